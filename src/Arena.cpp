@@ -0,0 +1,100 @@
+#include "Arena.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// =======================================================================
+// Class Arena
+
+static const size_t CHUNK_HEADER = 64; // multiple of the malloc alignment
+
+Arena::Arena (size_t chunkSize)
+{
+	Head = 0;
+	Ptr = End = 0;
+	ChunkSize = chunkSize;
+	nUsed = nReserved = nAlloc = nChunkAlloc = 0;
+}
+
+Arena::~Arena ()
+{
+	FreeChunks ();
+}
+
+void Arena::FreeChunks ()
+{
+	while (Head) {
+		Chunk *next = Head->Next;
+		free (Head);
+		Head = next;
+	}
+	Ptr = End = 0;
+	nReserved = 0;
+}
+
+Arena::Chunk *Arena::NewChunk (size_t size)
+{
+	Chunk *c = (Chunk*)malloc (CHUNK_HEADER + size);
+	if (!c) return 0;
+	c->Size = size;
+	nReserved += size;
+	nChunkAlloc++;
+	return c;
+}
+
+bool Arena::AddChunk (size_t size)
+{
+	if (size < ChunkSize) size = ChunkSize;
+	Chunk *c = NewChunk (size);
+	if (!c) return false;
+	c->Next = Head;
+	Head = c;
+	Ptr = (char*)c + CHUNK_HEADER;
+	End = Ptr + size;
+	return true;
+}
+
+static inline uintptr_t AlignUp (const void *p, size_t align)
+{
+	return ((uintptr_t)p + align-1) & ~(uintptr_t)(align-1);
+}
+
+void *Arena::Alloc (size_t size, size_t align)
+{
+	uintptr_t p = AlignUp (Ptr, align);
+	if (!Head || p + size > (uintptr_t)End) {
+		// chunk data is only aligned like malloc, so larger alignments need padding
+		size_t need = size + (align > alignof(max_align_t) ? align : 0);
+		if (Head && need > ChunkSize/4) {
+			// a large block gets a chunk of its own behind the current
+			// one, which stays open for small blocks
+			Chunk *c = NewChunk (need);
+			if (!c) return 0;
+			c->Next = Head->Next;
+			Head->Next = c;
+			p = AlignUp ((char*)c + CHUNK_HEADER, align);
+			nUsed += (p + size) - (uintptr_t)((char*)c + CHUNK_HEADER);
+			nAlloc++;
+			return (void*)p;
+		}
+		if (!AddChunk (need)) return 0;
+		p = AlignUp (Ptr, align);
+	}
+	nUsed += (p + size) - (uintptr_t)Ptr;
+	nAlloc++;
+	Ptr = (char*)(p + size);
+	return (void*)p;
+}
+
+void Arena::Reset ()
+{
+	if (Head && Head->Next) {
+		// coalesce into one chunk large enough for the last compile
+		size_t total = nReserved;
+		FreeChunks ();
+		AddChunk (total);
+	} else if (Head) {
+		Ptr = (char*)Head + CHUNK_HEADER;
+	}
+	nUsed = nAlloc = 0;
+}
@@ -0,0 +1,98 @@
+// =======================================================================
+// Class Arena
+// Monotonic allocator for the buffers of one compile. Allocations are
+// bumped out of large chunks and never freed individually; Reset makes
+// all memory available again (keeping it reserved for the next compile)
+// and the destructor releases it in one go.
+// An arena is not thread-safe. Use one per thread.
+// =======================================================================
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+#include <new>
+
+class Arena {
+public:
+	Arena (size_t chunkSize = 1 << 20);
+	~Arena ();
+
+	void *Alloc (size_t size, size_t align = 16);
+	// Return size bytes aligned to align (a power of 2),
+	// or 0 if out of memory
+
+	template<class T> T *New (size_t n)
+	{ return (T*)Alloc (n*sizeof(T), alignof(T) > 16 ? alignof(T) : 16); }
+	// Uninitialised array of n elements of a trivial type
+
+	void Reset ();
+	// Discard all allocations. If the previous compile needed several
+	// chunks they are replaced by one chunk of their total size, so that
+	// a compile of similar size runs out of a single chunk.
+
+	inline size_t Used () const { return nUsed; }
+	// bytes handed out since the last Reset, including alignment padding
+
+	inline size_t Reserved () const { return nReserved; }
+	// bytes held in chunks
+
+	inline size_t AllocCount () const { return nAlloc; }
+	// number of allocations since the last Reset
+
+	inline size_t ChunkCount () const { return nChunkAlloc; }
+	// number of chunks requested from the heap over the arena's lifetime
+
+private:
+	Arena (const Arena &);
+	Arena &operator= (const Arena &);
+
+	struct Chunk {
+		Chunk *Next;   // previously filled chunk
+		size_t Size;   // usable bytes after the header
+	};
+	Chunk *NewChunk (size_t size);
+	bool AddChunk (size_t size);
+	void FreeChunks ();
+
+	Chunk *Head;       // chunk currently allocated from
+	char *Ptr;         // next free byte in Head
+	char *End;         // end of Head
+	size_t ChunkSize;  // minimum size of a new chunk
+	size_t nUsed;
+	size_t nReserved;
+	size_t nAlloc;
+	size_t nChunkAlloc;
+};
+
+// =======================================================================
+// Helpers for code that works with or without an arena: objects and
+// arrays come from "arena" if it is given, and from the heap otherwise.
+// All return 0 if out of memory. ArenaDelete and ArenaDeleteArray only
+// release heap memory; arena memory is released by the arena.
+
+template<class T> T *ArenaNewArray (Arena *arena, size_t n)
+{
+	if (arena) return arena->New<T> (n);
+	return new(std::nothrow) T[n];
+}
+
+template<class T> void ArenaDeleteArray (Arena *arena, T *p)
+{
+	if (!arena) delete []p;
+}
+
+template<class T, class... A> T *ArenaNew (Arena *arena, A... args)
+{
+	if (!arena) return new(std::nothrow) T(args...);
+	void *p = arena->Alloc (sizeof(T), alignof(T));
+	return p ? new(p) T(args...) : 0;
+}
+
+template<class T> void ArenaDelete (Arena *arena, T *p)
+{
+	if (!arena) delete p;
+	else if (p) p->~T();
+}
+
+#endif // !__ARENA_H
@@ -0,0 +1,139 @@
+#include "Bvh.h"
+#include <algorithm>
+
+static const int NBIN = 16;          // centroid bins per axis
+static const float COST_TRAVERSE = 1.0f; // relative to one primitive test
+
+static inline void Grow (BvhBox &b, const BvhBox &a)
+{
+	for (int i = 0; i < 3; i++) {
+		if (a.Min[i] < b.Min[i]) b.Min[i] = a.Min[i];
+		if (a.Max[i] > b.Max[i]) b.Max[i] = a.Max[i];
+	}
+}
+
+static inline void Empty (BvhBox &b)
+{
+	b.Min[0] = b.Min[1] = b.Min[2] = 3.0e38f;
+	b.Max[0] = b.Max[1] = b.Max[2] = -3.0e38f;
+}
+
+static inline float HalfArea (const BvhBox &b)
+{
+	float dx = b.Max[0]-b.Min[0], dy = b.Max[1]-b.Min[1], dz = b.Max[2]-b.Min[2];
+	return dx < 0.0f ? 0.0f : dx*dy + dy*dz + dz*dx;
+}
+
+struct BvhBuilder {
+	const BvhBox *box;
+	std::vector<float> centre;       // 3 per primitive
+	std::vector<cmsh2_bvh_node> &node;
+	std::vector<uint32_t> &order;
+	uint32_t maxLeaf;
+
+	BvhBuilder (const BvhBox *b, uint32_t count, uint32_t leaf,
+		std::vector<cmsh2_bvh_node> &n, std::vector<uint32_t> &o)
+		: box(b), centre(3*count), node(n), order(o), maxLeaf(leaf)
+	{
+		for (uint32_t i = 0; i < count; i++)
+			for (int k = 0; k < 3; k++)
+				centre[3*i+k] = 0.5f*(box[i].Min[k]+box[i].Max[k]);
+	}
+
+	void Build (uint32_t begin, uint32_t end, uint32_t depth)
+	{
+		uint32_t i, n = end-begin, idx = (uint32_t)node.size();
+		int k, b;
+		node.push_back (cmsh2_bvh_node());
+		BvhBox bounds, cbounds;
+		Empty (bounds); Empty (cbounds);
+		for (i = begin; i < end; i++) {
+			Grow (bounds, box[order[i]]);
+			const float *c = &centre[3*order[i]];
+			BvhBox cb = { { c[0], c[1], c[2] }, { c[0], c[1], c[2] } };
+			Grow (cbounds, cb);
+		}
+		for (k = 0; k < 3; k++) {
+			node[idx].Min[k] = bounds.Min[k];
+			node[idx].Max[k] = bounds.Max[k];
+		}
+
+		// find the cheapest split plane over all axes and bins
+		float bestCost = 3.0e38f;
+		int bestAxis = -1, bestBin = 0;
+		if (n > 1 && depth+1 < CMSH2_BVH_MAX_DEPTH) {
+			for (k = 0; k < 3; k++) {
+				float lo = cbounds.Min[k], ext = cbounds.Max[k]-lo;
+				if (ext <= 0.0f) continue;
+				float scale = NBIN/ext;
+				BvhBox bin[NBIN];
+				uint32_t cnt[NBIN] = { 0 };
+				for (b = 0; b < NBIN; b++) Empty (bin[b]);
+				for (i = begin; i < end; i++) {
+					b = std::min (NBIN-1, (int)((centre[3*order[i]+k]-lo)*scale));
+					cnt[b]++;
+					Grow (bin[b], box[order[i]]);
+				}
+				float rarea[NBIN];
+				uint32_t rcnt[NBIN];
+				BvhBox acc;
+				Empty (acc);
+				uint32_t c = 0;
+				for (b = NBIN-1; b > 0; b--) {
+					Grow (acc, bin[b]);
+					c += cnt[b];
+					rarea[b] = HalfArea (acc);
+					rcnt[b] = c;
+				}
+				Empty (acc);
+				c = 0;
+				for (b = 0; b < NBIN-1; b++) {
+					Grow (acc, bin[b]);
+					c += cnt[b];
+					if (!c || !rcnt[b+1]) continue;
+					float cost = HalfArea (acc)*c + rarea[b+1]*rcnt[b+1];
+					if (cost < bestCost) bestCost = cost, bestAxis = k, bestBin = b;
+				}
+			}
+		}
+
+		float area = HalfArea (bounds);
+		float splitCost = area > 0.0f ? COST_TRAVERSE + bestCost/area : 3.0e38f;
+		if (bestAxis < 0 || (n <= maxLeaf && splitCost >= (float)n)) {
+			if (n > maxLeaf && bestAxis < 0 && depth+1 < CMSH2_BVH_MAX_DEPTH) {
+				// identical centroids: split by count
+				uint32_t mid = begin + n/2;
+				node[idx].Count = 0;
+				Build (begin, mid, depth+1);
+				node[idx].Index = (uint32_t)node.size();
+				Build (mid, end, depth+1);
+				return;
+			}
+			node[idx].Index = begin;
+			node[idx].Count = n;
+			return;
+		}
+
+		float lo = cbounds.Min[bestAxis], scale = NBIN/(cbounds.Max[bestAxis]-lo);
+		const float *cen = centre.data();
+		uint32_t *mid = std::partition (order.data()+begin, order.data()+end, [=](uint32_t p) {
+			return std::min (NBIN-1, (int)((cen[3*p+bestAxis]-lo)*scale)) <= bestBin;
+		});
+		node[idx].Count = 0;
+		Build (begin, (uint32_t)(mid-order.data()), depth+1);
+		node[idx].Index = (uint32_t)node.size();
+		Build ((uint32_t)(mid-order.data()), end, depth+1);
+	}
+};
+
+void BuildBvh (const BvhBox *box, uint32_t count, uint32_t maxLeaf,
+	std::vector<cmsh2_bvh_node> &node, std::vector<uint32_t> &order)
+{
+	node.clear ();
+	order.resize (count);
+	for (uint32_t i = 0; i < count; i++) order[i] = i;
+	if (!count) return;
+	node.reserve (2*count);
+	BvhBuilder builder (box, count, maxLeaf ? maxLeaf : 1, node, order);
+	builder.Build (0, count, 0);
+}
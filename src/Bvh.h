@@ -0,0 +1,25 @@
+// =======================================================================
+// Construction of bounding volume hierarchies with the surface area
+// heuristic (SAH), evaluated over centroid bins. The result uses the
+// flattened node layout of the CMSH format (cmsh2_bvh_node).
+// =======================================================================
+
+#ifndef __BVH_H
+#define __BVH_H
+
+#include <vector>
+#include "CmshFormat.h"
+
+struct BvhBox {
+	float Min[3];
+	float Max[3];
+};
+
+void BuildBvh (const BvhBox *box, uint32_t count, uint32_t maxLeaf,
+	std::vector<cmsh2_bvh_node> &node, std::vector<uint32_t> &order);
+// Build a hierarchy over count primitives with the given bounding boxes.
+// Leaves hold at most maxLeaf primitives, fewer if the SAH prefers it.
+// order receives the primitive indices in leaf order; leaf primitive
+// ranges in node refer to positions in order.
+
+#endif // !__BVH_H
@@ -0,0 +1,263 @@
+// =======================================================================
+// CMSH version 2 file format (_CMSHX2_).
+// All fields have fixed widths and natural alignment, and all structures
+// are little-endian, so the file can be memory-mapped and used in place.
+// Every section, vertex stream and index array starts at a multiple of
+// cmsh2_header::Alignment and is zero-padded to the next such multiple.
+// Only depends on <stdint.h>, so loaders can include it directly.
+// =======================================================================
+
+#ifndef __CMSHFORMAT_H
+#define __CMSHFORMAT_H
+
+#include <stdint.h>
+
+#define CMSH2_MAGIC "_CMSHX2_"
+
+// True on little-endian hosts. Structures are written and used in place in
+// host byte order, so writers and loaders must check this before using the
+// format.
+inline bool Cmsh2LittleEndianHost ()
+{
+	const uint16_t one = 1;
+	return *(const uint8_t*)&one == 1;
+}
+
+const uint32_t CMSH2_MAX_STREAMS = 8;
+
+// Section types
+enum {
+	CMSH2_SECTION_STRINGS = 1,        // string table (char[])
+	CMSH2_SECTION_STREAMS,            // cmsh2_stream[StreamCount]
+	CMSH2_SECTION_GROUPS,             // cmsh2_group[GroupCount]
+	CMSH2_SECTION_MATERIALS,          // cmsh2_material[MaterialCount]
+	CMSH2_SECTION_TEXTURES,           // uint32_t NameOffset[TextureCount]
+	CMSH2_SECTION_GEOMETRY,           // vertex streams and index arrays of all groups
+	CMSH2_SECTION_GROUP_REMAP,        // cmsh2_group_remap[] (see -merge)
+	CMSH2_SECTION_LABEL_INDEX,        // name index over group labels
+	CMSH2_SECTION_MATERIAL_INDEX,     // name index over material names
+	CMSH2_SECTION_WELDED,             // cmsh2_welded_group[GroupCount] (see -weld)
+	CMSH2_SECTION_ADJACENCY,          // cmsh2_adjacency_group[GroupCount] (see -adjacency)
+	CMSH2_SECTION_BVH,                // cmsh2_bvh (see -bvh)
+	CMSH2_SECTION_GROUP_BVH           // cmsh2_group_bvh (see -groupbvh)
+};
+
+// Vertex attributes. Attributes in a stream are stored in this order.
+enum {
+	CMSH2_ATTR_POSITION = 0x01,       // float x, y, z
+	CMSH2_ATTR_NORMAL   = 0x02,       // float nx, ny, nz
+	CMSH2_ATTR_UV       = 0x04,       // float tu, tv
+	CMSH2_ATTR_TANGENT  = 0x08        // float x, y, z, w (w = bitangent sign)
+};
+
+struct cmsh2_header {
+	char     Magic[8];       // CMSH2_MAGIC, not null-terminated
+	uint32_t HeaderSize;     // sizeof(cmsh2_header)
+	uint32_t Flags;          // reserved, 0
+	uint32_t Alignment;      // power of 2
+	uint32_t GroupCount;
+	uint32_t MaterialCount;
+	uint32_t TextureCount;
+	uint32_t StreamCount;    // number of vertex streams of each group
+	uint32_t SectionCount;   // number of cmsh2_section entries after the header
+	uint32_t VertexBlock;    // vertices per block in blocked streams, 0 = not blocked
+	uint32_t Reserved;
+	uint64_t FileSize;
+};
+
+// Blocked vertex streams (VertexBlock = n > 0) store the vertices in blocks
+// of n, one component at a time: x[n] y[n] z[n] nx[n] ... The last block is
+// padded with copies of the last vertex. A stream of a group with v
+// vertices and stride s then takes ((v+n-1)/n)*n*s bytes.
+
+struct cmsh2_section {
+	uint32_t Type;           // CMSH2_SECTION_*
+	uint32_t Reserved;
+	uint64_t Offset;         // from the start of the file
+	uint64_t Size;           // in bytes, without padding
+};
+
+struct cmsh2_stream {
+	uint32_t Attributes;     // CMSH2_ATTR_* bits
+	uint32_t Stride;         // bytes per vertex
+};
+
+struct cmsh2_group {
+	uint32_t NameOffset;     // label in the string table, 0 = none
+	int32_t  MaterialIndex;
+	int32_t  TextureIndex;
+	uint32_t Flags;
+	uint32_t UserFlags;
+	uint32_t ZBias;
+	uint32_t VertexCount;
+	uint32_t IndexCount;
+	uint32_t Attributes;     // CMSH2_ATTR_* bits present in this group
+	uint32_t Reserved;
+	uint64_t IndexOffset;    // uint32_t[IndexCount]
+	uint64_t StreamOffset[CMSH2_MAX_STREAMS];
+	// One per stream. A stream of this group holds only the attributes of
+	// cmsh2_stream::Attributes that are also in Attributes, so its stride
+	// may be smaller. 0 if none of them is, and beyond StreamCount.
+};
+
+// Position-only geometry of a group, with all vertices of equal position
+// welded into one, for depth and shadow passes. Triangles that became
+// degenerate are removed. Positions are blocked like the vertex streams.
+struct cmsh2_welded_group {
+	uint32_t VertexCount;
+	uint32_t IndexCount;
+	uint64_t PositionOffset; // vtx3[VertexCount]
+	uint64_t IndexOffset;    // uint32_t[IndexCount]
+};
+
+const uint32_t CMSH2_NO_TRIANGLE = 0xFFFFFFFF;
+
+// Edge of the welded geometry of a group. Triangle[0] contains the edge
+// in the direction Vertex[0] -> Vertex[1], Triangle[1] in the opposite
+// direction, or CMSH2_NO_TRIANGLE.
+struct cmsh2_edge {
+	uint32_t Vertex[2];
+	uint32_t Triangle[2];
+};
+
+// Edge adjacency of the welded geometry of a group, for shadow volumes.
+// The edges are sorted into three ranges: EdgeCount-OpenCount-NonManifoldCount
+// manifold edges shared by two triangles of opposite winding, then
+// OpenCount open edges used by one triangle, then NonManifoldCount records
+// for edges used by more than two triangles or by two of the same winding,
+// one record for each of those triangles (Triangle[1] = CMSH2_NO_TRIANGLE).
+struct cmsh2_adjacency_group {
+	uint32_t EdgeCount;
+	uint32_t OpenCount;
+	uint32_t NonManifoldCount;
+	uint32_t TriangleCount;  // number of welded triangles
+	uint64_t EdgeOffset;     // cmsh2_edge[EdgeCount]
+	uint64_t NormalOffset;   // vtx3[TriangleCount] unit face normals (0 if degenerate)
+};
+
+const uint32_t CMSH2_BVH_MAX_DEPTH = 64; // bounds the query traversal stack
+
+// Node of a bounding volume hierarchy. Nodes are stored depth first: the
+// first child of an inner node follows it, the second is at Index.
+struct cmsh2_bvh_node {
+	float    Min[3];
+	uint32_t Index;          // inner node: second child, leaf: first primitive
+	float    Max[3];
+	uint32_t Count;          // 0 for inner nodes, else number of primitives
+};
+
+// Triangle of the mesh BVH, stored in leaf order with its first vertex and
+// the edges to the other two, ready for ray intersection.
+struct cmsh2_bvh_triangle {
+	float    V0[3];
+	float    E1[3];          // V1 - V0
+	float    E2[3];          // V2 - V0
+	uint32_t Group;
+	uint32_t Triangle;       // triangle number in the group's index list
+	uint32_t Reserved;
+};
+
+// Triangle BVH over all groups of the mesh
+struct cmsh2_bvh {
+	uint32_t NodeCount;
+	uint32_t TriangleCount;
+	uint64_t NodeOffset;     // cmsh2_bvh_node[NodeCount], root first
+	uint64_t TriangleOffset; // cmsh2_bvh_triangle[TriangleCount]
+};
+
+// Bounding sphere of a group, stored in leaf order of the group BVH
+struct cmsh2_group_bound {
+	float    Centre[3];
+	float    Radius;
+	uint32_t Group;
+};
+
+// Hierarchy over the group bounding spheres, for culling groups by branch
+struct cmsh2_group_bvh {
+	uint32_t NodeCount;
+	uint32_t GroupCount;
+	uint64_t NodeOffset;     // cmsh2_bvh_node[NodeCount], root first
+	uint64_t BoundOffset;    // cmsh2_group_bound[GroupCount]
+};
+
+struct cmsh2_material {
+	uint32_t NameOffset;     // name in the string table, 0 = none
+	float    Diffuse[4];
+	float    Ambient[3];
+	float    Specular[3];
+	float    Emissive[3];
+	float    Power;
+};
+
+struct cmsh2_group_remap {
+	uint32_t Group;
+	uint32_t VertexOffset;
+	uint32_t VertexCount;
+	uint32_t IndexOffset;
+	uint32_t IndexCount;
+};
+
+static_assert (sizeof(cmsh2_header) == 56, "cmsh2_header layout");
+static_assert (sizeof(cmsh2_section) == 24, "cmsh2_section layout");
+static_assert (sizeof(cmsh2_stream) == 8, "cmsh2_stream layout");
+static_assert (sizeof(cmsh2_group) == 112, "cmsh2_group layout");
+static_assert (sizeof(cmsh2_welded_group) == 24, "cmsh2_welded_group layout");
+static_assert (sizeof(cmsh2_edge) == 16, "cmsh2_edge layout");
+static_assert (sizeof(cmsh2_adjacency_group) == 32, "cmsh2_adjacency_group layout");
+static_assert (sizeof(cmsh2_bvh_node) == 32, "cmsh2_bvh_node layout");
+static_assert (sizeof(cmsh2_bvh_triangle) == 48, "cmsh2_bvh_triangle layout");
+static_assert (sizeof(cmsh2_bvh) == 24, "cmsh2_bvh layout");
+static_assert (sizeof(cmsh2_group_bound) == 20, "cmsh2_group_bound layout");
+static_assert (sizeof(cmsh2_group_bvh) == 24, "cmsh2_group_bvh layout");
+static_assert (sizeof(cmsh2_material) == 60, "cmsh2_material layout");
+static_assert (sizeof(cmsh2_group_remap) == 20, "cmsh2_group_remap layout");
+
+// =======================================================================
+// Sphere patch archive (_CMSHA1_), written by the -patches generator: a
+// header, a table of tiles, and the CMSH files of the tiles (version 1 or
+// 2), each starting at a multiple of Alignment. Offsets inside a tile
+// are relative to the start of the tile.
+// =======================================================================
+
+#define CMSH_ARCHIVE_MAGIC "_CMSHA1_"
+
+struct cmsh_archive_header {
+	char     Magic[8];       // CMSH_ARCHIVE_MAGIC
+	uint32_t TileCount;      // NLat*NLng
+	uint32_t NLng;           // patches per latitude band
+	uint32_t NLat;           // latitude bands per hemisphere
+	uint32_t Res;            // latitude resolution of a patch
+	uint32_t Flags;          // CMSH_ARCHIVE_INSIDE
+	uint32_t Alignment;
+};
+
+const uint32_t CMSH_ARCHIVE_INSIDE = 0x01; // patches face the sphere centre
+
+// Tile entry, in the order ilat*NLng + ilng
+struct cmsh_archive_tile {
+	uint32_t Lat;            // latitude band, 0 at the equator
+	uint32_t Lng;            // longitude index, 0 at longitude 0
+	uint64_t Offset;         // file offset of the tile's CMSH file
+	uint64_t Size;
+};
+
+static_assert (sizeof(cmsh_archive_header) == 32, "cmsh_archive_header layout");
+static_assert (sizeof(cmsh_archive_tile) == 24, "cmsh_archive_tile layout");
+
+// Size in bytes of the attributes in mask
+inline uint32_t Cmsh2AttributeSize (uint32_t mask)
+{
+	return (mask & CMSH2_ATTR_POSITION ? 12 : 0) + (mask & CMSH2_ATTR_NORMAL ? 12 : 0) +
+		(mask & CMSH2_ATTR_UV ? 8 : 0) + (mask & CMSH2_ATTR_TANGENT ? 16 : 0);
+}
+
+// Return the directory entry of a section, or 0 if the file has none
+inline const cmsh2_section *Cmsh2FindSection (const cmsh2_header *hdr, uint32_t type)
+{
+	const cmsh2_section *sec = (const cmsh2_section*)((const char*)hdr + hdr->HeaderSize);
+	for (uint32_t i = 0; i < hdr->SectionCount; i++)
+		if (sec[i].Type == type) return sec+i;
+	return 0;
+}
+
+#endif // !__CMSHFORMAT_H
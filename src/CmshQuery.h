@@ -0,0 +1,236 @@
+// =======================================================================
+// Ray and sphere queries against the triangle BVH of a CMSH version 2
+// file (section CMSH2_SECTION_BVH), and culling against the group BVH
+// (section CMSH2_SECTION_GROUP_BVH). Header only and free of Windows
+// dependencies, so loaders can use it on the mapped file directly:
+//
+//   const cmsh2_bvh *bvh = (const cmsh2_bvh*)(base + sec->Offset);
+//   const cmsh2_bvh_node *node = (const cmsh2_bvh_node*)(base + bvh->NodeOffset);
+//   const cmsh2_bvh_triangle *tri = (const cmsh2_bvh_triangle*)(base + bvh->TriangleOffset);
+// =======================================================================
+
+#ifndef __CMSHQUERY_H
+#define __CMSHQUERY_H
+
+#include "CmshFormat.h"
+
+struct cmsh2_ray_hit {
+	float    Distance;               // along the ray, in units of dir
+	float    U, V;                   // barycentric coordinates of the hit
+	uint32_t Group;
+	uint32_t Triangle;               // triangle number in the group
+};
+
+// Moeller-Trumbore test of a ray against one triangle, both faces.
+// Returns the distance if it is in (0, tmax), else tmax.
+inline float Cmsh2RayTriangle (const cmsh2_bvh_triangle &t, const float org[3],
+	const float dir[3], float tmax, float &u, float &v)
+{
+	float p[3] = { dir[1]*t.E2[2]-dir[2]*t.E2[1], dir[2]*t.E2[0]-dir[0]*t.E2[2], dir[0]*t.E2[1]-dir[1]*t.E2[0] };
+	float det = t.E1[0]*p[0] + t.E1[1]*p[1] + t.E1[2]*p[2];
+	if (det > -1e-12f && det < 1e-12f) return tmax;
+	float idet = 1.0f/det;
+	float s[3] = { org[0]-t.V0[0], org[1]-t.V0[1], org[2]-t.V0[2] };
+	float uu = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2])*idet;
+	if (uu < 0.0f || uu > 1.0f) return tmax;
+	float q[3] = { s[1]*t.E1[2]-s[2]*t.E1[1], s[2]*t.E1[0]-s[0]*t.E1[2], s[0]*t.E1[1]-s[1]*t.E1[0] };
+	float vv = (dir[0]*q[0] + dir[1]*q[1] + dir[2]*q[2])*idet;
+	if (vv < 0.0f || uu+vv > 1.0f) return tmax;
+	float d = (t.E2[0]*q[0] + t.E2[1]*q[1] + t.E2[2]*q[2])*idet;
+	if (d <= 0.0f || d >= tmax) return tmax;
+	u = uu, v = vv;
+	return d;
+}
+
+// Slab test of a ray (given by origin and inverse direction) against a
+// node box. Returns the entry distance, or a negative value on a miss.
+inline float Cmsh2RayBox (const cmsh2_bvh_node &n, const float org[3],
+	const float idir[3], float tmax)
+{
+	float t0 = 0.0f, t1 = tmax;
+	for (int i = 0; i < 3; i++) {
+		float a = (n.Min[i]-org[i])*idir[i];
+		float b = (n.Max[i]-org[i])*idir[i];
+		if (a > b) { float c = a; a = b; b = c; }
+		if (a > t0) t0 = a;
+		if (b < t1) t1 = b;
+		if (t0 > t1) return -1.0f;
+	}
+	return t0;
+}
+
+// Find the nearest triangle hit by the ray org + t*dir with 0 < t < tmax.
+// Returns false if there is none.
+inline bool Cmsh2RayQuery (const cmsh2_bvh_node *node, const cmsh2_bvh_triangle *tri,
+	const float org[3], const float dir[3], float tmax, cmsh2_ray_hit &hit)
+{
+	float idir[3];
+	for (int i = 0; i < 3; i++)
+		idir[i] = dir[i] != 0.0f ? 1.0f/dir[i] : 3.0e38f;
+	uint32_t stack[CMSH2_BVH_MAX_DEPTH];
+	int sp = 0;
+	uint32_t cur = 0;
+	bool found = false;
+	if (Cmsh2RayBox (node[0], org, idir, tmax) < 0.0f) return false;
+	for (;;) {
+		const cmsh2_bvh_node &n = node[cur];
+		if (n.Count) {
+			for (uint32_t i = n.Index; i < n.Index+n.Count; i++) {
+				float u, v, d = Cmsh2RayTriangle (tri[i], org, dir, tmax, u, v);
+				if (d < tmax) {
+					tmax = d;
+					hit.Distance = d, hit.U = u, hit.V = v;
+					hit.Group = tri[i].Group, hit.Triangle = tri[i].Triangle;
+					found = true;
+				}
+			}
+		} else {
+			uint32_t a = cur+1, b = n.Index;
+			float da = Cmsh2RayBox (node[a], org, idir, tmax);
+			float db = Cmsh2RayBox (node[b], org, idir, tmax);
+			if (da >= 0.0f && db >= 0.0f) {
+				if (db < da) { uint32_t c = a; a = b; b = c; }
+				stack[sp++] = b;
+				cur = a;
+				continue;
+			}
+			if (da >= 0.0f) { cur = a; continue; }
+			if (db >= 0.0f) { cur = b; continue; }
+		}
+		if (!sp) break;
+		cur = stack[--sp];
+	}
+	return found;
+}
+
+// Squared distance from point p to a triangle (Ericson, Real-Time
+// Collision Detection, 5.1.5)
+inline float Cmsh2PointTriangleDist2 (const cmsh2_bvh_triangle &t, const float p[3])
+{
+	const float *ab = t.E1, *ac = t.E2;
+	float ap[3] = { p[0]-t.V0[0], p[1]-t.V0[1], p[2]-t.V0[2] };
+	float d1 = ab[0]*ap[0]+ab[1]*ap[1]+ab[2]*ap[2];
+	float d2 = ac[0]*ap[0]+ac[1]*ap[1]+ac[2]*ap[2];
+	float s, w;                      // closest point V0 + s*ab + w*ac
+	if (d1 <= 0.0f && d2 <= 0.0f) s = 0.0f, w = 0.0f;
+	else {
+		float bp[3] = { ap[0]-ab[0], ap[1]-ab[1], ap[2]-ab[2] };
+		float d3 = ab[0]*bp[0]+ab[1]*bp[1]+ab[2]*bp[2];
+		float d4 = ac[0]*bp[0]+ac[1]*bp[1]+ac[2]*bp[2];
+		float cp[3] = { ap[0]-ac[0], ap[1]-ac[1], ap[2]-ac[2] };
+		float d5 = ab[0]*cp[0]+ab[1]*cp[1]+ab[2]*cp[2];
+		float d6 = ac[0]*cp[0]+ac[1]*cp[1]+ac[2]*cp[2];
+		float vc = d1*d4 - d3*d2, vb = d5*d2 - d1*d6, va = d3*d6 - d5*d4;
+		if (d3 >= 0.0f && d4 <= d3) s = 1.0f, w = 0.0f;
+		else if (d6 >= 0.0f && d5 <= d6) s = 0.0f, w = 1.0f;
+		else if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) s = d1/(d1-d3), w = 0.0f;
+		else if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) s = 0.0f, w = d2/(d2-d6);
+		else if (va <= 0.0f && d4-d3 >= 0.0f && d5-d6 >= 0.0f) {
+			w = (d4-d3)/((d4-d3)+(d5-d6));
+			s = 1.0f-w;
+		} else {
+			float den = 1.0f/(va+vb+vc);
+			s = vb*den, w = vc*den;
+		}
+	}
+	float d[3];
+	for (int i = 0; i < 3; i++) d[i] = ap[i] - s*ab[i] - w*ac[i];
+	return d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+}
+
+// Collect the triangles touching the sphere with given centre and radius.
+// Writes up to maxHit BVH triangle indices to hit and returns the total
+// number of triangles found, which may exceed maxHit.
+inline uint32_t Cmsh2SphereQuery (const cmsh2_bvh_node *node, const cmsh2_bvh_triangle *tri,
+	const float centre[3], float radius, uint32_t *hit, uint32_t maxHit)
+{
+	uint32_t stack[CMSH2_BVH_MAX_DEPTH];
+	int sp = 0;
+	uint32_t cur = 0, count = 0;
+	float r2 = radius*radius;
+	for (;;) {
+		const cmsh2_bvh_node &n = node[cur];
+		float d2 = 0.0f;
+		for (int i = 0; i < 3; i++) {
+			float d = centre[i] < n.Min[i] ? n.Min[i]-centre[i] : centre[i] > n.Max[i] ? centre[i]-n.Max[i] : 0.0f;
+			d2 += d*d;
+		}
+		if (d2 <= r2) {
+			if (n.Count) {
+				for (uint32_t i = n.Index; i < n.Index+n.Count; i++)
+					if (Cmsh2PointTriangleDist2 (tri[i], centre) <= r2) {
+						if (count < maxHit) hit[count] = i;
+						count++;
+					}
+			} else {
+				stack[sp++] = n.Index;
+				cur++;
+				continue;
+			}
+		}
+		if (!sp) break;
+		cur = stack[--sp];
+	}
+	return count;
+}
+
+// Cull the groups against a convex volume, e.g. a view frustum, given by
+// planeCount planes (nx, ny, nz, d) with nx*x + ny*y + nz*z + d >= 0 on the
+// inside. Branches entirely inside or outside the volume are accepted or
+// rejected as a whole. Writes the indices of the groups whose bounding
+// spheres intersect the volume to visible (room for GroupCount entries) and
+// returns their number. tests receives the number of node and sphere
+// tests made, for comparison with testing every group.
+inline uint32_t Cmsh2CullGroups (const cmsh2_bvh_node *node, const cmsh2_group_bound *bound,
+	const float (*plane)[4], int planeCount, uint32_t *visible, uint32_t &tests)
+{
+	uint32_t stack[CMSH2_BVH_MAX_DEPTH];
+	int sp = 0;
+	uint32_t cur = 0, count = 0;
+	tests = 0;
+	for (;;) {
+		const cmsh2_bvh_node &n = node[cur];
+		bool outside = false, inside = true;
+		tests++;
+		for (int i = 0; i < planeCount && !outside; i++) {
+			const float *p = plane[i];
+			float dmin = p[3], dmax = p[3];  // distances of the box corners least and most inside
+			for (int k = 0; k < 3; k++) {
+				if (p[k] >= 0.0f) dmin += p[k]*n.Min[k], dmax += p[k]*n.Max[k];
+				else              dmin += p[k]*n.Max[k], dmax += p[k]*n.Min[k];
+			}
+			if (dmax < 0.0f) outside = true;
+			else if (dmin < 0.0f) inside = false;
+		}
+		if (!outside) {
+			if (inside) {
+				// accept the whole branch: its leaves are contiguous
+				uint32_t first = cur, last = cur;
+				while (!node[first].Count) first++;
+				while (!node[last].Count) last = node[last].Index;
+				for (uint32_t i = node[first].Index; i < node[last].Index+node[last].Count; i++)
+					visible[count++] = bound[i].Group;
+			} else if (n.Count) {
+				for (uint32_t i = n.Index; i < n.Index+n.Count; i++) {
+					const cmsh2_group_bound &b = bound[i];
+					bool vis = true;
+					tests++;
+					for (int j = 0; j < planeCount && vis; j++) {
+						const float *p = plane[j];
+						vis = p[0]*b.Centre[0] + p[1]*b.Centre[1] + p[2]*b.Centre[2] + p[3] >= -b.Radius;
+					}
+					if (vis) visible[count++] = b.Group;
+				}
+			} else {
+				stack[sp++] = n.Index;
+				cur++;
+				continue;
+			}
+		}
+		if (!sp) break;
+		cur = stack[--sp];
+	}
+	return count;
+}
+
+#endif // !__CMSHQUERY_H
@@ -16,6 +16,11 @@
 #include <math.h>
 #include <stdio.h>
 #include "D3DMath.h"
+#include "Simd.h"
+
+// The batch functions match the single-item functions bit for bit only if
+// neither is compiled with fused multiply-adds
+SIMD_NO_FP_CONTRACT
 
 VOID VMAT_rotx (D3DMATRIX &a, double r)
 {
@@ -379,7 +384,7 @@ VOID D3DMath_QuaternionSlerp( FLOAT& Qx, FLOAT& Qy, FLOAT& Qz, FLOAT& Qw,
     if( fCosTheta < 0.0f )
     {
         // Flip start quaternion
-        Ax = -Ax; Ay = -Ay; Ax = -Az; Aw = -Aw;
+        Ax = -Ax; Ay = -Ay; Az = -Az; Aw = -Aw;
         fCosTheta = -fCosTheta;
     }
 
@@ -418,3 +423,525 @@ VOID D3DMath_QuaternionSlerp( FLOAT& Qx, FLOAT& Qy, FLOAT& Qz, FLOAT& Qw,
 
 
 
+
+#ifdef SIMD_SSE2
+//-----------------------------------------------------------------------------
+// Helpers for the batch functions. Vectors and quaternions are loaded four
+// at a time and transposed so that each register holds one component of
+// four items.
+//-----------------------------------------------------------------------------
+
+// x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3  ->  x0..x3 | y0..y3 | z0..z3
+static inline void Transpose3x4( __m128 r0, __m128 r1, __m128 r2,
+                                 __m128& x, __m128& y, __m128& z )
+{
+    __m128 t0 = _mm_shuffle_ps( r1, r2, _MM_SHUFFLE(2,1,3,2) ); // x2 y2 x3 y3
+    __m128 t1 = _mm_shuffle_ps( r0, r1, _MM_SHUFFLE(1,0,2,1) ); // y0 z0 y1 z1
+    x = _mm_shuffle_ps( r0, t0, _MM_SHUFFLE(2,0,3,0) );
+    y = _mm_shuffle_ps( t1, t0, _MM_SHUFFLE(3,1,2,0) );
+    z = _mm_shuffle_ps( t1, r2, _MM_SHUFFLE(3,0,3,1) );
+}
+
+// Inverse of Transpose3x4
+static inline void Untranspose3x4( __m128 x, __m128 y, __m128 z,
+                                   __m128& r0, __m128& r1, __m128& r2 )
+{
+    __m128 xy0 = _mm_shuffle_ps( x, y, _MM_SHUFFLE(2,0,2,0) );   // x0 x2 y0 y2
+    __m128 xy1 = _mm_shuffle_ps( x, y, _MM_SHUFFLE(3,1,3,1) );   // x1 x3 y1 y3
+    __m128 zx  = _mm_shuffle_ps( z, xy1, _MM_SHUFFLE(1,0,2,0) ); // z0 z2 x1 x3
+    __m128 yz  = _mm_shuffle_ps( xy1, z, _MM_SHUFFLE(3,1,3,2) ); // y1 y3 z1 z3
+    r0 = _mm_shuffle_ps( xy0, zx, _MM_SHUFFLE(2,0,2,0) );
+    r1 = _mm_shuffle_ps( yz, xy0, _MM_SHUFFLE(3,1,2,0) );
+    r2 = _mm_shuffle_ps( zx, yz, _MM_SHUFFLE(3,1,3,1) );
+}
+
+static inline void LoadQuaternions( const D3DMATH_QUATERNION* pSrc,
+                                    __m128& x, __m128& y, __m128& z, __m128& w )
+{
+    const float* p = (const float*)pSrc;
+    x = _mm_loadu_ps( p );
+    y = _mm_loadu_ps( p+4 );
+    z = _mm_loadu_ps( p+8 );
+    w = _mm_loadu_ps( p+12 );
+    _MM_TRANSPOSE4_PS( x, y, z, w );
+}
+
+// acos(c) for 0 <= c <= 1 (Abramowitz & Stegun 4.4.46, error < 2e-8 rad)
+static inline __m128 AcosPoly( __m128 c )
+{
+    __m128 p = _mm_set1_ps( -0.0012624911f );
+    p = _mm_add_ps( _mm_mul_ps( p, c ), _mm_set1_ps(  0.0066700901f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, c ), _mm_set1_ps( -0.0170881256f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, c ), _mm_set1_ps(  0.0308918810f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, c ), _mm_set1_ps( -0.0501743046f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, c ), _mm_set1_ps(  0.0889789874f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, c ), _mm_set1_ps( -0.2145988016f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, c ), _mm_set1_ps(  1.5707963050f ) );
+    return _mm_mul_ps( p, _mm_sqrt_ps( _mm_sub_ps( _mm_set1_ps( 1.0f ), c ) ) );
+}
+
+// sin(x), reduced to [-Pi/2,Pi/2] and evaluated with the Taylor series up
+// to x^11 (error < 6e-8)
+static inline __m128 SinPoly( __m128 x )
+{
+    const __m128 sign = _mm_set1_ps( -0.0f );
+    __m128 k = _mm_cvtepi32_ps( _mm_cvtps_epi32( _mm_mul_ps( x, _mm_set1_ps( 0.5f*g_INV_PI ) ) ) );
+    x = _mm_sub_ps( x, _mm_mul_ps( k, _mm_set1_ps( 6.28125f ) ) );
+    x = _mm_sub_ps( x, _mm_mul_ps( k, _mm_set1_ps( 1.9353071795864769e-3f ) ) );
+    __m128 s  = _mm_and_ps( x, sign );
+    __m128 ax = _mm_xor_ps( x, s );
+    __m128 fold = _mm_cmpgt_ps( ax, _mm_set1_ps( g_PI_DIV_2 ) );
+    ax = _mm_or_ps( _mm_and_ps( fold, _mm_sub_ps( _mm_set1_ps( g_PI ), ax ) ),
+                    _mm_andnot_ps( fold, ax ) );
+    x = _mm_xor_ps( ax, s );
+    __m128 x2 = _mm_mul_ps( x, x );
+    __m128 p = _mm_set1_ps( -2.5052108e-8f );
+    p = _mm_add_ps( _mm_mul_ps( p, x2 ), _mm_set1_ps(  2.7557319e-6f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, x2 ), _mm_set1_ps( -1.9841270e-4f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, x2 ), _mm_set1_ps(  8.3333333e-3f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, x2 ), _mm_set1_ps( -1.6666667e-1f ) );
+    return _mm_add_ps( x, _mm_mul_ps( _mm_mul_ps( p, x2 ), x ) );
+}
+#endif // SIMD_SSE2
+
+#ifdef SIMD_AVX
+// Transpose3x4 on both 128-bit lanes: lane 0 holds items 0-3, lane 1 items 4-7
+static inline void Transpose3x8( __m256 r0, __m256 r1, __m256 r2,
+                                 __m256& x, __m256& y, __m256& z )
+{
+    __m256 t0 = _mm256_shuffle_ps( r1, r2, _MM_SHUFFLE(2,1,3,2) );
+    __m256 t1 = _mm256_shuffle_ps( r0, r1, _MM_SHUFFLE(1,0,2,1) );
+    x = _mm256_shuffle_ps( r0, t0, _MM_SHUFFLE(2,0,3,0) );
+    y = _mm256_shuffle_ps( t1, t0, _MM_SHUFFLE(3,1,2,0) );
+    z = _mm256_shuffle_ps( t1, r2, _MM_SHUFFLE(3,0,3,1) );
+}
+
+static inline void Untranspose3x8( __m256 x, __m256 y, __m256 z,
+                                   __m256& r0, __m256& r1, __m256& r2 )
+{
+    __m256 xy0 = _mm256_shuffle_ps( x, y, _MM_SHUFFLE(2,0,2,0) );
+    __m256 xy1 = _mm256_shuffle_ps( x, y, _MM_SHUFFLE(3,1,3,1) );
+    __m256 zx  = _mm256_shuffle_ps( z, xy1, _MM_SHUFFLE(1,0,2,0) );
+    __m256 yz  = _mm256_shuffle_ps( xy1, z, _MM_SHUFFLE(3,1,3,2) );
+    r0 = _mm256_shuffle_ps( xy0, zx, _MM_SHUFFLE(2,0,2,0) );
+    r1 = _mm256_shuffle_ps( yz, xy0, _MM_SHUFFLE(3,1,2,0) );
+    r2 = _mm256_shuffle_ps( zx, yz, _MM_SHUFFLE(3,1,3,1) );
+}
+
+// Loads 8 vectors so that Transpose3x8 sees the layout of Transpose3x4 per lane
+static inline void LoadVectors8( const float* p, __m256& r0, __m256& r1, __m256& r2 )
+{
+    r0 = _mm256_insertf128_ps( _mm256_castps128_ps256( _mm_loadu_ps( p    ) ), _mm_loadu_ps( p+12 ), 1 );
+    r1 = _mm256_insertf128_ps( _mm256_castps128_ps256( _mm_loadu_ps( p+4  ) ), _mm_loadu_ps( p+16 ), 1 );
+    r2 = _mm256_insertf128_ps( _mm256_castps128_ps256( _mm_loadu_ps( p+8  ) ), _mm_loadu_ps( p+20 ), 1 );
+}
+
+static inline void StoreVectors8( float* p, __m256 r0, __m256 r1, __m256 r2 )
+{
+    _mm_storeu_ps( p,    _mm256_castps256_ps128( r0 ) );
+    _mm_storeu_ps( p+4,  _mm256_castps256_ps128( r1 ) );
+    _mm_storeu_ps( p+8,  _mm256_castps256_ps128( r2 ) );
+    _mm_storeu_ps( p+12, _mm256_extractf128_ps( r0, 1 ) );
+    _mm_storeu_ps( p+16, _mm256_extractf128_ps( r1, 1 ) );
+    _mm_storeu_ps( p+20, _mm256_extractf128_ps( r2, 1 ) );
+}
+
+// _MM_TRANSPOSE4_PS on both 128-bit lanes
+static inline void Transpose4x8( __m256& r0, __m256& r1, __m256& r2, __m256& r3 )
+{
+    __m256 t0 = _mm256_unpacklo_ps( r0, r1 ), t1 = _mm256_unpacklo_ps( r2, r3 );
+    __m256 t2 = _mm256_unpackhi_ps( r0, r1 ), t3 = _mm256_unpackhi_ps( r2, r3 );
+    r0 = _mm256_shuffle_ps( t0, t1, _MM_SHUFFLE(1,0,1,0) );
+    r1 = _mm256_shuffle_ps( t0, t1, _MM_SHUFFLE(3,2,3,2) );
+    r2 = _mm256_shuffle_ps( t2, t3, _MM_SHUFFLE(1,0,1,0) );
+    r3 = _mm256_shuffle_ps( t2, t3, _MM_SHUFFLE(3,2,3,2) );
+}
+
+// Quaternion k in lane 0 and k+4 in lane 1 of register k
+static inline __m256 LoadPair( const float* p, int k )
+{
+    return _mm256_insertf128_ps( _mm256_castps128_ps256( _mm_loadu_ps( p+4*k ) ), _mm_loadu_ps( p+16+4*k ), 1 );
+}
+
+static inline void StorePair( float* p0, float* p1, __m256 r )
+{
+    _mm_storeu_ps( p0, _mm256_castps256_ps128( r ) );
+    _mm_storeu_ps( p1, _mm256_extractf128_ps( r, 1 ) );
+}
+
+static inline void LoadQuaternions8( const D3DMATH_QUATERNION* pSrc,
+                                     __m256& x, __m256& y, __m256& z, __m256& w )
+{
+    const float* p = (const float*)pSrc;
+    x = LoadPair( p, 0 );
+    y = LoadPair( p, 1 );
+    z = LoadPair( p, 2 );
+    w = LoadPair( p, 3 );
+    Transpose4x8( x, y, z, w );
+}
+
+// AcosPoly and SinPoly on 8 values
+static inline __m256 AcosPoly8( __m256 c )
+{
+    __m256 p = _mm256_set1_ps( -0.0012624911f );
+    p = _mm256_add_ps( _mm256_mul_ps( p, c ), _mm256_set1_ps(  0.0066700901f ) );
+    p = _mm256_add_ps( _mm256_mul_ps( p, c ), _mm256_set1_ps( -0.0170881256f ) );
+    p = _mm256_add_ps( _mm256_mul_ps( p, c ), _mm256_set1_ps(  0.0308918810f ) );
+    p = _mm256_add_ps( _mm256_mul_ps( p, c ), _mm256_set1_ps( -0.0501743046f ) );
+    p = _mm256_add_ps( _mm256_mul_ps( p, c ), _mm256_set1_ps(  0.0889789874f ) );
+    p = _mm256_add_ps( _mm256_mul_ps( p, c ), _mm256_set1_ps( -0.2145988016f ) );
+    p = _mm256_add_ps( _mm256_mul_ps( p, c ), _mm256_set1_ps(  1.5707963050f ) );
+    return _mm256_mul_ps( p, _mm256_sqrt_ps( _mm256_sub_ps( _mm256_set1_ps( 1.0f ), c ) ) );
+}
+
+static inline __m256 SinPoly8( __m256 x )
+{
+    const __m256 sign = _mm256_set1_ps( -0.0f );
+    __m256 k = _mm256_cvtepi32_ps( _mm256_cvtps_epi32( _mm256_mul_ps( x, _mm256_set1_ps( 0.5f*g_INV_PI ) ) ) );
+    x = _mm256_sub_ps( x, _mm256_mul_ps( k, _mm256_set1_ps( 6.28125f ) ) );
+    x = _mm256_sub_ps( x, _mm256_mul_ps( k, _mm256_set1_ps( 1.9353071795864769e-3f ) ) );
+    __m256 s  = _mm256_and_ps( x, sign );
+    __m256 ax = _mm256_xor_ps( x, s );
+    __m256 fold = _mm256_cmp_ps( ax, _mm256_set1_ps( g_PI_DIV_2 ), _CMP_GT_OQ );
+    ax = _mm256_blendv_ps( ax, _mm256_sub_ps( _mm256_set1_ps( g_PI ), ax ), fold );
+    x = _mm256_xor_ps( ax, s );
+    __m256 x2 = _mm256_mul_ps( x, x );
+    __m256 p = _mm256_set1_ps( -2.5052108e-8f );
+    p = _mm256_add_ps( _mm256_mul_ps( p, x2 ), _mm256_set1_ps(  2.7557319e-6f ) );
+    p = _mm256_add_ps( _mm256_mul_ps( p, x2 ), _mm256_set1_ps( -1.9841270e-4f ) );
+    p = _mm256_add_ps( _mm256_mul_ps( p, x2 ), _mm256_set1_ps(  8.3333333e-3f ) );
+    p = _mm256_add_ps( _mm256_mul_ps( p, x2 ), _mm256_set1_ps( -1.6666667e-1f ) );
+    return _mm256_add_ps( x, _mm256_mul_ps( _mm256_mul_ps( p, x2 ), x ) );
+}
+#endif // SIMD_AVX
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: D3DMath_VectorMatrixMultiplyBatch()
+// Desc: Multiplies n vectors by a matrix. The products are evaluated in the
+//       same order as D3DMath_VectorMatrixMultiply, so the results are
+//       bit-identical to the single-item function.
+//-----------------------------------------------------------------------------
+HRESULT D3DMath_VectorMatrixMultiplyBatch( D3DVECTOR* pDest, const D3DVECTOR* pSrc,
+                                           DWORD n, const D3DMATRIX& mat )
+{
+    HRESULT hr = S_OK;
+    DWORD i = 0;
+
+#ifdef SIMD_AVX
+    {
+        const __m256 m11 = _mm256_set1_ps( mat._11 ), m12 = _mm256_set1_ps( mat._12 ), m13 = _mm256_set1_ps( mat._13 ), m14 = _mm256_set1_ps( mat._14 );
+        const __m256 m21 = _mm256_set1_ps( mat._21 ), m22 = _mm256_set1_ps( mat._22 ), m23 = _mm256_set1_ps( mat._23 ), m24 = _mm256_set1_ps( mat._24 );
+        const __m256 m31 = _mm256_set1_ps( mat._31 ), m32 = _mm256_set1_ps( mat._32 ), m33 = _mm256_set1_ps( mat._33 ), m34 = _mm256_set1_ps( mat._34 );
+        const __m256 m41 = _mm256_set1_ps( mat._41 ), m42 = _mm256_set1_ps( mat._42 ), m43 = _mm256_set1_ps( mat._43 ), m44 = _mm256_set1_ps( mat._44 );
+        const __m256 absmask = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7fffffff ) );
+        const __m256 eps = _mm256_set1_ps( g_EPSILON );
+
+        for( ; i+8 <= n; i += 8 )
+        {
+            __m256 r0, r1, r2, vx, vy, vz;
+            LoadVectors8( (const float*)(pSrc+i), r0, r1, r2 );
+            Transpose3x8( r0, r1, r2, vx, vy, vz );
+
+            __m256 x = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( vx, m11 ), _mm256_mul_ps( vy, m21 ) ), _mm256_mul_ps( vz, m31 ) ), m41 );
+            __m256 y = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( vx, m12 ), _mm256_mul_ps( vy, m22 ) ), _mm256_mul_ps( vz, m32 ) ), m42 );
+            __m256 z = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( vx, m13 ), _mm256_mul_ps( vy, m23 ) ), _mm256_mul_ps( vz, m33 ) ), m43 );
+            __m256 w = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( vx, m14 ), _mm256_mul_ps( vy, m24 ) ), _mm256_mul_ps( vz, m34 ) ), m44 );
+            x = _mm256_div_ps( x, w );
+            y = _mm256_div_ps( y, w );
+            z = _mm256_div_ps( z, w );
+
+            __m256 bad = _mm256_cmp_ps( _mm256_and_ps( w, absmask ), eps, _CMP_LT_OQ );
+            if( _mm256_movemask_ps( bad ) )
+            {
+                // Keep the previous destination where w vanished
+                __m256 d0, d1, d2, dx, dy, dz;
+                LoadVectors8( (const float*)(pDest+i), d0, d1, d2 );
+                Transpose3x8( d0, d1, d2, dx, dy, dz );
+                x = _mm256_blendv_ps( x, dx, bad );
+                y = _mm256_blendv_ps( y, dy, bad );
+                z = _mm256_blendv_ps( z, dz, bad );
+                hr = E_INVALIDARG;
+            }
+            Untranspose3x8( x, y, z, r0, r1, r2 );
+            StoreVectors8( (float*)(pDest+i), r0, r1, r2 );
+        }
+    }
+#endif
+
+#ifdef SIMD_SSE2
+    {
+        const __m128 m11 = _mm_set1_ps( mat._11 ), m12 = _mm_set1_ps( mat._12 ), m13 = _mm_set1_ps( mat._13 ), m14 = _mm_set1_ps( mat._14 );
+        const __m128 m21 = _mm_set1_ps( mat._21 ), m22 = _mm_set1_ps( mat._22 ), m23 = _mm_set1_ps( mat._23 ), m24 = _mm_set1_ps( mat._24 );
+        const __m128 m31 = _mm_set1_ps( mat._31 ), m32 = _mm_set1_ps( mat._32 ), m33 = _mm_set1_ps( mat._33 ), m34 = _mm_set1_ps( mat._34 );
+        const __m128 m41 = _mm_set1_ps( mat._41 ), m42 = _mm_set1_ps( mat._42 ), m43 = _mm_set1_ps( mat._43 ), m44 = _mm_set1_ps( mat._44 );
+        const __m128 absmask = _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff ) );
+        const __m128 eps = _mm_set1_ps( g_EPSILON );
+
+        for( ; i+4 <= n; i += 4 )
+        {
+            const float* ps = (const float*)(pSrc+i);
+            __m128 vx, vy, vz;
+            Transpose3x4( _mm_loadu_ps( ps ), _mm_loadu_ps( ps+4 ), _mm_loadu_ps( ps+8 ), vx, vy, vz );
+
+            __m128 x = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( vx, m11 ), _mm_mul_ps( vy, m21 ) ), _mm_mul_ps( vz, m31 ) ), m41 );
+            __m128 y = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( vx, m12 ), _mm_mul_ps( vy, m22 ) ), _mm_mul_ps( vz, m32 ) ), m42 );
+            __m128 z = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( vx, m13 ), _mm_mul_ps( vy, m23 ) ), _mm_mul_ps( vz, m33 ) ), m43 );
+            __m128 w = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( vx, m14 ), _mm_mul_ps( vy, m24 ) ), _mm_mul_ps( vz, m34 ) ), m44 );
+            x = _mm_div_ps( x, w );
+            y = _mm_div_ps( y, w );
+            z = _mm_div_ps( z, w );
+
+            float* pd = (float*)(pDest+i);
+            __m128 bad = _mm_cmplt_ps( _mm_and_ps( w, absmask ), eps );
+            if( _mm_movemask_ps( bad ) )
+            {
+                // Keep the previous destination where w vanished
+                __m128 dx, dy, dz;
+                Transpose3x4( _mm_loadu_ps( pd ), _mm_loadu_ps( pd+4 ), _mm_loadu_ps( pd+8 ), dx, dy, dz );
+                x = _mm_or_ps( _mm_and_ps( bad, dx ), _mm_andnot_ps( bad, x ) );
+                y = _mm_or_ps( _mm_and_ps( bad, dy ), _mm_andnot_ps( bad, y ) );
+                z = _mm_or_ps( _mm_and_ps( bad, dz ), _mm_andnot_ps( bad, z ) );
+                hr = E_INVALIDARG;
+            }
+            __m128 r0, r1, r2;
+            Untranspose3x4( x, y, z, r0, r1, r2 );
+            _mm_storeu_ps( pd,   r0 );
+            _mm_storeu_ps( pd+4, r1 );
+            _mm_storeu_ps( pd+8, r2 );
+        }
+    }
+#endif
+
+    for( ; i < n; i++ )
+        if( FAILED( D3DMath_VectorMatrixMultiply( pDest[i], pSrc[i], mat ) ) )
+            hr = E_INVALIDARG;
+
+    return hr;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: D3DMath_MatrixFromQuaternionBatch()
+// Desc: Converts n unit quaternions into rotation matrices. Bit-identical to
+//       D3DMath_MatrixFromQuaternion.
+//-----------------------------------------------------------------------------
+VOID D3DMath_MatrixFromQuaternionBatch( D3DMATRIX* pDest, const D3DMATH_QUATERNION* pSrc,
+                                        DWORD n )
+{
+    DWORD i = 0;
+
+#ifdef SIMD_AVX
+    {
+        const __m256 one = _mm256_set1_ps( 1.0f ), two = _mm256_set1_ps( 2.0f );
+        const __m128 row4 = _mm_setr_ps( 0.0f, 0.0f, 0.0f, 1.0f );
+
+        for( ; i+8 <= n; i += 8 )
+        {
+            __m256 x, y, z, w;
+            LoadQuaternions8( pSrc+i, x, y, z, w );
+
+            __m256 xx = _mm256_mul_ps( x, x ), yy = _mm256_mul_ps( y, y ), zz = _mm256_mul_ps( z, z );
+            __m256 xy = _mm256_mul_ps( x, y ), xz = _mm256_mul_ps( x, z ), yz = _mm256_mul_ps( y, z );
+            __m256 wx = _mm256_mul_ps( w, x ), wy = _mm256_mul_ps( w, y ), wz = _mm256_mul_ps( w, z );
+
+            __m256 r1[4], r2[4], r3[4];
+            r1[0] = _mm256_sub_ps( one, _mm256_mul_ps( two, _mm256_add_ps( yy, zz ) ) );
+            r1[1] = _mm256_mul_ps( two, _mm256_sub_ps( xy, wz ) );
+            r1[2] = _mm256_mul_ps( two, _mm256_add_ps( xz, wy ) );
+            r1[3] = _mm256_setzero_ps();
+
+            r2[0] = _mm256_mul_ps( two, _mm256_add_ps( xy, wz ) );
+            r2[1] = _mm256_sub_ps( one, _mm256_mul_ps( two, _mm256_add_ps( xx, zz ) ) );
+            r2[2] = _mm256_mul_ps( two, _mm256_sub_ps( yz, wx ) );
+            r2[3] = _mm256_setzero_ps();
+
+            r3[0] = _mm256_mul_ps( two, _mm256_sub_ps( xz, wy ) );
+            r3[1] = _mm256_mul_ps( two, _mm256_add_ps( yz, wx ) );
+            r3[2] = _mm256_sub_ps( one, _mm256_mul_ps( two, _mm256_add_ps( xx, yy ) ) );
+            r3[3] = _mm256_setzero_ps();
+
+            // Lane 0 of r1[k] is row 1 of matrix k, lane 1 that of matrix k+4
+            Transpose4x8( r1[0], r1[1], r1[2], r1[3] );
+            Transpose4x8( r2[0], r2[1], r2[2], r2[3] );
+            Transpose4x8( r3[0], r3[1], r3[2], r3[3] );
+            for( int k = 0; k < 4; k++ )
+            {
+                float* pd0 = (float*)(pDest+i+k);
+                float* pd1 = (float*)(pDest+i+k+4);
+                StorePair( pd0,   pd1,   r1[k] );
+                StorePair( pd0+4, pd1+4, r2[k] );
+                StorePair( pd0+8, pd1+8, r3[k] );
+                _mm_storeu_ps( pd0+12, row4 );
+                _mm_storeu_ps( pd1+12, row4 );
+            }
+        }
+    }
+#endif
+
+#ifdef SIMD_SSE2
+    const __m128 one = _mm_set1_ps( 1.0f ), two = _mm_set1_ps( 2.0f );
+    const __m128 row4 = _mm_setr_ps( 0.0f, 0.0f, 0.0f, 1.0f );
+
+    for( ; i+4 <= n; i += 4 )
+    {
+        __m128 x, y, z, w;
+        LoadQuaternions( pSrc+i, x, y, z, w );
+
+        __m128 xx = _mm_mul_ps( x, x ), yy = _mm_mul_ps( y, y ), zz = _mm_mul_ps( z, z );
+        __m128 xy = _mm_mul_ps( x, y ), xz = _mm_mul_ps( x, z ), yz = _mm_mul_ps( y, z );
+        __m128 wx = _mm_mul_ps( w, x ), wy = _mm_mul_ps( w, y ), wz = _mm_mul_ps( w, z );
+
+        __m128 r1[4], r2[4], r3[4];
+        r1[0] = _mm_sub_ps( one, _mm_mul_ps( two, _mm_add_ps( yy, zz ) ) );
+        r1[1] = _mm_mul_ps( two, _mm_sub_ps( xy, wz ) );
+        r1[2] = _mm_mul_ps( two, _mm_add_ps( xz, wy ) );
+        r1[3] = _mm_setzero_ps();
+
+        r2[0] = _mm_mul_ps( two, _mm_add_ps( xy, wz ) );
+        r2[1] = _mm_sub_ps( one, _mm_mul_ps( two, _mm_add_ps( xx, zz ) ) );
+        r2[2] = _mm_mul_ps( two, _mm_sub_ps( yz, wx ) );
+        r2[3] = _mm_setzero_ps();
+
+        r3[0] = _mm_mul_ps( two, _mm_sub_ps( xz, wy ) );
+        r3[1] = _mm_mul_ps( two, _mm_add_ps( yz, wx ) );
+        r3[2] = _mm_sub_ps( one, _mm_mul_ps( two, _mm_add_ps( xx, yy ) ) );
+        r3[3] = _mm_setzero_ps();
+
+        // Each transpose turns one row of four matrices into four matrix rows
+        _MM_TRANSPOSE4_PS( r1[0], r1[1], r1[2], r1[3] );
+        _MM_TRANSPOSE4_PS( r2[0], r2[1], r2[2], r2[3] );
+        _MM_TRANSPOSE4_PS( r3[0], r3[1], r3[2], r3[3] );
+        for( int k = 0; k < 4; k++ )
+        {
+            float* pd = (float*)(pDest+i+k);
+            _mm_storeu_ps( pd,    r1[k] );
+            _mm_storeu_ps( pd+4,  r2[k] );
+            _mm_storeu_ps( pd+8,  r3[k] );
+            _mm_storeu_ps( pd+12, row4 );
+        }
+    }
+#endif
+
+    for( ; i < n; i++ )
+        D3DMath_MatrixFromQuaternion( pDest[i], pSrc[i].x, pSrc[i].y, pSrc[i].z, pSrc[i].w );
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: D3DMath_QuaternionSlerpBatch()
+// Desc: Spherical linear interpolation of n quaternion pairs. After the
+//       start quaternion is flipped into the same hemisphere the antipodal
+//       branch of D3DMath_QuaternionSlerp can no longer be taken, so the
+//       vector path only distinguishes linear and spherical interpolation.
+//-----------------------------------------------------------------------------
+VOID D3DMath_QuaternionSlerpBatch( D3DMATH_QUATERNION* pDest, const D3DMATH_QUATERNION* pA,
+                                   const D3DMATH_QUATERNION* pB, const FLOAT* pAlpha, DWORD n )
+{
+    DWORD i = 0;
+
+#ifdef SIMD_AVX
+    {
+        const __m256 sign = _mm256_set1_ps( -0.0f );
+        const __m256 one = _mm256_set1_ps( 1.0f );
+        const __m256 lin = _mm256_set1_ps( 0.05f );
+
+        for( ; i+8 <= n; i += 8 )
+        {
+            __m256 ax, ay, az, aw, bx, by, bz, bw;
+            LoadQuaternions8( pA+i, ax, ay, az, aw );
+            LoadQuaternions8( pB+i, bx, by, bz, bw );
+            __m256 alpha = _mm256_loadu_ps( pAlpha+i );
+
+            __m256 c = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( ax, bx ), _mm256_mul_ps( ay, by ) ),
+                                                     _mm256_mul_ps( az, bz ) ), _mm256_mul_ps( aw, bw ) );
+
+            // Flip start quaternion where cos(theta) < 0
+            __m256 flip = _mm256_and_ps( c, sign );
+            ax = _mm256_xor_ps( ax, flip ); ay = _mm256_xor_ps( ay, flip );
+            az = _mm256_xor_ps( az, flip ); aw = _mm256_xor_ps( aw, flip );
+            c  = _mm256_xor_ps( c, flip );
+            c  = _mm256_min_ps( c, one );
+
+            __m256 theta = AcosPoly8( c );
+            __m256 sinTheta = _mm256_sqrt_ps( _mm256_mul_ps( _mm256_sub_ps( one, c ), _mm256_add_ps( one, c ) ) );
+            __m256 s1 = _mm256_div_ps( SinPoly8( _mm256_mul_ps( theta, _mm256_sub_ps( one, alpha ) ) ), sinTheta );
+            __m256 s2 = _mm256_div_ps( SinPoly8( _mm256_mul_ps( theta, alpha ) ), sinTheta );
+
+            // If the quaternions are close, use linear interpolation
+            __m256 close = _mm256_cmp_ps( _mm256_sub_ps( one, c ), lin, _CMP_LT_OQ );
+            s1 = _mm256_blendv_ps( s1, _mm256_sub_ps( one, alpha ), close );
+            s2 = _mm256_blendv_ps( s2, alpha, close );
+
+            __m256 qx = _mm256_add_ps( _mm256_mul_ps( s1, ax ), _mm256_mul_ps( s2, bx ) );
+            __m256 qy = _mm256_add_ps( _mm256_mul_ps( s1, ay ), _mm256_mul_ps( s2, by ) );
+            __m256 qz = _mm256_add_ps( _mm256_mul_ps( s1, az ), _mm256_mul_ps( s2, bz ) );
+            __m256 qw = _mm256_add_ps( _mm256_mul_ps( s1, aw ), _mm256_mul_ps( s2, bw ) );
+            Transpose4x8( qx, qy, qz, qw );
+            float* pd = (float*)(pDest+i);
+            StorePair( pd,    pd+16, qx );
+            StorePair( pd+4,  pd+20, qy );
+            StorePair( pd+8,  pd+24, qz );
+            StorePair( pd+12, pd+28, qw );
+        }
+    }
+#endif
+
+#ifdef SIMD_SSE2
+    const __m128 sign = _mm_set1_ps( -0.0f );
+    const __m128 one = _mm_set1_ps( 1.0f );
+    const __m128 lin = _mm_set1_ps( 0.05f );
+
+    for( ; i+4 <= n; i += 4 )
+    {
+        __m128 ax, ay, az, aw, bx, by, bz, bw;
+        LoadQuaternions( pA+i, ax, ay, az, aw );
+        LoadQuaternions( pB+i, bx, by, bz, bw );
+        __m128 alpha = _mm_loadu_ps( pAlpha+i );
+
+        __m128 c = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( ax, bx ), _mm_mul_ps( ay, by ) ),
+                                           _mm_mul_ps( az, bz ) ), _mm_mul_ps( aw, bw ) );
+
+        // Flip start quaternion where cos(theta) < 0
+        __m128 flip = _mm_and_ps( c, sign );
+        ax = _mm_xor_ps( ax, flip ); ay = _mm_xor_ps( ay, flip );
+        az = _mm_xor_ps( az, flip ); aw = _mm_xor_ps( aw, flip );
+        c  = _mm_xor_ps( c, flip );
+        c  = _mm_min_ps( c, one );
+
+        __m128 theta = AcosPoly( c );
+        __m128 sinTheta = _mm_sqrt_ps( _mm_mul_ps( _mm_sub_ps( one, c ), _mm_add_ps( one, c ) ) );
+        __m128 s1 = _mm_div_ps( SinPoly( _mm_mul_ps( theta, _mm_sub_ps( one, alpha ) ) ), sinTheta );
+        __m128 s2 = _mm_div_ps( SinPoly( _mm_mul_ps( theta, alpha ) ), sinTheta );
+
+        // If the quaternions are close, use linear interpolation
+        __m128 close = _mm_cmplt_ps( _mm_sub_ps( one, c ), lin );
+        s1 = _mm_or_ps( _mm_and_ps( close, _mm_sub_ps( one, alpha ) ), _mm_andnot_ps( close, s1 ) );
+        s2 = _mm_or_ps( _mm_and_ps( close, alpha ), _mm_andnot_ps( close, s2 ) );
+
+        __m128 qx = _mm_add_ps( _mm_mul_ps( s1, ax ), _mm_mul_ps( s2, bx ) );
+        __m128 qy = _mm_add_ps( _mm_mul_ps( s1, ay ), _mm_mul_ps( s2, by ) );
+        __m128 qz = _mm_add_ps( _mm_mul_ps( s1, az ), _mm_mul_ps( s2, bz ) );
+        __m128 qw = _mm_add_ps( _mm_mul_ps( s1, aw ), _mm_mul_ps( s2, bw ) );
+        _MM_TRANSPOSE4_PS( qx, qy, qz, qw );
+        float* pd = (float*)(pDest+i);
+        _mm_storeu_ps( pd,    qx );
+        _mm_storeu_ps( pd+4,  qy );
+        _mm_storeu_ps( pd+8,  qz );
+        _mm_storeu_ps( pd+12, qw );
+    }
+#endif
+
+    for( ; i < n; i++ )
+    {
+        D3DMATH_QUATERNION a = pA[i], b = pB[i];
+        D3DMath_QuaternionSlerp( pDest[i].x, pDest[i].y, pDest[i].z, pDest[i].w,
+                                 a.x, a.y, a.z, a.w, b.x, b.y, b.z, b.w, pAlpha[i] );
+    }
+}
@@ -203,6 +203,23 @@ D3DMath_Normalise (D3DVECTOR &v)
 	v.x *= ilen, v.y *= ilen, v.z *= ilen;
 }
 
+//-----------------------------------------------------------------------------
+// Approximations
+//-----------------------------------------------------------------------------
+
+// Polynomial approximation of acos(x) for -1 <= x <= 1 (Abramowitz & Stegun
+// 4.4.45). Absolute error is below 7e-5 rad, which is good enough for
+// weighting but not for geometry.
+inline float
+D3DMath_FastAcos (float x)
+{
+	float ax = x < 0.0f ? -x : x;
+	if (ax > 1.0f) ax = 1.0f;
+	float r = (float)sqrt (1.0f-ax) *
+		(1.5707288f + ax*(-0.2121144f + ax*(0.0742610f - ax*0.0187293f)));
+	return x < 0.0f ? g_PI-r : r;
+}
+
 //-----------------------------------------------------------------------------
 // Quaternion functions
 //-----------------------------------------------------------------------------
@@ -225,5 +242,32 @@ VOID D3DMath_QuaternionSlerp( FLOAT& Qx, FLOAT& Qy, FLOAT& Qz, FLOAT& Qw,
                               FLOAT fAlpha );
 
 
+//-----------------------------------------------------------------------------
+// Batch functions
+// Apply the single-item functions above to arrays of n items, with SSE or
+// AVX where the compiler targets them. Destination and source arrays may
+// be the same.
+//-----------------------------------------------------------------------------
+typedef struct {
+	FLOAT x, y, z, w;
+} D3DMATH_QUATERNION;
+
+// Same results as D3DMath_VectorMatrixMultiply for each vector. Returns
+// E_INVALIDARG if w vanished for any vector, whose result is then left
+// unchanged.
+HRESULT D3DMath_VectorMatrixMultiplyBatch( D3DVECTOR* pDest, const D3DVECTOR* pSrc,
+                                           DWORD n, const D3DMATRIX& mat );
+
+// Same results as D3DMath_MatrixFromQuaternion for each quaternion
+VOID D3DMath_MatrixFromQuaternionBatch( D3DMATRIX* pDest, const D3DMATH_QUATERNION* pSrc,
+                                        DWORD n );
+
+// D3DMath_QuaternionSlerp for each pair pA[i], pB[i] with fraction pAlpha[i].
+// The vector paths use polynomial acos and sin, so results may differ from
+// the single-item function by a few units in the last place.
+VOID D3DMath_QuaternionSlerpBatch( D3DMATH_QUATERNION* pDest, const D3DMATH_QUATERNION* pA,
+                                   const D3DMATH_QUATERNION* pB, const FLOAT* pAlpha, DWORD n );
+
+
 #endif // D3DMATH_H
 
@@ -5,6 +5,10 @@
 #include <stdio.h>
 #include <d3dtypes.h>
 #include "d3dmath.h"
+#include "Simd.h"
+#include "Arena.h"
+#include <algorithm>
+#include <atomic>
 
 #ifdef INLINEGRAPHICS
 #include "OGraphics.h"
@@ -20,6 +24,83 @@ extern char DBG_MSG[256];
 
 static D3DMATERIAL7 defmat = {{1,1,1,1},{1,1,1,1},{0,0,0,1},{0,0,0,1},0};
 
+// =======================================================================
+// Shared group buffers
+// A vertex or index list shared by groups of several meshes carries a
+// reference count. Lists owned by a single group have none. Lists
+// allocated from the mesh's arena are marked with ArenaRef; they are
+// never shared or freed individually.
+
+struct BufferRef {
+	std::atomic<DWORD> n;
+};
+
+static BufferRef ArenaRef;
+
+// Allocate a list of n elements from arena, or from the heap if arena is 0,
+// and set its reference mark
+template<class T> static T *NewBuffer (Arena *arena, DWORD n, BufferRef *&ref)
+{
+	if (!arena) {
+		ref = 0;
+		return new T[n];
+	}
+	T *buf = arena->New<T> (n);
+	if (!buf) throw std::bad_alloc();
+	ref = &ArenaRef;
+	return buf;
+}
+
+// Add a reference to a list, creating the count on its first share
+static BufferRef *AddRef (BufferRef *&ref)
+{
+	if (!ref) {
+		ref = new BufferRef;
+		ref->n = 1;
+	}
+	ref->n++;
+	return ref;
+}
+
+// Drop a group's reference to a list, deleting the list with the last one
+template<class T> static void ReleaseBuffer (T *&buf, BufferRef *&ref)
+{
+	if (!ref) delete []buf;
+	else if (ref != &ArenaRef && --ref->n == 0) { delete []buf; delete ref; }
+	buf = 0;
+	ref = 0;
+}
+
+// Give a group its own copy of a list of n elements before modifying it
+template<class T> static void UniqueBuffer (T *&buf, BufferRef *&ref, DWORD n, Arena *arena)
+{
+	if (!ref || ref == &ArenaRef) return;
+	if (ref->n == 1) {
+		delete ref; // the other owners have gone
+		ref = 0;
+	} else {
+		BufferRef *tmpref;
+		T *tmp = NewBuffer<T> (arena, n, tmpref);
+		memcpy (tmp, buf, n*sizeof(T));
+		if (--ref->n == 0) { delete []buf; delete ref; } // lost a race with another owner
+		buf = tmp;
+		ref = tmpref;
+	}
+}
+
+// Let a group use list src of n elements: shared by reference count, or
+// copied into arena (or the heap) if src belongs to another mesh's arena
+template<class T> static void ShareBuffer (T *&buf, BufferRef *&ref, T *src, BufferRef *&srcref, DWORD n, Arena *arena)
+{
+	if (srcref == &ArenaRef) {
+		buf = NewBuffer<T> (arena, n, ref);
+		memcpy (buf, src, n*sizeof(T));
+	} else {
+		buf = src;
+		ref = AddRef (srcref);
+	}
+}
+
 // =======================================================================
 // Class Triangle
 
@@ -59,17 +140,43 @@ void Triangle::SetNodes (int n0, int n1, int n2)
 
 Mesh::Mesh ()
 {
+	ListArena = 0;
 	nGrp = nMtrl = nTex = 0;
 	GrpVis   = 0;
 	GrpSetup = false;
+	bDeferSetup = false;
+	MtrlName = TexName = 0;
 	bModulateMatAlpha = false;
+	nmlWeight = NMLWEIGHT_ANGLE;
+	nmlCrease = 0.0f;
+	Flags = 0;
+}
+
+Mesh::Mesh (Arena *arena)
+{
+	ListArena = arena;
+	nGrp = nMtrl = nTex = 0;
+	GrpVis   = 0;
+	GrpSetup = false;
+	bDeferSetup = false;
+	MtrlName = TexName = 0;
+	bModulateMatAlpha = false;
+	nmlWeight = NMLWEIGHT_ANGLE;
+	nmlCrease = 0.0f;
+	Flags = 0;
 }
 
 Mesh::Mesh (NTVERTEX *vtx, DWORD nvtx, WORD *idx, DWORD nidx, DWORD matidx, DWORD texidx)
 {
+	ListArena = 0;
 	nGrp = nMtrl = nTex = 0;
 	GrpVis   = 0;
 	GrpSetup = false;
+	bDeferSetup = false;
+	MtrlName = TexName = 0;
+	nmlWeight = NMLWEIGHT_ANGLE;
+	nmlCrease = 0.0f;
+	Flags = 0;
 	AddGroup (vtx, nvtx, idx, nidx, matidx, texidx);
 	bModulateMatAlpha = false;
 	Setup();
@@ -77,13 +184,57 @@ Mesh::Mesh (NTVERTEX *vtx, DWORD nvtx, WORD *idx, DWORD nidx, DWORD matidx, DWOR
 
 Mesh::Mesh (const Mesh &mesh)
 {
+	ListArena = 0;
 	nGrp = nMtrl = nTex = 0;
 	GrpVis = 0;
 	GrpSetup = false;
+	bDeferSetup = false;
+	MtrlName = TexName = 0;
 	Set (mesh);
 }
 
-void Mesh::Set (const Mesh &mesh)
+Mesh::Mesh (Mesh &&mesh)
+{
+	ListArena = 0;
+	nGrp = nMtrl = nTex = 0;
+	GrpVis = 0;
+	GrpSetup = false;
+	bDeferSetup = false;
+	MtrlName = TexName = 0;
+	*this = static_cast<Mesh&&>(mesh);
+}
+
+Mesh &Mesh::operator= (const Mesh &mesh)
+{
+	if (this != &mesh) Set (mesh);
+	return *this;
+}
+
+Mesh &Mesh::operator= (Mesh &&mesh)
+{
+	if (this == &mesh) return *this;
+	Clear ();
+	nGrp = mesh.nGrp;        Grp = mesh.Grp;        ListArena = mesh.ListArena;
+	nMtrl = mesh.nMtrl;      Mtrl = mesh.Mtrl;      MtrlName = mesh.MtrlName;
+	nTex = mesh.nTex;        TexName = mesh.TexName;
+	Strings = static_cast<StringPool&&>(mesh.Strings);
+	GrpSetup = mesh.GrpSetup;
+	bDeferSetup = mesh.bDeferSetup;
+	GrpCnt = mesh.GrpCnt;    GrpRad = mesh.GrpRad;  GrpVis = mesh.GrpVis;
+	nmlWeight = mesh.nmlWeight;
+	nmlCrease = mesh.nmlCrease;
+	bModulateMatAlpha = mesh.bModulateMatAlpha;
+	Flags = mesh.Flags;
+
+	// leave mesh empty, in the state Clear puts it in
+	mesh.nGrp = mesh.nMtrl = mesh.nTex = 0;
+	mesh.MtrlName = mesh.TexName = 0;
+	mesh.GrpVis = 0;
+	mesh.GrpSetup = mesh.bDeferSetup = false;
+	return *this;
+}
+
+void Mesh::Set (const Mesh &mesh, bool share)
 {
 	DWORD i;
 
@@ -92,18 +243,28 @@ void Mesh::Set (const Mesh &mesh)
 		Grp = new GroupSpec[nGrp];
 		memcpy (Grp, mesh.Grp, nGrp*sizeof(GroupSpec));
 		for (i = 0; i < nGrp; i++) {
-			Grp[i].Vtx = new NTVERTEX[Grp[i].nVtx];
+			if (share) {
+				ShareBuffer (Grp[i].Vtx, Grp[i].VtxRef, mesh.Grp[i].Vtx, mesh.Grp[i].VtxRef, Grp[i].nVtx, ListArena);
+				ShareBuffer (Grp[i].Idx, Grp[i].IdxRef, mesh.Grp[i].Idx, mesh.Grp[i].IdxRef, Grp[i].nIdx, ListArena);
+				continue;
+			}
+			Grp[i].Vtx = NewBuffer<NTVERTEX> (ListArena, Grp[i].nVtx, Grp[i].VtxRef);
 			memcpy (Grp[i].Vtx, mesh.Grp[i].Vtx, Grp[i].nVtx*sizeof(NTVERTEX));
-			Grp[i].Idx = new WORD[Grp[i].nIdx];
+			Grp[i].Idx = NewBuffer<WORD> (ListArena, Grp[i].nIdx, Grp[i].IdxRef);
 			memcpy (Grp[i].Idx, mesh.Grp[i].Idx, Grp[i].nIdx*sizeof(WORD));
 		}
 	}
 	if (nMtrl = mesh.nMtrl) {
 		Mtrl = new D3DMATERIAL7[nMtrl];
 		memcpy (Mtrl, mesh.Mtrl, nMtrl*sizeof(D3DMATERIAL7));
+		MtrlName = new DWORD[nMtrl];
+		memcpy (MtrlName, mesh.MtrlName, nMtrl*sizeof(DWORD));
 	}
 	if (nTex = mesh.nTex) {
+		TexName = new DWORD[nTex];
+		memcpy (TexName, mesh.TexName, nTex*sizeof(DWORD));
 	}
+	Strings = mesh.Strings;
 	if (GrpSetup = mesh.GrpSetup) {
 		GrpCnt = new D3DVECTOR[nGrp];
 		memcpy (GrpCnt, mesh.GrpCnt, nGrp*sizeof(D3DVECTOR));
@@ -115,6 +276,9 @@ void Mesh::Set (const Mesh &mesh)
 		GrpVis = 0;
 	}
 	bModulateMatAlpha = mesh.bModulateMatAlpha;
+	nmlWeight = mesh.nmlWeight;
+	nmlCrease = mesh.nmlCrease;
+	Flags = mesh.Flags;
 }
 
 Mesh::~Mesh ()
@@ -146,6 +310,11 @@ void Mesh::SetupGroup (DWORD grp)
 {
 	DWORD i;
 	D3DVALUE x, y, z, dx, dy, dz, d2, d2max;
+	if (!Grp[grp].nVtx) { // e.g. emptied by CleanupGroup
+		GrpCnt[grp].x = GrpCnt[grp].y = GrpCnt[grp].z = 0.0f;
+		GrpRad[grp] = 0.0f;
+		return;
+	}
 	D3DVALUE invtx = (D3DVALUE)(1.0/Grp[grp].nVtx);
 	x = y = z = 0.0f;
 	for (i = 0; i < Grp[grp].nVtx; i++) {
@@ -167,6 +336,18 @@ void Mesh::SetupGroup (DWORD grp)
 	GrpRad[grp] = (FLOAT)sqrt (d2max);
 }
 
+void Mesh::BeginUpdate ()
+{
+	bDeferSetup = true;
+}
+
+void Mesh::EndUpdate ()
+{
+	bDeferSetup = false;
+	if (GrpSetup)
+		for (DWORD g = 0; g < nGrp; g++) SetupGroup (g);
+}
+
 int Mesh::AddGroup (NTVERTEX *vtx, DWORD nvtx, WORD *idx, DWORD nidx,
 	DWORD mtrl_idx, DWORD tex_idx, WORD zbias, DWORD flag, bool deepcopy)
 {
@@ -191,15 +372,16 @@ int Mesh::AddGroup (NTVERTEX *vtx, DWORD nvtx, WORD *idx, DWORD nidx,
 	GrpVis = tmp_Vis;
 	g = Grp+nGrp;
 	if (deepcopy) {
-		g->Vtx = new NTVERTEX[nvtx]; 
+		g->Vtx = NewBuffer<NTVERTEX> (ListArena, nvtx, g->VtxRef);
 		if (vtx) memcpy (g->Vtx, vtx, nvtx*sizeof(NTVERTEX));
 		else     memset (g->Vtx, 0, nvtx*sizeof(NTVERTEX));
-		g->Idx = new WORD[nidx];
+		g->Idx = NewBuffer<WORD> (ListArena, nidx, g->IdxRef);
 		if (idx) memcpy (g->Idx, idx, nidx*sizeof(WORD));
 		else     memset (g->Idx, 0, nidx*sizeof(WORD));
 	} else {
 		g->Vtx = vtx;
 		g->Idx = idx;
+		g->VtxRef = g->IdxRef = 0;
 	}
 	g->nVtx = nvtx;
 	g->nIdx = nidx;
@@ -208,6 +390,8 @@ int Mesh::AddGroup (NTVERTEX *vtx, DWORD nvtx, WORD *idx, DWORD nidx,
 	g->zBias = zbias;
 	g->Flags = 0;
 	g->UsrFlag = flag;
+	g->Label = 0;
+	g->NoNormal = false;
 	if (GrpSetup) {
 		SetupGroup (nGrp);
 		if (g->MtrlIdx != SPEC_INHERIT && g->MtrlIdx >= nMtrl)
@@ -225,32 +409,132 @@ bool Mesh::AddGroupBlock (DWORD grp, const NTVERTEX *vtx, DWORD nvtx, const WORD
 	GroupSpec *g = Grp+grp;
 	WORD vofs = (WORD)g->nVtx;
 
-	NTVERTEX *v = new NTVERTEX[g->nVtx+nvtx];
-	if (g->nVtx) {
-		memcpy (v, g->Vtx, g->nVtx*sizeof(NTVERTEX));
-		delete []g->Vtx;
-	}
+	BufferRef *ref;
+	NTVERTEX *v = NewBuffer<NTVERTEX> (ListArena, g->nVtx+nvtx, ref);
+	if (g->nVtx) memcpy (v, g->Vtx, g->nVtx*sizeof(NTVERTEX));
+	ReleaseBuffer (g->Vtx, g->VtxRef);
 	if (nvtx) {
 		memcpy (v+g->nVtx, vtx, nvtx*sizeof(NTVERTEX));
 	}
 	g->Vtx = v;
+	g->VtxRef = ref;
 	g->nVtx += nvtx;
 
-	WORD *i = new WORD[g->nIdx+nidx];
-	if (g->nIdx) {
-		memcpy (i, g->Idx, g->nIdx*sizeof(WORD));
-		delete []g->Idx;
-	}
+	WORD *i = NewBuffer<WORD> (ListArena, g->nIdx+nidx, ref);
+	if (g->nIdx) memcpy (i, g->Idx, g->nIdx*sizeof(WORD));
+	ReleaseBuffer (g->Idx, g->IdxRef);
 	if (nidx) {
 		for (DWORD j = 0; j < nidx; j++)
 			i[g->nIdx+j] = idx[j] + vofs;
 	}
 	g->Idx = i;
+	g->IdxRef = ref;
 	g->nIdx += nidx;
 
 	return true;
 }
 
+// Render state ordering used to find mergeable groups.
+static bool GroupStateLess (const GroupSpec &a, const GroupSpec &b)
+{
+	if (a.MtrlIdx != b.MtrlIdx) return a.MtrlIdx < b.MtrlIdx;
+	if (a.TexIdx  != b.TexIdx)  return a.TexIdx  < b.TexIdx;
+	if (a.Flags   != b.Flags)   return a.Flags   < b.Flags;
+	if (a.UsrFlag != b.UsrFlag) return a.UsrFlag < b.UsrFlag;
+	return a.zBias < b.zBias;
+}
+
+DWORD Mesh::MergeGroups (const bool *keep, GroupRemap *remap)
+{
+	DWORD i, j, k, n, g;
+	DWORD *order = new DWORD[nGrp];   // mergeable groups sorted by state
+	DWORD *target = new DWORD[nGrp];  // group each group is merged into
+
+	// Merging changes which group precedes another, so inherited materials
+	// and textures are resolved to those of the previous group first.
+	DWORD mtrl = SPEC_INHERIT, tex = SPEC_INHERIT;
+	for (g = 0; g < nGrp; g++) {
+		if (Grp[g].MtrlIdx == SPEC_INHERIT) Grp[g].MtrlIdx = mtrl;
+		else mtrl = Grp[g].MtrlIdx;
+		if (Grp[g].TexIdx == SPEC_INHERIT) Grp[g].TexIdx = tex;
+		else tex = Grp[g].TexIdx;
+	}
+
+	for (g = n = 0; g < nGrp; g++) {
+		target[g] = g;
+		if (remap) {
+			remap[g].VtxOfs = remap[g].IdxOfs = 0;
+			remap[g].nVtx = Grp[g].nVtx;
+			remap[g].nIdx = Grp[g].nIdx;
+		}
+		if (!keep || !keep[g]) order[n++] = g;
+	}
+	std::stable_sort (order, order+n, [this](DWORD a, DWORD b) { return GroupStateLess (Grp[a], Grp[b]); });
+
+	// Collect the members of each target in a scratch block with zero-based
+	// indices, so that every target needs only one AddGroupBlock call.
+	NTVERTEX *bvtx = 0;
+	WORD *bidx = 0;
+	DWORD bnvtx = 0, bnidx = 0, bmaxvtx = 0, bmaxidx = 0;
+	for (i = 0; i < n; i = j) {
+		DWORD t = order[i];
+		DWORD tnvtx = Grp[t].nVtx;
+		for (j = i+1; j < n && !GroupStateLess (Grp[t], Grp[order[j]]); j++) {
+			GroupSpec &m = Grp[order[j]];
+			if (tnvtx + bnvtx + m.nVtx > 0x10000) break; // exceeds 16-bit index range
+			if (bnvtx + m.nVtx > bmaxvtx) {
+				NTVERTEX *tmp = new NTVERTEX[bmaxvtx = max (2*bmaxvtx, bnvtx+m.nVtx)];
+				if (bnvtx) memcpy (tmp, bvtx, bnvtx*sizeof(NTVERTEX));
+				delete []bvtx;
+				bvtx = tmp;
+			}
+			if (bnidx + m.nIdx > bmaxidx) {
+				WORD *tmp = new WORD[bmaxidx = max (2*bmaxidx, bnidx+m.nIdx)];
+				if (bnidx) memcpy (tmp, bidx, bnidx*sizeof(WORD));
+				delete []bidx;
+				bidx = tmp;
+			}
+			if (remap) {
+				remap[order[j]].VtxOfs = Grp[t].nVtx + bnvtx;
+				remap[order[j]].IdxOfs = Grp[t].nIdx + bnidx;
+			}
+			memcpy (bvtx+bnvtx, m.Vtx, m.nVtx*sizeof(NTVERTEX));
+			for (k = 0; k < m.nIdx; k++) bidx[bnidx+k] = (WORD)(m.Idx[k] + bnvtx);
+			bnvtx += m.nVtx;
+			bnidx += m.nIdx;
+			target[order[j]] = t;
+			Grp[t].NoNormal = Grp[t].NoNormal && m.NoNormal;
+		}
+		if (bnvtx || bnidx) {
+			AddGroupBlock (t, bvtx, bnvtx, bidx, bnidx);
+			bnvtx = bnidx = 0;
+		}
+		// a run interrupted by the index limit continues with the next target
+	}
+	delete []bvtx;
+	delete []bidx;
+
+	// Drop the merged groups and compact the group list.
+	DWORD *newidx = order; // reuse
+	for (g = n = 0; g < nGrp; g++) {
+		if (target[g] != g) {
+			ReleaseBuffer (Grp[g].Vtx, Grp[g].VtxRef);
+			ReleaseBuffer (Grp[g].Idx, Grp[g].IdxRef);
+			continue;
+		}
+		newidx[g] = n;
+		Grp[n++] = Grp[g];
+	}
+	if (remap)
+		for (g = 0; g < nGrp; g++) remap[g].Grp = newidx[target[g]];
+	nGrp = n;
+	delete []order;
+	delete []target;
+
+	if (GrpSetup) Setup ();
+	return nGrp;
+}
+
 bool Mesh::MakeGroupVertexBuffer (DWORD grp)
 {
 #ifdef INLINEGRAPHICS
@@ -274,24 +558,37 @@ bool Mesh::MakeGroupVertexBuffer (DWORD grp)
 #endif
 }
 
-void Mesh::AddMesh (Mesh &mesh)
+void Mesh::AddMesh (const Mesh &mesh)
 {
-	for (DWORD i = 0; i < mesh.nGroup(); i++) {
-		NTVERTEX *vtx2;
-		WORD *idx2;
-		GroupSpec *gs = mesh.GetGroup (i);
-		// need to copy the vertex and index lists
-		vtx2 = new NTVERTEX[gs->nVtx];  memcpy (vtx2, gs->Vtx, gs->nVtx*sizeof(NTVERTEX));
-		idx2 = new WORD[gs->nIdx];      memcpy (idx2, gs->Idx, gs->nIdx*sizeof(WORD));
-		AddGroup (vtx2, gs->nVtx, idx2, gs->nIdx);
+	DWORD ngrp = mesh.nGroup(); // grows if mesh == *this
+	for (DWORD i = 0; i < ngrp; i++) {
+		const GroupSpec &gs = mesh.Grp[i];
+		// share the vertex and index lists
+		int g = AddGroup (gs.Vtx, gs.nVtx, gs.Idx, gs.nIdx);
+		GroupSpec &src = mesh.Grp[i]; // Grp may have moved if mesh == *this
+		ShareBuffer (Grp[g].Vtx, Grp[g].VtxRef, src.Vtx, src.VtxRef, src.nVtx, ListArena);
+		ShareBuffer (Grp[g].Idx, Grp[g].IdxRef, src.Idx, src.IdxRef, src.nIdx, ListArena);
+		SetLabel (g, mesh.GetLabel (i));
 	}
 }
 
+void Mesh::UnshareGroup (DWORD grp, bool vtx, bool idx)
+{
+	if (grp >= nGrp) return;
+	if (vtx) UniqueBuffer (Grp[grp].Vtx, Grp[grp].VtxRef, Grp[grp].nVtx, ListArena);
+	if (idx) UniqueBuffer (Grp[grp].Idx, Grp[grp].IdxRef, Grp[grp].nIdx, ListArena);
+}
+
+void Mesh::SetLabel (DWORD grp, const char *label)
+{
+	if (grp < nGrp) Grp[grp].Label = Strings.Add (label);
+}
+
 bool Mesh::DeleteGroup (DWORD grp)
 {
 	if (grp < nGrp) {
-		delete []Grp[grp].Vtx;
-		delete []Grp[grp].Idx;
+		ReleaseBuffer (Grp[grp].Vtx, Grp[grp].VtxRef);
+		ReleaseBuffer (Grp[grp].Idx, Grp[grp].IdxRef);
 
 		if (nGrp == 1) { // delete the only group
 			delete []Grp;
@@ -309,13 +606,20 @@ bool Mesh::DeleteGroup (DWORD grp)
 	}
 }
 
-int Mesh::AddMaterial (D3DMATERIAL7 &mtrl)
+int Mesh::AddMaterial (D3DMATERIAL7 &mtrl, const char *name)
 {
 	D3DMATERIAL7 *tmp_Mtrl = new D3DMATERIAL7[nMtrl+1];
 	memcpy (tmp_Mtrl, Mtrl, sizeof(D3DMATERIAL7)*nMtrl);
 	memcpy (tmp_Mtrl+nMtrl, &mtrl, sizeof(D3DMATERIAL7));
-	if (nMtrl) delete []Mtrl;
+	DWORD *tmp_Name = new DWORD[nMtrl+1];
+	memcpy (tmp_Name, MtrlName, sizeof(DWORD)*nMtrl);
+	tmp_Name[nMtrl] = Strings.Add (name);
+	if (nMtrl) {
+		delete []Mtrl;
+		delete []MtrlName;
+	}
 	Mtrl = tmp_Mtrl;
+	MtrlName = tmp_Name;
 	return nMtrl++;
 }
 
@@ -334,23 +638,179 @@ bool Mesh::DeleteMaterial (DWORD matidx)
 
 	// remove material from the list
 	D3DMATERIAL7 *tmp_Mtrl = 0;
+	DWORD *tmp_Name = 0;
 	if (nMtrl > 1) {
 		tmp_Mtrl = new D3DMATERIAL7[nMtrl-1];
+		tmp_Name = new DWORD[nMtrl-1];
 		for (i = j = 0; i < nMtrl; i++) {
-			if (i != matidx) memcpy (tmp_Mtrl+j++, Mtrl+i, sizeof(D3DMATERIAL7));
+			if (i != matidx) {
+				tmp_Name[j] = MtrlName[i];
+				memcpy (tmp_Mtrl+j++, Mtrl+i, sizeof(D3DMATERIAL7));
+			}
 		}
 	}
 	delete []Mtrl;
+	delete []MtrlName;
 	Mtrl = tmp_Mtrl;
+	MtrlName = tmp_Name;
 	nMtrl--;
 	return true;
 }
 
+// Material equality as seen by the renderer. Compares values rather than
+// bytes, so that e.g. 0 and -0 are treated as equal.
+static bool SameMaterial (const D3DMATERIAL7 &a, const D3DMATERIAL7 &b)
+{
+	const D3DCOLORVALUE *ca[4] = { &a.diffuse, &a.ambient, &a.specular, &a.emissive };
+	const D3DCOLORVALUE *cb[4] = { &b.diffuse, &b.ambient, &b.specular, &b.emissive };
+	for (int i = 0; i < 4; i++)
+		if (ca[i]->r != cb[i]->r || ca[i]->g != cb[i]->g || ca[i]->b != cb[i]->b || ca[i]->a != cb[i]->a)
+			return false;
+	return a.power == b.power;
+}
+
+// FNV-1a of the colours and power of a material. -0 is hashed as 0, as
+// SameMaterial treats them as equal.
+static DWORD MaterialHash (const D3DMATERIAL7 &m)
+{
+	const D3DVALUE *c[4] = { &m.diffuse.r, &m.ambient.r, &m.specular.r, &m.emissive.r };
+	D3DVALUE v[17];
+	for (int i = 0; i < 4; i++)
+		for (int k = 0; k < 4; k++) v[i*4+k] = c[i][k] + 0.0f;
+	v[16] = m.power + 0.0f;
+	const unsigned char *b = (const unsigned char*)v;
+	DWORD h = 2166136261u;
+	for (size_t i = 0; i < sizeof(v); i++)
+		h = (h ^ b[i]) * 16777619u;
+	return h;
+}
+
+// Open addressing table of unique list entries for RemoveDuplicateMaterials
+// and RemoveDuplicateTextures, with at least twice as many slots as entries
+static DWORD *NewDedupTable (DWORD n, DWORD &nslot)
+{
+	for (nslot = 16; nslot < 2*n; nslot *= 2);
+	DWORD *slot = new DWORD[nslot];
+	for (DWORD i = 0; i < nslot; i++) slot[i] = (DWORD)-1;
+	return slot;
+}
+
+DWORD Mesh::RemoveDuplicateMaterials ()
+{
+	DWORD i, j, g, n;
+	if (!nMtrl) return 0;
+
+	bool *used = new bool[nMtrl];
+	DWORD *map = new DWORD[nMtrl];
+	memset (used, 0, nMtrl*sizeof(bool));
+	for (g = 0; g < nGrp; g++)
+		if (Grp[g].MtrlIdx < nMtrl) used[Grp[g].MtrlIdx] = true;
+
+	// compact in place: entries below n are the unique materials kept so
+	// far, and the hash table holds their indices
+	DWORD nslot, *slot = NewDedupTable (nMtrl, nslot);
+	for (i = n = 0; i < nMtrl; i++) {
+		if (!used[i]) continue;
+		for (j = MaterialHash (Mtrl[i]) & (nslot-1); slot[j] != (DWORD)-1; j = (j+1) & (nslot-1))
+			if (SameMaterial (Mtrl[slot[j]], Mtrl[i])) break;
+		if (slot[j] == (DWORD)-1) {
+			if (n != i) {
+				Mtrl[n] = Mtrl[i];
+				MtrlName[n] = MtrlName[i];
+			}
+			slot[j] = n++;
+		}
+		map[i] = slot[j];
+	}
+	for (g = 0; g < nGrp; g++)
+		if (Grp[g].MtrlIdx < nMtrl) Grp[g].MtrlIdx = map[Grp[g].MtrlIdx];
+	delete []used;
+	delete []map;
+	delete []slot;
+
+	DWORD removed = nMtrl-n;
+	if (!(nMtrl = n)) {
+		delete []Mtrl;
+		delete []MtrlName;
+		Mtrl = 0;
+		MtrlName = 0;
+	}
+	return removed;
+}
+
+int Mesh::AddTexture (const char *name)
+{
+	DWORD *tmp_Name = new DWORD[nTex+1];
+	memcpy (tmp_Name, TexName, sizeof(DWORD)*nTex);
+	tmp_Name[nTex] = Strings.Add (name);
+	if (nTex) delete []TexName;
+	TexName = tmp_Name;
+	return nTex++;
+}
+
+// Texture file name equality, ignoring case and the type of path separator
+static bool SameTextureName (const char *a, const char *b)
+{
+	for (;; a++, b++) {
+		int ca = (*a == '/' ? '\\' : toupper ((unsigned char)*a));
+		int cb = (*b == '/' ? '\\' : toupper ((unsigned char)*b));
+		if (ca != cb) return false;
+		if (!ca) return true;
+	}
+}
+
+// FNV-1a of a texture file name, consistent with SameTextureName
+static DWORD TextureNameHash (const char *name)
+{
+	DWORD h = 2166136261u;
+	for (; *name; name++)
+		h = (h ^ (DWORD)(*name == '/' ? '\\' : toupper ((unsigned char)*name))) * 16777619u;
+	return h;
+}
+
+DWORD Mesh::RemoveDuplicateTextures ()
+{
+	DWORD i, j, g, n;
+	if (!nTex) return 0;
+
+	bool *used = new bool[nTex];
+	DWORD *map = new DWORD[nTex];
+	memset (used, 0, nTex*sizeof(bool));
+	for (g = 0; g < nGrp; g++)
+		if (Grp[g].TexIdx < nTex) used[Grp[g].TexIdx] = true;
+
+	DWORD nslot, *slot = NewDedupTable (nTex, nslot);
+	for (i = n = 0; i < nTex; i++) {
+		if (!used[i]) continue;
+		const char *name = Strings.Get (TexName[i]);
+		for (j = TextureNameHash (name) & (nslot-1); slot[j] != (DWORD)-1; j = (j+1) & (nslot-1))
+			if (TexName[slot[j]] == TexName[i] ||
+				SameTextureName (Strings.Get (TexName[slot[j]]), name)) break;
+		if (slot[j] == (DWORD)-1) {
+			if (n != i) TexName[n] = TexName[i];
+			slot[j] = n++;
+		}
+		map[i] = slot[j];
+	}
+	for (g = 0; g < nGrp; g++)
+		if (Grp[g].TexIdx < nTex) Grp[g].TexIdx = map[Grp[g].TexIdx];
+	delete []used;
+	delete []map;
+	delete []slot;
+
+	DWORD removed = nTex-n;
+	if (!(nTex = n)) {
+		delete []TexName;
+		TexName = 0;
+	}
+	return removed;
+}
+
 void Mesh::Clear ()
 {
 	for (DWORD i = 0; i < nGrp; i++) {
-		delete []Grp[i].Vtx;
-		delete []Grp[i].Idx;
+		ReleaseBuffer (Grp[i].Vtx, Grp[i].VtxRef);
+		ReleaseBuffer (Grp[i].Idx, Grp[i].IdxRef);
 	}
 	if (nGrp) {
 		delete []Grp;
@@ -358,8 +818,14 @@ void Mesh::Clear ()
 	}
 	if (nMtrl) {
 		delete []Mtrl;
+		delete []MtrlName;
 		nMtrl = 0;
 	}
+	if (nTex) {
+		delete []TexName;
+		nTex = 0;
+	}
+	Strings.Clear ();
 	if (GrpVis) {
 		delete []GrpCnt;
 		delete []GrpRad;
@@ -369,27 +835,99 @@ void Mesh::Clear ()
 	GrpSetup = false;
 }
 
+#ifdef SIMD_SSE2
+// Four NTVERTEX records transposed into one register per vertex component.
+// NTVERTEX is 8 floats, so each record is loaded as two halves which are
+// transposed separately.
+struct VtxBlock { __m128 x, y, z, nx, ny, nz, tu, tv; };
+
+static inline void LoadVtxBlock (const NTVERTEX *v, VtxBlock &b)
+{
+	__m128 r0 = _mm_loadu_ps (&v[0].x), r1 = _mm_loadu_ps (&v[1].x);
+	__m128 r2 = _mm_loadu_ps (&v[2].x), r3 = _mm_loadu_ps (&v[3].x);
+	_MM_TRANSPOSE4_PS (r0, r1, r2, r3);
+	b.x = r0, b.y = r1, b.z = r2, b.nx = r3;
+	r0 = _mm_loadu_ps (&v[0].ny), r1 = _mm_loadu_ps (&v[1].ny);
+	r2 = _mm_loadu_ps (&v[2].ny), r3 = _mm_loadu_ps (&v[3].ny);
+	_MM_TRANSPOSE4_PS (r0, r1, r2, r3);
+	b.ny = r0, b.nz = r1, b.tu = r2, b.tv = r3;
+}
+
+static inline void StoreVtxBlock (NTVERTEX *v, const VtxBlock &b)
+{
+	__m128 r0 = b.x, r1 = b.y, r2 = b.z, r3 = b.nx;
+	_MM_TRANSPOSE4_PS (r0, r1, r2, r3);
+	_mm_storeu_ps (&v[0].x, r0), _mm_storeu_ps (&v[1].x, r1);
+	_mm_storeu_ps (&v[2].x, r2), _mm_storeu_ps (&v[3].x, r3);
+	r0 = b.ny, r1 = b.nz, r2 = b.tu, r3 = b.tv;
+	_MM_TRANSPOSE4_PS (r0, r1, r2, r3);
+	_mm_storeu_ps (&v[0].ny, r0), _mm_storeu_ps (&v[1].ny, r1);
+	_mm_storeu_ps (&v[2].ny, r2), _mm_storeu_ps (&v[3].ny, r3);
+}
+
+// Zero-length normals (e.g. of unused vertices of NONORMAL groups) are
+// left alone instead of becoming NaN
+static inline void NormaliseVtxBlock (VtxBlock &b)
+{
+	const __m128 one = _mm_set1_ps (1.0f);
+	__m128 len2 = _mm_add_ps (_mm_add_ps (_mm_mul_ps (b.nx, b.nx), _mm_mul_ps (b.ny, b.ny)), _mm_mul_ps (b.nz, b.nz));
+	__m128 nonzero = _mm_cmpneq_ps (len2, _mm_setzero_ps ());
+	__m128 ilen = _mm_div_ps (one, _mm_sqrt_ps (len2));
+	ilen = _mm_or_ps (_mm_and_ps (nonzero, ilen), _mm_andnot_ps (nonzero, one));
+	b.nx = _mm_mul_ps (b.nx, ilen);
+	b.ny = _mm_mul_ps (b.ny, ilen);
+	b.nz = _mm_mul_ps (b.nz, ilen);
+}
+#endif // SIMD_SSE2
+
 void Mesh::ScaleGroup (DWORD grp, D3DVALUE sx, D3DVALUE sy, D3DVALUE sz)
 {
-	int i, nv = Grp[grp].nVtx;
+	int i = 0, nv = Grp[grp].nVtx;
+	UnshareGroup (grp, true, false);
 	NTVERTEX *vtx = Grp[grp].Vtx;
-	for (i = 0; i < nv; i++) {
+	if (sx == sy && sx == sz) { // no change in normals
+		// only x, y and z are touched, and the scalar loop is as fast as
+		// SSE (-bench kernels)
+		for (; i < nv; i++) {
+			vtx[i].x *= sx;
+			vtx[i].y *= sy;
+			vtx[i].z *= sz;
+		}
+		if (GrpSetup && !bDeferSetup) SetupGroup (grp);
+		return;
+	}
+	D3DVALUE snx = sy*sz, sny = sx*sz, snz = sx*sy;
+#ifdef SIMD_SSE2
+	__m128 msx = _mm_set1_ps (sx), msy = _mm_set1_ps (sy), msz = _mm_set1_ps (sz);
+	__m128 mnx = _mm_set1_ps (snx), mny = _mm_set1_ps (sny), mnz = _mm_set1_ps (snz);
+	for (; i+4 <= nv; i += 4) {
+		VtxBlock b;
+		LoadVtxBlock (vtx+i, b);
+		b.x = _mm_mul_ps (b.x, msx);
+		b.y = _mm_mul_ps (b.y, msy);
+		b.z = _mm_mul_ps (b.z, msz);
+		b.nx = _mm_mul_ps (b.nx, mnx);
+		b.ny = _mm_mul_ps (b.ny, mny);
+		b.nz = _mm_mul_ps (b.nz, mnz);
+		NormaliseVtxBlock (b);
+		StoreVtxBlock (vtx+i, b);
+	}
+#endif
+	for (; i < nv; i++) {
 		vtx[i].x *= sx;
 		vtx[i].y *= sy;
 		vtx[i].z *= sz;
-	}
-	if (sx == sy && sx == sz) return; // no change in normals
-	D3DVALUE snx = sy*sz, sny = sx*sz, snz = sx*sy;
-	for (i = 0; i < nv; i++) {
 		vtx[i].nx *= snx;
 		vtx[i].ny *= sny;
 		vtx[i].nz *= snz;
-		D3DVALUE ilen = (D3DVALUE)(1.0/sqrt (vtx[i].nx*vtx[i].nx + vtx[i].ny*vtx[i].ny + vtx[i].nz*vtx[i].nz));
+		D3DVALUE len2 = vtx[i].nx*vtx[i].nx + vtx[i].ny*vtx[i].ny + vtx[i].nz*vtx[i].nz;
+		if (len2 == 0.0f) continue; // no normal to renormalise
+		D3DVALUE ilen = (D3DVALUE)(1.0/sqrt (len2));
 		vtx[i].nx *= ilen;
 		vtx[i].ny *= ilen;
 		vtx[i].nz *= ilen;
 	}
-	if (GrpSetup) SetupGroup (grp);
+	if (GrpSetup && !bDeferSetup) SetupGroup (grp);
 }
 
 void Mesh::Scale (D3DVALUE sx, D3DVALUE sy, D3DVALUE sz)
@@ -401,6 +939,7 @@ void Mesh::Scale (D3DVALUE sx, D3DVALUE sy, D3DVALUE sz)
 void Mesh::TranslateGroup (DWORD grp, D3DVALUE dx, D3DVALUE dy, D3DVALUE dz)
 {
 	int i, nv = Grp[grp].nVtx;
+	UnshareGroup (grp, true, false);
 	NTVERTEX *vtx = Grp[grp].Vtx;
 	for (i = 0; i < nv; i++) {
 		vtx[i].x += dx;
@@ -422,12 +961,13 @@ void Mesh::Translate (D3DVALUE dx, D3DVALUE dy, D3DVALUE dz)
 
 void Mesh::RotateGroup (DWORD grp, RotAxis axis, D3DVALUE angle)
 {
-	int i, nv = Grp[grp].nVtx;
+	int i = 0, nv = Grp[grp].nVtx;
+	UnshareGroup (grp, true, false);
 	NTVERTEX *vtx = Grp[grp].Vtx;
 	D3DVALUE cosa = (D3DVALUE)cos(angle), sina = (D3DVALUE)sin(angle);
 	switch (axis) {
 	case ROTATE_X:
-		for (i = 0; i < nv; i++) {
+		for (; i < nv; i++) {
 			D3DVALUE y = vtx[i].y, z = vtx[i].z;
 			vtx[i].y = cosa*y - sina*z;
 			vtx[i].z = sina*y + cosa*z;
@@ -442,7 +982,7 @@ void Mesh::RotateGroup (DWORD grp, RotAxis axis, D3DVALUE angle)
 		}
 		break;
 	case ROTATE_Y:
-		for (i = 0; i < nv; i++) {
+		for (; i < nv; i++) {
 			D3DVALUE x = vtx[i].x, z = vtx[i].z;
 			vtx[i].x = cosa*x - sina*z;
 			vtx[i].z = sina*x + cosa*z;
@@ -457,7 +997,7 @@ void Mesh::RotateGroup (DWORD grp, RotAxis axis, D3DVALUE angle)
 		}
 		break;
 	case ROTATE_Z:
-		for (i = 0; i < nv; i++) {
+		for (; i < nv; i++) {
 			D3DVALUE x = vtx[i].x, y = vtx[i].y;
 			vtx[i].x = cosa*x - sina*y;
 			vtx[i].y = sina*x + cosa*y;
@@ -482,29 +1022,72 @@ void Mesh::Rotate (RotAxis axis, D3DVALUE angle)
 
 void Mesh::TransformGroup (DWORD grp, const D3DMATRIX &mat)
 {
-	int i, nv = Grp[grp].nVtx;
+	int i = 0, nv = Grp[grp].nVtx;
+	UnshareGroup (grp, true, false);
 	NTVERTEX *vtx = Grp[grp].Vtx;
 	FLOAT x, y, z, w;
 
-	for (i = 0; i < nv; i++) {
+	// affine transformations don't need the perspective divide
+	bool affine = (mat._14 == 0.0f && mat._24 == 0.0f && mat._34 == 0.0f && mat._44 == 1.0f);
+
+#ifdef SIMD_SSE2
+	__m128 m11 = _mm_set1_ps (mat._11), m12 = _mm_set1_ps (mat._12), m13 = _mm_set1_ps (mat._13), m14 = _mm_set1_ps (mat._14);
+	__m128 m21 = _mm_set1_ps (mat._21), m22 = _mm_set1_ps (mat._22), m23 = _mm_set1_ps (mat._23), m24 = _mm_set1_ps (mat._24);
+	__m128 m31 = _mm_set1_ps (mat._31), m32 = _mm_set1_ps (mat._32), m33 = _mm_set1_ps (mat._33), m34 = _mm_set1_ps (mat._34);
+	__m128 m41 = _mm_set1_ps (mat._41), m42 = _mm_set1_ps (mat._42), m43 = _mm_set1_ps (mat._43), m44 = _mm_set1_ps (mat._44);
+	for (; i+4 <= nv; i += 4) {
+		VtxBlock b;
+		LoadVtxBlock (vtx+i, b);
+		__m128 vx = _mm_add_ps (_mm_add_ps (_mm_mul_ps (b.x, m11), _mm_mul_ps (b.y, m21)), _mm_add_ps (_mm_mul_ps (b.z, m31), m41));
+		__m128 vy = _mm_add_ps (_mm_add_ps (_mm_mul_ps (b.x, m12), _mm_mul_ps (b.y, m22)), _mm_add_ps (_mm_mul_ps (b.z, m32), m42));
+		__m128 vz = _mm_add_ps (_mm_add_ps (_mm_mul_ps (b.x, m13), _mm_mul_ps (b.y, m23)), _mm_add_ps (_mm_mul_ps (b.z, m33), m43));
+		if (!affine) {
+			__m128 vw = _mm_add_ps (_mm_add_ps (_mm_mul_ps (b.x, m14), _mm_mul_ps (b.y, m24)), _mm_add_ps (_mm_mul_ps (b.z, m34), m44));
+			vx = _mm_div_ps (vx, vw);
+			vy = _mm_div_ps (vy, vw);
+			vz = _mm_div_ps (vz, vw);
+		}
+		b.x = vx, b.y = vy, b.z = vz;
+
+		vx = _mm_add_ps (_mm_add_ps (_mm_mul_ps (b.nx, m11), _mm_mul_ps (b.ny, m21)), _mm_mul_ps (b.nz, m31));
+		vy = _mm_add_ps (_mm_add_ps (_mm_mul_ps (b.nx, m12), _mm_mul_ps (b.ny, m22)), _mm_mul_ps (b.nz, m32));
+		vz = _mm_add_ps (_mm_add_ps (_mm_mul_ps (b.nx, m13), _mm_mul_ps (b.ny, m23)), _mm_mul_ps (b.nz, m33));
+		b.nx = vx, b.ny = vy, b.nz = vz;
+		NormaliseVtxBlock (b);
+		StoreVtxBlock (vtx+i, b);
+	}
+#endif
+
+	for (; i < nv; i++) {
 		NTVERTEX &v = vtx[i];
 		x = v.x*mat._11 + v.y*mat._21 + v.z* mat._31 + mat._41;
 		y = v.x*mat._12 + v.y*mat._22 + v.z* mat._32 + mat._42;
 		z = v.x*mat._13 + v.y*mat._23 + v.z* mat._33 + mat._43;
-		w = v.x*mat._14 + v.y*mat._24 + v.z* mat._34 + mat._44;
-    	v.x = x/w;
-		v.y = y/w;
-		v.z = z/w;
+		if (affine) {
+			v.x = x;
+			v.y = y;
+			v.z = z;
+		} else {
+			w = v.x*mat._14 + v.y*mat._24 + v.z* mat._34 + mat._44;
+			v.x = x/w;
+			v.y = y/w;
+			v.z = z/w;
+		}
 
 		x = v.nx*mat._11 + v.ny*mat._21 + v.nz* mat._31;
 		y = v.nx*mat._12 + v.ny*mat._22 + v.nz* mat._32;
 		z = v.nx*mat._13 + v.ny*mat._23 + v.nz* mat._33;
-		w = 1.0f/(FLOAT)sqrt (x*x + y*y + z*z);
+		w = x*x + y*y + z*z;
+		if (w == 0.0f) { // no normal to renormalise
+			v.nx = x, v.ny = y, v.nz = z;
+			continue;
+		}
+		w = 1.0f/(FLOAT)sqrt (w);
 		v.nx = x*w;
 		v.ny = y*w;
 		v.nz = z*w;
 	}
-	if (GrpSetup) SetupGroup (grp);
+	if (GrpSetup && !bDeferSetup) SetupGroup (grp);
 }
 
 void Mesh::Transform (const D3DMATRIX &mat)
@@ -516,6 +1099,7 @@ void Mesh::Transform (const D3DMATRIX &mat)
 void Mesh::TexScaleGroup (DWORD grp, D3DVALUE su, D3DVALUE sv)
 {
 	int i, nv = Grp[grp].nVtx;
+	UnshareGroup (grp, true, false);
 	NTVERTEX *vtx = Grp[grp].Vtx;
 	for (i = 0; i < nv; i++) {
 		vtx[i].tu *= su;
@@ -529,64 +1113,278 @@ void Mesh::TexScale (D3DVALUE su, D3DVALUE sv)
 		TexScaleGroup (grp, su, sv);
 }
 
-void Mesh::CalcNormals (DWORD grp, bool missingonly)
+void Mesh::SetNormalOptions (NormalWeight weight, D3DVALUE crease)
+{
+	nmlWeight = weight;
+	nmlCrease = (crease > 0.0f && crease < g_PI ? crease : 0.0f);
+}
+
+// Unit normal of triangle i0,i1,i2 and the weights of its three corners.
+// Returns false for degenerate triangles.
+static bool FaceNormal (const NTVERTEX *vtx, DWORD i0, DWORD i1, DWORD i2,
+	Mesh::NormalWeight weight, D3DVECTOR &nm, D3DVALUE *w)
 {
 	const float eps = 1e-8f;
-	int i, nv = Grp[grp].nVtx, nt = Grp[grp].nIdx/3;
+	D3DVECTOR V01 = { vtx[i1].x - vtx[i0].x, vtx[i1].y - vtx[i0].y, vtx[i1].z - vtx[i0].z };
+	D3DVECTOR V02 = { vtx[i2].x - vtx[i0].x, vtx[i2].y - vtx[i0].y, vtx[i2].z - vtx[i0].z };
+	D3DVECTOR V12 = { vtx[i2].x - vtx[i1].x, vtx[i2].y - vtx[i1].y, vtx[i2].z - vtx[i1].z };
+	nm = D3DMath_CrossProduct (V01, V02);
+	D3DVALUE len = D3DMath_Length (nm);
+	if (len < eps) return false;
+
+	nm.x /= len, nm.y /= len, nm.z /= len;
+	if (weight == Mesh::NMLWEIGHT_AREA) {
+		w[0] = w[1] = w[2] = len;
+		return true;
+	}
+
+	// corner angles from the edge vectors: cos a = (u.v)/(|u||v|)
+	D3DVALUE d01 = D3DMath_Length2 (V01);
+	D3DVALUE d02 = D3DMath_Length2 (V02);
+	D3DVALUE d12 = D3DMath_Length2 (V12);
+	D3DVALUE c0 =  (V01.x*V02.x + V01.y*V02.y + V01.z*V02.z) / (D3DVALUE)sqrt (d01*d02);
+	D3DVALUE c1 = -(V01.x*V12.x + V01.y*V12.y + V01.z*V12.z) / (D3DVALUE)sqrt (d01*d12);
+	D3DVALUE c2 =  (V02.x*V12.x + V02.y*V12.y + V02.z*V12.z) / (D3DVALUE)sqrt (d02*d12);
+	if (weight == Mesh::NMLWEIGHT_ANGLE_FAST) {
+		w[0] = D3DMath_FastAcos (c0);
+		w[1] = D3DMath_FastAcos (c1);
+		w[2] = D3DMath_FastAcos (c2);
+	} else {
+		w[0] = (D3DVALUE)acos (c0 < -1.0f ? -1.0f : c0 > 1.0f ? 1.0f : c0);
+		w[1] = (D3DVALUE)acos (c1 < -1.0f ? -1.0f : c1 > 1.0f ? 1.0f : c1);
+		w[2] = (D3DVALUE)acos (c2 < -1.0f ? -1.0f : c2 > 1.0f ? 1.0f : c2);
+	}
+	return true;
+}
+
+DWORD Mesh::CalcNormals (DWORD grp, bool missingonly)
+{
+	int i, j, k, nv = Grp[grp].nVtx, nt = Grp[grp].nIdx/3;
+	UnshareGroup (grp);
+	DWORD ndegen = 0;
 	WORD *idx = Grp[grp].Idx;
 	NTVERTEX *vtx = Grp[grp].Vtx;
 	bool *calcNml = new bool[nv];
 	if (missingonly) {
+		int nmissing = 0;
 		for (i = 0; i < nv; i++) {
 			if (vtx[i].nx*vtx[i].nx + vtx[i].ny*vtx[i].ny + vtx[i].nz*vtx[i].nz > 0.1f) {
 				calcNml[i] = false; // flag for "leave normal alone"
 			} else {
 				calcNml[i] = true;
 				vtx[i].nx = vtx[i].ny = vtx[i].nz = 0.0f;
+				nmissing++;
 			}
 		}
+		if (!nmissing) {
+			delete []calcNml;
+			return 0;
+		}
 	} else {
 		for (i = 0; i < nv; i++) {
 			calcNml[i] = true;
 			vtx[i].nx = vtx[i].ny = vtx[i].nz = 0.0f;
 		}
 	}
-	for (i = 0; i < nt; i++) {
-		DWORD i0 = idx[i*3], i1 = idx[i*3+1], i2 = idx[i*3+2];
-		if (!calcNml[i0] && !calcNml[i1] && !calcNml[i2])
-			continue; // nothing to do for this triangle
-		D3DVECTOR V01 = { vtx[i1].x - vtx[i0].x, vtx[i1].y - vtx[i0].y, vtx[i1].z - vtx[i0].z };
-		D3DVECTOR V02 = { vtx[i2].x - vtx[i0].x, vtx[i2].y - vtx[i0].y, vtx[i2].z - vtx[i0].z };
-		D3DVECTOR V12 = { vtx[i2].x - vtx[i1].x, vtx[i2].y - vtx[i1].y, vtx[i2].z - vtx[i1].z };
-		D3DVECTOR nm = D3DMath_CrossProduct (V01, V02);
-		D3DVALUE len = D3DMath_Length (nm);
-
-		if (len >= eps) {
-			nm.x /= len, nm.y /= len, nm.z /= len;
-			D3DVALUE d01 = D3DMath_Length(V01);
-			D3DVALUE d02 = D3DMath_Length(V02);
-			D3DVALUE d12 = D3DMath_Length(V12);
-			if (calcNml[i0]) {
-				D3DVALUE a0 = acos((d01 * d01 + d02 * d02 - d12 * d12) / (2.0f * d01 * d02));
-				vtx[i0].nx += nm.x * a0, vtx[i0].ny += nm.y * a0, vtx[i0].nz += nm.z * a0;
+
+	if (nmlCrease <= 0.0f) {
+		// smooth across all shared vertices: accumulate directly
+		for (i = 0; i < nt; i++) {
+			DWORD i0 = idx[i*3], i1 = idx[i*3+1], i2 = idx[i*3+2];
+			D3DVECTOR nm;
+			D3DVALUE w[3];
+			if (!calcNml[i0] && !calcNml[i1] && !calcNml[i2])
+				continue; // nothing to do for this triangle
+			if (!FaceNormal (vtx, i0, i1, i2, nmlWeight, nm, w)) {
+				ndegen++;
+				continue;
+			}
+			if (calcNml[i0]) vtx[i0].nx += nm.x * w[0], vtx[i0].ny += nm.y * w[0], vtx[i0].nz += nm.z * w[0];
+			if (calcNml[i1]) vtx[i1].nx += nm.x * w[1], vtx[i1].ny += nm.y * w[1], vtx[i1].nz += nm.z * w[1];
+			if (calcNml[i2]) vtx[i2].nx += nm.x * w[2], vtx[i2].ny += nm.y * w[2], vtx[i2].nz += nm.z * w[2];
+		}
+	} else {
+		// Split along creases. The corners around each vertex are sorted into
+		// clusters whose face normals lie within the crease angle of the face
+		// that opened the cluster. The first cluster keeps the vertex, every
+		// further cluster becomes a new vertex appended to the group.
+		int nc = nt*3, ncl = 0, nsplit = 0;
+		D3DVALUE cosCrease = (D3DVALUE)cos (nmlCrease);
+		D3DVECTOR *fnm = new D3DVECTOR[nt]; // unit face normals
+		bool *fok = new bool[nt];           // false for degenerate faces
+		D3DVALUE *cw = new D3DVALUE[nc];    // corner weights
+		int *vofs = new int[nv+1];          // corner list offsets per vertex
+		int *vcrn = new int[nc];            // corners sorted by vertex
+		int *cclus = new int[nc];           // cluster of each corner
+		// a vertex without valid corners still gets one cluster, so there
+		// are at most nc+nv clusters
+		int *cseed = new int[nc+nv];        // face that opened each cluster
+		int *cown = new int[nc+nv];         // vertex owning each cluster
+		D3DVECTOR *cnm = new D3DVECTOR[nc+nv]; // accumulated cluster normals
+
+		// only faces around vertices that need a normal are used
+		for (i = 0; i < nt; i++) {
+			DWORD i0 = idx[i*3], i1 = idx[i*3+1], i2 = idx[i*3+2];
+			if (!calcNml[i0] && !calcNml[i1] && !calcNml[i2]) fok[i] = false;
+			else if (!(fok[i] = FaceNormal (vtx, i0, i1, i2, nmlWeight, fnm[i], cw+i*3))) ndegen++;
+		}
+		memset (vofs, 0, (nv+1)*sizeof(int));
+		for (i = 0; i < nc; i++) vofs[idx[i]+1]++;
+		for (i = 0; i < nv; i++) vofs[i+1] += vofs[i];
+		for (i = 0; i < nc; i++) vcrn[vofs[idx[i]]++] = i;
+		for (i = nv; i > 0; i--) vofs[i] = vofs[i-1];
+		vofs[0] = 0;
+
+		for (i = 0; i < nv; i++) {
+			if (!calcNml[i]) continue;
+			int first = ncl;
+			for (j = vofs[i]; j < vofs[i+1]; j++) {
+				int c = vcrn[j], t = c/3;
+				if (!fok[t]) continue;
+				for (k = first; k < ncl; k++) {
+					const D3DVECTOR &s = fnm[cseed[k]];
+					if (s.x*fnm[t].x + s.y*fnm[t].y + s.z*fnm[t].z >= cosCrease) break;
+				}
+				if (k == ncl) {
+					cseed[ncl] = t;
+					cown[ncl] = i;
+					cnm[ncl].x = cnm[ncl].y = cnm[ncl].z = 0.0f;
+					ncl++;
+				}
+				cnm[k].x += fnm[t].x * cw[c], cnm[k].y += fnm[t].y * cw[c], cnm[k].z += fnm[t].z * cw[c];
+				cclus[c] = k;
 			}
-			if (calcNml[i1]) {
-				D3DVALUE a1 = acos((d01 * d01 + d12 * d12 - d02 * d02) / (2.0f * d01 * d12));
-				vtx[i1].nx += nm.x * a1, vtx[i1].ny += nm.y * a1, vtx[i1].nz += nm.z * a1;
+			if (ncl == first) { // no valid faces: keep a single empty cluster
+				cseed[ncl] = -1;
+				cown[ncl] = i;
+				cnm[ncl].x = cnm[ncl].y = cnm[ncl].z = 0.0f;
+				ncl++;
 			}
-			if (calcNml[i2]) {
-				D3DVALUE a2 = acos((d02 * d02 + d12 * d12 - d01 * d01) / (2.0f * d02 * d12));
-				vtx[i2].nx += nm.x * a2, vtx[i2].ny += nm.y * a2, vtx[i2].nz += nm.z * a2;
+			for (j = vofs[i]; j < vofs[i+1]; j++)
+				if (!fok[vcrn[j]/3]) cclus[vcrn[j]] = first;
+			nsplit += ncl-first-1;
+		}
+
+		// Split only if the new vertices are still addressable by 16-bit
+		// indices. Otherwise all clusters collapse back into their vertex.
+		if (nsplit && nv+nsplit <= 0x10000) {
+			BufferRef *vref;
+			NTVERTEX *v = NewBuffer<NTVERTEX> (ListArena, nv+nsplit, vref);
+			memcpy (v, vtx, nv*sizeof(NTVERTEX));
+			for (k = 0, j = nv, i = -1; k < ncl; k++) {
+				if (cown[k] == i) v[j] = vtx[i], cown[k] = j++;
+				else i = cown[k];
 			}
+			for (i = 0; i < nc; i++)
+				if (calcNml[idx[i]]) idx[i] = (WORD)cown[cclus[i]];
+			ReleaseBuffer (Grp[grp].Vtx, Grp[grp].VtxRef);
+			Grp[grp].Vtx = vtx = v;
+			Grp[grp].VtxRef = vref;
+			Grp[grp].nVtx = nv+nsplit;
 		}
+		for (k = 0; k < ncl; k++)
+			vtx[cown[k]].nx += cnm[k].x, vtx[cown[k]].ny += cnm[k].y, vtx[cown[k]].nz += cnm[k].z;
+
+		delete []fnm;
+		delete []fok;
+		delete []cw;
+		delete []vofs;
+		delete []vcrn;
+		delete []cclus;
+		delete []cseed;
+		delete []cown;
+		delete []cnm;
 	}
-	for (i = 0; i < nv; i++)
-		if (calcNml[i]) {
+
+	for (i = 0; i < (int)Grp[grp].nVtx; i++)
+		if (i >= nv || calcNml[i]) {
 			D3DVECTOR nm = { vtx[i].nx, vtx[i].ny, vtx[i].nz };
 			D3DVALUE len = D3DMath_Length(nm);
-			vtx[i].nx /= len, vtx[i].ny /= len, vtx[i].nz /= len;
+			if (len > 0.0f) vtx[i].nx /= len, vtx[i].ny /= len, vtx[i].nz /= len;
 		}
 	delete []calcNml;
+	return ndegen;
+}
+
+bool Mesh::CleanupGroup (DWORD grp, CleanupCount *count)
+{
+	DWORD i, j, n, nt, nv;
+	CleanupCount c = { 0, 0, 0 };
+	if (count) *count = c;
+	if (grp >= nGrp) return false;
+	UnshareGroup (grp);
+	WORD *idx = Grp[grp].Idx;
+	NTVERTEX *vtx = Grp[grp].Vtx;
+	nt = Grp[grp].nIdx/3;
+	nv = Grp[grp].nVtx;
+
+	// drop zero-area triangles, compacting the index list in place
+	D3DVECTOR nm;
+	D3DVALUE w[3];
+	for (i = n = 0; i < nt; i++) {
+		if (!FaceNormal (vtx, idx[i*3], idx[i*3+1], idx[i*3+2], NMLWEIGHT_AREA, nm, w)) {
+			c.nDegenerate++;
+			continue;
+		}
+		if (n != i) memcpy (idx+n*3, idx+i*3, 3*sizeof(WORD));
+		n++;
+	}
+	nt = n;
+
+	// drop repeated triangles: rotate each so that its lowest index comes
+	// first, which keeps the winding, sort and keep the first of each run
+	if (nt > 1) {
+		WORD *key = new WORD[nt*3];
+		DWORD *order = new DWORD[nt];
+		bool *keep = new bool[nt];
+		for (i = 0; i < nt; i++) {
+			const WORD *t = idx+i*3;
+			j = (t[1] < t[0] ? (t[2] < t[1] ? 2 : 1) : (t[2] < t[0] ? 2 : 0));
+			key[i*3] = t[j], key[i*3+1] = t[(j+1)%3], key[i*3+2] = t[(j+2)%3];
+			order[i] = i;
+			keep[i] = true;
+		}
+		std::sort (order, order+nt, [key](DWORD a, DWORD b) {
+			const WORD *ka = key+a*3, *kb = key+b*3;
+			if (ka[0] != kb[0]) return ka[0] < kb[0];
+			if (ka[1] != kb[1]) return ka[1] < kb[1];
+			if (ka[2] != kb[2]) return ka[2] < kb[2];
+			return a < b;
+		});
+		for (i = 1; i < nt; i++)
+			if (!memcmp (key+order[i]*3, key+order[i-1]*3, 3*sizeof(WORD))) {
+				keep[order[i]] = false;
+				c.nDuplicate++;
+			}
+		for (i = n = 0; i < nt; i++) {
+			if (!keep[i]) continue;
+			if (n != i) memcpy (idx+n*3, idx+i*3, 3*sizeof(WORD));
+			n++;
+		}
+		nt = n;
+		delete []key;
+		delete []order;
+		delete []keep;
+	}
+
+	// compact the vertex list to the referenced vertices
+	DWORD *map = new DWORD[nv];
+	for (i = 0; i < nv; i++) map[i] = (DWORD)-1;
+	for (i = 0; i < nt*3; i++) map[idx[i]] = 0;
+	for (i = n = 0; i < nv; i++) {
+		if (map[i]) { c.nUnused++; continue; }
+		if (n != i) vtx[n] = vtx[i];
+		map[i] = n++;
+	}
+	for (i = 0; i < nt*3; i++) idx[i] = (WORD)map[idx[i]];
+	delete []map;
+
+	bool changed = (nt*3 != Grp[grp].nIdx || n != nv);
+	Grp[grp].nIdx = nt*3;
+	Grp[grp].nVtx = n;
+	if (changed && GrpSetup && !bDeferSetup) SetupGroup (grp);
+	if (count) *count = c;
+	return changed;
 }
 
 void Mesh::CalcTexCoords (DWORD grp)
@@ -594,6 +1392,7 @@ void Mesh::CalcTexCoords (DWORD grp)
 	// quick hack. not globally usable
 
 	int i, nv = Grp[grp].nVtx;
+	UnshareGroup (grp, true, false);
 	NTVERTEX *vtx = Grp[grp].Vtx;
 	double ipi = 1.0/Pi, i2pi = 0.5/Pi;
 
@@ -628,7 +1427,8 @@ void Mesh::EnableMatAlpha (bool enable)
 istream &operator>> (istream &is, Mesh &mesh)
 {
 	char cbuf[256];
-	int i, j, g, ngrp, nvtx, ntri, nidx, nmtrl, mtrl_idx, ntex, tex_idx, flag, res;
+	Str256 label;
+	int i, j, g, gi, ngrp, nvtx, ntri, nidx, nmtrl, mtrl_idx, ntex, tex_idx, flag, res;
 	DWORD uflag;
 	WORD zbias;
 	D3DMATERIAL7 mtrl;
@@ -649,14 +1449,12 @@ istream &operator>> (istream &is, Mesh &mesh)
 		}
 	}
 
-	mesh.Labels = new Mesh::tex_file[ngrp];
-	int zeroSize = 256 * ngrp;
-	ZeroMemory(mesh.Labels, zeroSize);
 	for (g = 0, term = false; g < ngrp && !term; g++) {
 
 		// set defaults
-		NTVERTEX *vtx;
-		WORD *idx;
+		NTVERTEX *vtx = 0;
+		WORD *idx = 0;
+		BufferRef *vref = 0, *iref = 0;
 		mtrl_idx = SPEC_INHERIT;
 		tex_idx  = SPEC_INHERIT;
 		zbias    = 0;
@@ -665,6 +1463,7 @@ istream &operator>> (istream &is, Mesh &mesh)
 		bool bnormal = true, calcnml = false;
 		bool flipidx = false;
 		nvtx = ntri = 0;
+		label[0] = '\0';
 
 		for (;;) {
 			if (!is.getline (cbuf, 256)) { term = true; break; }
@@ -688,7 +1487,7 @@ istream &operator>> (istream &is, Mesh &mesh)
 			} else if (!_strnicmp (cbuf, "FLIP", 4)) {
 				flipidx = true;
 			} else if (!_strnicmp (cbuf, "LABEL", 5)) {
-				sscanf(cbuf + 5, "%255s", mesh.Labels[g].File);
+				sscanf (cbuf+5, "%255s", label);
 			} else if (!_strnicmp (cbuf, "STATIC", 6)) {
 				flag |= 0x04;
 			} else if (!_strnicmp (cbuf, "DYNAMIC", 7)) {
@@ -696,12 +1495,12 @@ istream &operator>> (istream &is, Mesh &mesh)
 			} else if (!_strnicmp (cbuf, "GEOM", 4)) {    // read geometry
 				if (sscanf (cbuf+4, "%d%d", &nvtx, &ntri) != 2) break; // parse error - skip group
 				nidx = ntri*3;
-				vtx = new NTVERTEX[nvtx];
+				vtx = NewBuffer<NTVERTEX> (mesh.ListArena, nvtx, vref);
 				ZeroMemory (vtx, sizeof (NTVERTEX)*nvtx);
 				for (i = 0; i < nvtx; i++) {
 					NTVERTEX &v = vtx[i];
 					if (!is.getline (cbuf, 256)) {
-						delete []vtx;
+						ReleaseBuffer (vtx, vref);
 						nvtx = 0;
 						break;
 					}
@@ -714,51 +1513,47 @@ istream &operator>> (istream &is, Mesh &mesh)
 							&v.x, &v.y, &v.z, &v.tu, &v.tv);
 					}
 				}
-				idx = new WORD[nidx];
+				idx = NewBuffer<WORD> (mesh.ListArena, nidx, iref);
 				ZeroMemory (idx, sizeof (WORD)*nidx);
 				for (i = j = 0; i < ntri; i++) {
 					if (!is.getline (cbuf, 256)) {
-						delete []vtx;
-						delete []idx;
+						ReleaseBuffer (vtx, vref);
+						ReleaseBuffer (idx, iref);
 						nvtx = nidx = 0;
 						break;
 					}
 					sscanf (cbuf, "%hd%hd%hd", idx+j, idx+j+1, idx+j+2);
 					j += 3;
 				}
-				if (flipidx)
-					for (i = 0; i < ntri; i++) {
-						WORD tmp = idx[i*3+1]; idx[i*3+1] = idx[i*3+2]; idx[i*3+2] = tmp;
-					}
+				if (flipidx) FlipWinding (idx, ntri);
 
 				break;
 			}
 		}
 		if (nvtx && nidx) {
-			mesh.AddGroup (vtx, nvtx, idx, nidx, mtrl_idx, tex_idx, zbias);
-			mesh.Grp[g].Flags = flag;
-			mesh.Grp[g].UsrFlag = uflag;
-			if (calcnml) mesh.CalcNormals (g, true);
-			if (flag & 0x04) mesh.MakeGroupVertexBuffer (g);
+			gi = mesh.AddGroup (vtx, nvtx, idx, nidx, mtrl_idx, tex_idx, zbias);
+			mesh.Grp[gi].VtxRef = vref;
+			mesh.Grp[gi].IdxRef = iref;
+			mesh.Grp[gi].Flags = flag;
+			mesh.Grp[gi].UsrFlag = uflag;
+			mesh.Grp[gi].Label = mesh.Strings.Add (label);
+			mesh.Grp[gi].NoNormal = !bnormal;
+			if (calcnml) mesh.CalcNormals (gi, true);
+			if (flag & 0x04) mesh.MakeGroupVertexBuffer (gi);
+		} else {
+			ReleaseBuffer (vtx, vref);
+			ReleaseBuffer (idx, iref);
 		}
 	}
 
 	// read material list
 	if (is.getline (cbuf, 256) && !strncmp (cbuf, "MATERIALS", 9) && (sscanf (cbuf+9, "%d", &nmtrl) == 1)) {
 		Str256 *matname = new Str256[nmtrl];
-		mesh.MatNames = new Mesh::tex_file[nmtrl];
 		Str256 mnm;
 		for (i = 0; i < nmtrl; i++) {
-			Str256 *curr = &matname[i];
 			is.getline (cbuf, 256);
-			sscanf (cbuf, "%s", matname[i]);
-			ZeroMemory(&mesh.MatNames[i], 256);
-			int len = strlen(matname[i]);
-			for (int c = 0; c < 255; c++)
-			{
-				mesh.MatNames[i].File[c] = cbuf[c];
-			}
-
+			matname[i][0] = '\0';
+			sscanf (cbuf, "%255s", matname[i]);
 		}
 		for (i = 0; i < nmtrl; i++) {
 			ZeroMemory (&mtrl, sizeof (D3DMATERIAL7));
@@ -773,7 +1568,7 @@ istream &operator>> (istream &is, Mesh &mesh)
 			if (res < 5) mtrl.power = 0.0;
 			is.getline (cbuf, 256);
 			sscanf (cbuf, "%f%f%f%f", &mtrl.emissive.r, &mtrl.emissive.g, &mtrl.emissive.b, &mtrl.emissive.a);
-			mesh.AddMaterial (mtrl);
+			mesh.AddMaterial (mtrl, matname[i]);
 		}
 		delete []matname;
 	}
@@ -781,18 +1576,14 @@ istream &operator>> (istream &is, Mesh &mesh)
 	// read texture list
 	if (is.getline (cbuf, 256) && !strncmp (cbuf, "TEXTURES", 8) && (sscanf (cbuf+8, "%d", &ntex) == 1)) {
 		Str256 texname, flagstr;
-		mesh.nTex = ntex;
-		mesh.TexFiles = new Mesh::tex_file[ntex];
 		for (i = 0; i < ntex; i++) {
 			is.getline (cbuf, 256);
-			flagstr[0] = '\0';
+			texname[0] = flagstr[0] = '\0';
 			sscanf (cbuf, "%255s%255s", texname, flagstr);
 			if (texname[0] != '0' || texname[1] != '\0') {
 				bool uncompress = (toupper(flagstr[0]) == 'D');
 			}
-			ZeroMemory(&mesh.TexFiles[i], 256);
-			int length = strlen(texname);
-			for (int t = 0; t < length; t++) mesh.TexFiles[i].File[t] = texname[t];
+			mesh.AddTexture (texname);
 		}
 	}
 
@@ -820,6 +1611,36 @@ bool Mesh::bEnableSpecular = false;
 // Default is (nlat-ilat)*res. bseg is ignored for triangular patches (i.e. where upper
 // latitude is 90)
 
+void FlipWinding (WORD *idx, DWORD ntri)
+{
+	DWORD i = 0;
+#ifdef SIMD_SSE2
+	// 8 triangles (3 registers) at a time. Word k of the block keeps its
+	// value (k%3 == 0), takes that of word k+1 (k%3 == 1) or of word k-1
+	// (k%3 == 2); the shifted words are carried across register boundaries.
+	const __m128i keep[3] = {
+		_mm_setr_epi16 (-1,0,0,-1,0,0,-1,0), _mm_setr_epi16 (0,-1,0,0,-1,0,0,-1), _mm_setr_epi16 (0,0,-1,0,0,-1,0,0) };
+	const __m128i next[3] = {
+		_mm_setr_epi16 (0,-1,0,0,-1,0,0,-1), _mm_setr_epi16 (0,0,-1,0,0,-1,0,0), _mm_setr_epi16 (-1,0,0,-1,0,0,-1,0) };
+	const __m128i prev[3] = {
+		_mm_setr_epi16 (0,0,-1,0,0,-1,0,0), _mm_setr_epi16 (-1,0,0,-1,0,0,-1,0), _mm_setr_epi16 (0,-1,0,0,-1,0,0,-1) };
+	for (; i+8 <= ntri; i += 8) {
+		__m128i *p = (__m128i*)(idx+i*3);
+		__m128i r[3] = { _mm_loadu_si128 (p), _mm_loadu_si128 (p+1), _mm_loadu_si128 (p+2) };
+		for (int k = 0; k < 3; k++) {
+			__m128i n = _mm_srli_si128 (r[k], 2), q = _mm_slli_si128 (r[k], 2);
+			if (k < 2) n = _mm_or_si128 (n, _mm_slli_si128 (r[k+1], 14));
+			if (k > 0) q = _mm_or_si128 (q, _mm_srli_si128 (r[k-1], 14));
+			_mm_storeu_si128 (p+k, _mm_or_si128 (_mm_and_si128 (r[k], keep[k]),
+				_mm_or_si128 (_mm_and_si128 (n, next[k]), _mm_and_si128 (q, prev[k]))));
+		}
+	}
+#endif // SIMD_SSE2
+	for (; i < ntri; i++) {
+		WORD tmp = idx[i*3+1]; idx[i*3+1] = idx[i*3+2]; idx[i*3+2] = tmp;
+	}
+}
+
 void CreateSpherePatch (Mesh &mesh, int nlng, int nlat, int ilat, int res, int bseg, bool reduce, bool outside)
 {
 	const float c1 = 1.0f, c2 = 0.0f; // -1.0f/512.0f; // assumes 256x256 texture patches
@@ -827,7 +1648,6 @@ void CreateSpherePatch (Mesh &mesh, int nlng, int nlat, int ilat, int res, int b
 	int i, j, nVtx, nIdx, nseg, n, nofs0, nofs1;
 	double minlat, maxlat, lat, minlng, maxlng, lng;
 	double slat, clat, slng, clng;
-	WORD tmp;
 	
 	minlat = Pi05 * (double)ilat/(double)nlat;
 	maxlat = Pi05 * (double)(ilat+1)/(double)nlat;
@@ -882,8 +1702,7 @@ void CreateSpherePatch (Mesh &mesh, int nlng, int nlat, int ilat, int res, int b
 		nofs0 = nofs1;
 	}
 	if (!outside)
-		for (i = 0; i < nIdx/3; i += 3)
-			tmp = Idx[i+1], Idx[i+1] = Idx[i+2], Idx[i+2] = tmp;
+		FlipWinding (Idx, nIdx/3);
 
 	mesh.Clear();
 	mesh.AddGroup (Vtx, nVtx, Idx, nIdx, SPEC_INHERIT, SPEC_INHERIT);
@@ -13,6 +13,7 @@
 #include <d3d.h>
 #include <d3dtypes.h>
 #include <iostream>
+#include "StringPool.h"
 //#include "OrbiterAPI.h"
 
 /**
@@ -57,6 +58,9 @@ public:
 // =======================================================================
 // mesh group descriptor
 
+struct BufferRef; // reference count of a shared group buffer (Mesh.cpp)
+class Arena;
+
 typedef struct {
 	NTVERTEX  *Vtx;
 	WORD      *Idx;
@@ -67,6 +71,10 @@ typedef struct {
 	DWORD     UsrFlag;
 	WORD      zBias;
 	WORD      Flags;
+	DWORD     Label;    // label offset in the mesh string pool (0 = no label)
+	bool      NoNormal; // normals were generated (NONORMAL keyword), not read
+	BufferRef *VtxRef;  // reference count while Vtx is shared with copies of the mesh (0 = not shared)
+	BufferRef *IdxRef;  // reference count while Idx is shared with copies of the mesh (0 = not shared)
 } GroupSpec;
 
 // =======================================================================
@@ -77,16 +85,36 @@ public:
 	Mesh ();
 	// Create an empty mesh
 
+	explicit Mesh (Arena *arena);
+	// Create an empty mesh whose vertex and index lists are allocated from
+	// "arena" (see Arena.h) instead of the heap. The lists are released
+	// with the arena, so the arena must outlive the mesh. Copies of the
+	// mesh in other meshes get their own lists instead of sharing them.
+
 	Mesh (NTVERTEX *vtx, DWORD nvtx, WORD *idx, DWORD nidx,
 		DWORD matidx = SPEC_DEFAULT, DWORD texidx = SPEC_DEFAULT);
 	// Create a single-group mesh
 
 	Mesh (const Mesh &mesh);
-	// copy constructor
+	// copy constructor (shares the group buffers, see Set)
+
+	Mesh (Mesh &&mesh);
+	// move constructor. Leaves "mesh" empty.
 
 	~Mesh ();
 
-	void Set (const Mesh &mesh);
+	Mesh &operator= (const Mesh &mesh);
+	Mesh &operator= (Mesh &&mesh);
+	// copy (shares the group buffers, see Set) and move assignment
+
+	void Set (const Mesh &mesh, bool share = true);
+	// Make *this a copy of "mesh". With share=true the vertex and index
+	// lists are not copied but shared by reference count, so the copy costs
+	// O(groups). A shared list is copied when either mesh modifies it (see
+	// UnshareGroup). With share=false all lists are copied.
+	// Sharing is set up on the first copy of a mesh and modifies the
+	// bookkeeping of "mesh", so concurrent copies of a mesh must be
+	// serialised. Copies can then be used by different threads.
 
 	void Setup ();
 	// call after all groups are assembled or whenever groups change,
@@ -98,6 +126,12 @@ public:
 	void SetupGroup (DWORD grp);
 	// Re-apply setup for a particular group (e.g. after transformation)
 
+	void BeginUpdate ();
+	void EndUpdate ();
+	// Bracket a sequence of transformations. In between, the transformation
+	// functions don't update the group bounds; EndUpdate recalculates them
+	// once for all groups.
+
 	inline DWORD nGroup() const { return nGrp; }
 	// Number of groups
 
@@ -107,12 +141,37 @@ public:
 	inline DWORD nTexture() const { return nTex; }
 	// Number of textures
 
-	inline GroupSpec *GetGroup (DWORD grp) { return (grp < nGrp ? Grp+grp : 0); }
+	inline GroupSpec *GetGroup (DWORD grp)
+	{ if (grp >= nGrp) return 0; UnshareGroup (grp); return Grp+grp; }
 	// return a pointer to the group specification for group grp
+	// The group's lists are unshared first, so they may be modified.
+
+	inline const GroupSpec *GetGroup (DWORD grp) const { return (grp < nGrp ? Grp+grp : 0); }
+	// read-only access to group grp, which leaves shared lists shared
+
+	void UnshareGroup (DWORD grp, bool vtx = true, bool idx = true);
+	// Give group grp its own copy of its vertex (vtx=true) and/or index
+	// (idx=true) list if it is shared with a copy of the mesh. All Mesh
+	// functions that modify a group call this first.
 
 	inline DWORD GetGroupUsrFlag (DWORD grp) const { return (grp < nGrp ? Grp[grp].UsrFlag : 0); }
 	// return the user-defined flag for group grp
 
+	inline bool GetGroupBounds (DWORD grp, D3DVECTOR &cnt, D3DVALUE &rad) const
+	{ if (!GrpSetup || grp >= nGrp) return false; cnt = GrpCnt[grp]; rad = GrpRad[grp]; return true; }
+	// return the bounding sphere of group grp as computed by SetupGroup
+	// (false if the mesh has not been set up)
+
+	inline const char *GetLabel (DWORD grp) const
+	{ return (grp < nGrp && Grp[grp].Label ? Strings.Get (Grp[grp].Label) : 0); }
+	void SetLabel (DWORD grp, const char *label);
+	// return/set the label of group grp (0 if the group has no label)
+
+	inline const StringPool &GetStrings () const { return Strings; }
+	// The pool holding all group labels, material names and texture names.
+	// Equal names have equal offsets, so they can be compared by offset
+	// (see StringPool::Find).
+
 	int AddGroup (NTVERTEX *vtx, DWORD nvtx, WORD *idx, DWORD nidx,
 		DWORD mtrl_idx = SPEC_INHERIT, DWORD tex_idx = SPEC_INHERIT,
 		WORD zbias = 0, DWORD flag = 0, bool deepcopy = false);
@@ -134,38 +193,79 @@ public:
 	// copy the group vertex information into a vertex buffer in video memory
 	// Ignored if the device has no T&L capability
 
-	void AddMesh (Mesh &mesh);
+	struct GroupRemap {
+		DWORD Grp;     // group the original group ended up in
+		DWORD VtxOfs;  // offset of its first vertex in that group
+		DWORD nVtx;    // number of vertices
+		DWORD IdxOfs;  // offset of its first index in that group
+		DWORD nIdx;    // number of indices
+	};
+
+	DWORD MergeGroups (const bool *keep = 0, GroupRemap *remap = 0);
+	// Merge groups with identical render state (material, texture, flags,
+	// user flag and z-bias) into the first group of that state, using
+	// AddGroupBlock. A merged group is closed once another block would no
+	// longer be addressable by 16-bit indices. Groups with keep[grp] set are
+	// left untouched. The remaining groups keep their relative order.
+	// Materials and textures set to SPEC_INHERIT are first replaced by
+	// those of the previous group, in all groups, and groups are merged on
+	// the resolved state. Leading groups without a previous one keep
+	// SPEC_INHERIT.
+	// NoNormal is not part of the render state. A merged group keeps it
+	// only if all its members had it.
+	// If remap is given, it must have nGroup() entries and receives the
+	// location of each original group in the merged mesh.
+	// Returns the new number of groups.
+
+	void AddMesh (const Mesh &mesh);
 	// Merge "mesh" into "this", by adding all groups of "mesh"
 	// Currently this does not use the materials and textures of "mesh"
+	// The new groups share the lists of "mesh" (see Set).
 
 	inline D3DMATERIAL7 *GetMaterial (DWORD matidx)
 	{ return (matidx < nMtrl ? Mtrl+matidx : 0); }
+	inline const D3DMATERIAL7 *GetMaterial (DWORD matidx) const
+	{ return (matidx < nMtrl ? Mtrl+matidx : 0); }
 	// return a material pointer
 
-	int AddMaterial (D3DMATERIAL7 &mtrl);
+	int AddMaterial (D3DMATERIAL7 &mtrl, const char *name = 0);
 	// Add new material to the mesh and return its list index
 
+	inline const char *GetMaterialName (DWORD matidx) const
+	{ return (matidx < nMtrl && MtrlName[matidx] ? Strings.Get (MtrlName[matidx]) : 0); }
+	// return the name of a material (0 if it has no name)
+
 	bool DeleteMaterial (DWORD matidx);
 	// Delete material with index 'matidx' from the list. Any groups
 	// using that material are reset to material 0. Any group material
 	// indices > matidx are decremented to account for changed list
 
-	inline char *GetTextureName(DWORD texidx)
-	{
-		if (texidx < nTex)
-		{
-			if (TexFiles[texidx].File[0] == '\0') return nullptr;
-			return TexFiles[texidx].File;
-		}
-		return nullptr;
-	}
+	DWORD RemoveDuplicateMaterials ();
+	// Collapse materials with identical parameters into the first of them,
+	// drop materials no group refers to, and update the group material
+	// indices. Material names don't take part in the comparison; a collapsed
+	// material keeps the name of the first one. Returns the number of
+	// materials removed.
+
+	DWORD RemoveDuplicateTextures ();
+	// Collapse texture entries naming the same file (ignoring case and path
+	// separator style), drop textures no group refers to, and update the
+	// group texture indices. Returns the number of textures removed.
+
+	int AddTexture (const char *name);
+	// Add a texture file name to the mesh and return its list index
+
+	inline const char *GetTextureName (DWORD texidx) const
+	{ return (texidx < nTex && TexName[texidx] ? Strings.Get (TexName[texidx]) : 0); }
+	// return the file name of a texture (0 if it has no name)
 
 	void SetTexMixture (DWORD grp, DWORD ntex, float mix);
 	void SetTexMixture (DWORD ntex, float mix);
 
 	void ScaleGroup (DWORD grp, D3DVALUE sx, D3DVALUE sy, D3DVALUE sz);
 	void Scale (D3DVALUE sx, D3DVALUE sy, D3DVALUE sz);
-	// scale an individual group or the whole mesh
+	// scale an individual group or the whole mesh. Zero-length normals
+	// stay zero.
 
 	void TranslateGroup (DWORD grp, D3DVALUE dx, D3DVALUE dy, D3DVALUE dz);
 	void Translate (D3DVALUE dx, D3DVALUE dy, D3DVALUE dz);
@@ -178,15 +278,43 @@ public:
 
 	void TransformGroup (DWORD grp, const D3DMATRIX &mat);
 	void Transform (const D3DMATRIX &mat);
-	// rotate mesh using the provided rotation matrix
+	// rotate mesh using the provided rotation matrix. Zero-length normals
+	// stay zero.
 
 	void TexScaleGroup (DWORD grp, D3DVALUE su, D3DVALUE sv);
 	void TexScale (D3DVALUE su, D3DVALUE sv);
 	// scale the texture coordinates of an individual group or the whole mesh
 
-	void CalcNormals (DWORD grp, bool missingonly);
+	enum NormalWeight { NMLWEIGHT_AREA, NMLWEIGHT_ANGLE_FAST, NMLWEIGHT_ANGLE };
+	void SetNormalOptions (NormalWeight weight, D3DVALUE crease = 0.0f);
+	// select how face normals are weighted when accumulated into vertex normals
+	// (face area, polynomial approximation of the corner angle, or exact corner
+	// angle), and the crease angle [rad] above which CalcNormals splits vertices
+	// along hard edges (0 = smooth across all shared vertices)
+
+	DWORD CalcNormals (DWORD grp, bool missingonly);
 	// automatic calculation of vertex normals for group grp
 	// if missingonly=true then only normals with zero length are calculated
+	// Uses the options set with SetNormalOptions. If a crease angle is set,
+	// vertices may be appended to the group (unless that would exceed the
+	// 16-bit index range, in which case the group is smoothed without splits)
+	// Returns the number of zero-area triangles, which don't contribute to
+	// any normal (see CleanupGroup). If missingonly=true, face normals are
+	// only computed, and zero-area triangles only counted, for triangles
+	// with a vertex that needs a normal.
+
+	struct CleanupCount {
+		DWORD nDegenerate; // zero-area triangles removed
+		DWORD nDuplicate;  // repeated triangles removed
+		DWORD nUnused;     // unreferenced vertices removed
+	};
+
+	bool CleanupGroup (DWORD grp, CleanupCount *count = 0);
+	// Remove zero-area triangles (as detected by CalcNormals) and repeated
+	// triangles (the same vertices in the same winding order) from group grp,
+	// then drop the vertices no triangle refers to. Remaining triangles and
+	// vertices keep their order. If count is given, it receives the number
+	// of items removed. Returns true if the group changed.
 
 	void CalcTexCoords (DWORD grp);
 	// under construction
@@ -199,28 +327,30 @@ public:
 	friend std::istream &operator>> (std::istream &is, Mesh &mesh);
 	// read mesh from file
 
-	struct tex_file
-	{
-		char File[256];
-	};
-	tex_file *Labels;
-	tex_file *MatNames;
 private:
 
 	DWORD nGrp;         // number of groups
 	GroupSpec *Grp;     // list of group specs	
+	Arena *ListArena;   // allocator for the group vertex and index lists (0 = heap)
 
 	DWORD nMtrl;        // number of materials
 	D3DMATERIAL7 *Mtrl; // list of materials used by the mesh
+	DWORD *MtrlName;    // material name offsets in Strings
 
 	DWORD nTex;         // number of textures
-	tex_file *TexFiles;
+	DWORD *TexName;     // texture file name offsets in Strings
+
+	StringPool Strings; // group labels, material and texture names
 
 	bool GrpSetup;      // true if the following arrays are allocated
+	bool bDeferSetup;   // true between BeginUpdate and EndUpdate
 	D3DVECTOR *GrpCnt;  // list of barycentres for each group (local coords)
 	D3DVALUE *GrpRad;   // list of max. radii for each group
 	DWORD *GrpVis;      // visibility flags for each group
 
+	NormalWeight nmlWeight; // face weighting used by CalcNormals
+	D3DVALUE nmlCrease;     // crease angle used by CalcNormals [rad], 0 = none
+
 	// global mesh flags
 	static bool bEnableSpecular;   // enable specular reflection
 	bool bModulateMatAlpha;
@@ -242,4 +372,8 @@ void CreateSpherePatch (Mesh &mesh, int nlng, int nlat, int ilat, int res,
 // Create a mesh representing a rectangular patch on a sphere at a given
 // position and resolution
 
+void FlipWinding (WORD *idx, DWORD ntri);
+// Reverse the winding order of ntri triangles by swapping the second and
+// third index of each
+
 #endif // !__MESH_H
\ No newline at end of file
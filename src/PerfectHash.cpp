@@ -0,0 +1,80 @@
+#include "PerfectHash.h"
+#include <string.h>
+#include <algorithm>
+
+// Give up on a bucket after this many seeds. With about 4 keys per bucket
+// a seed is usually found within a few hundred attempts.
+static const unsigned MAXSEED = 1u << 20;
+
+bool PerfectHashBuild (const char *const *key, unsigned nkey, int *displace, unsigned *slot)
+{
+	unsigned i, j, k, b, nbucket = PerfectHashBuckets (nkey);
+	if (!nkey) return true;
+
+	// sort the keys by bucket, then process the buckets largest first
+	unsigned *bkt = new unsigned[nkey];
+	unsigned *order = new unsigned[nkey];
+	for (i = 0; i < nkey; i++) {
+		bkt[i] = PerfectHashString (key[i], 0) % nbucket;
+		order[i] = i;
+	}
+	std::sort (order, order+nkey, [bkt](unsigned a, unsigned b) { return bkt[a] < bkt[b]; });
+	unsigned *first = new unsigned[nbucket+1]; // first entry of each bucket in order
+	for (b = i = 0; b < nbucket; b++) {
+		first[b] = i;
+		while (i < nkey && bkt[order[i]] == b) i++;
+	}
+	first[nbucket] = nkey;
+	unsigned *border = new unsigned[nbucket];
+	for (b = 0; b < nbucket; b++) border[b] = b;
+	std::stable_sort (border, border+nbucket, [first](unsigned a, unsigned b)
+		{ return first[a+1]-first[a] > first[b+1]-first[b]; });
+
+	bool *used = new bool[nkey];
+	memset (used, 0, nkey*sizeof(bool));
+	unsigned *tmp = new unsigned[nkey];
+	unsigned freeslot = 0;
+	bool ok = true;
+
+	for (k = 0; k < nbucket && ok; k++) {
+		b = border[k];
+		unsigned n = first[b+1]-first[b];
+		const unsigned *bk = order+first[b];
+		if (n == 0) {
+			displace[b] = 0;
+		} else if (n == 1) { // store the slot directly
+			while (used[freeslot]) freeslot++;
+			used[freeslot] = true;
+			slot[bk[0]] = freeslot;
+			displace[b] = -(int)freeslot-1;
+		} else {
+			unsigned seed;
+			for (seed = 1; seed < MAXSEED; seed++) {
+				for (i = 0; i < n; i++) {
+					tmp[i] = PerfectHashString (key[bk[i]], seed) % nkey;
+					if (used[tmp[i]]) break;
+					for (j = 0; j < i; j++)
+						if (tmp[j] == tmp[i]) break;
+					if (j < i) break;
+				}
+				if (i == n) break;
+			}
+			if (seed == MAXSEED) ok = false;
+			else {
+				for (i = 0; i < n; i++) {
+					used[tmp[i]] = true;
+					slot[bk[i]] = tmp[i];
+				}
+				displace[b] = (int)seed;
+			}
+		}
+	}
+
+	delete []bkt;
+	delete []order;
+	delete []first;
+	delete []border;
+	delete []used;
+	delete []tmp;
+	return ok;
+}
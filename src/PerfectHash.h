@@ -0,0 +1,71 @@
+// =======================================================================
+// Minimal perfect hashing of name sets (hash and displace).
+// The keys are distributed into buckets with a fixed hash. Each bucket
+// stores a displacement: either a seed for a second hash that maps all
+// keys of the bucket to free slots, or, for buckets with a single key,
+// the slot itself (encoded as -slot-1). A set of n keys is mapped to
+// n slots without collisions.
+//
+// The lookup functions are inline and have no dependencies, so that
+// loaders can use them directly on a memory-mapped CMSH file.
+// =======================================================================
+
+#ifndef __PERFECTHASH_H
+#define __PERFECTHASH_H
+
+// FNV-1a with a seed, followed by a final avalanche step so that
+// consecutive seeds give independent hashes.
+inline unsigned PerfectHashString (const char *str, unsigned seed)
+{
+	unsigned h = 2166136261u ^ (seed * 0x9E3779B9u);
+	for (; *str; str++) h = (h ^ (unsigned char)*str) * 16777619u;
+	h ^= h >> 16; h *= 0x85EBCA6Bu;
+	h ^= h >> 13; h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+	return h;
+}
+
+// Number of buckets used for nkey keys (about 4 keys per bucket)
+inline unsigned PerfectHashBuckets (unsigned nkey)
+{
+	return (nkey+3)/4;
+}
+
+// Slot of key in a table of nkey slots. For a string that is not in the
+// key set, an arbitrary slot is returned, so the caller must compare the
+// key stored in the slot.
+inline unsigned PerfectHashSlot (const char *key, const int *displace, unsigned nbucket, unsigned nkey)
+{
+	int d = displace[PerfectHashString (key, 0) % nbucket];
+	if (d < 0) return (unsigned)(-d-1);
+	return PerfectHashString (key, (unsigned)d) % nkey;
+}
+
+bool PerfectHashBuild (const char *const *key, unsigned nkey, int *displace, unsigned *slot);
+// Build the displacement table for nkey distinct keys. displace must have
+// PerfectHashBuckets(nkey) entries, slot receives the slot of each key.
+// Returns false if no displacement was found for some bucket.
+
+// =======================================================================
+// Name index section of a CMSH file:
+//
+//   int KeyCount;
+//   int BucketCount;
+//   int Displace[BucketCount];
+//   struct { int NameOffset; int Index; } Entries[KeyCount];
+//
+// NameOffset refers to the CMSH string table. Returns the index stored
+// for name, or -1 if the name is not in the index.
+
+inline int CmshFindName (const char *name, const int *section, const char *strings)
+{
+	unsigned nkey = (unsigned)section[0], nbucket = (unsigned)section[1];
+	if (!nkey || !name) return -1;
+	const int *entry = section + 2 + nbucket +
+		2 * PerfectHashSlot (name, section+2, nbucket, nkey);
+	const char *s = strings + entry[0];
+	while (*s && *s == *name) s++, name++;
+	return *s == *name ? entry[1] : -1;
+}
+
+#endif // !__PERFECTHASH_H
@@ -0,0 +1,40 @@
+// =======================================================================
+// Instruction set detection for the vectorised code paths.
+// Defines SIMD_SSE2, SIMD_AVX and SIMD_AVX2 when the compiler targets
+// the respective instruction set, and includes the matching intrinsics.
+// Code using these macros must always provide a scalar fallback.
+// =======================================================================
+
+#ifndef __SIMD_H
+#define __SIMD_H
+
+#if defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(SIMD_SSE2) && defined(__AVX__)
+#define SIMD_AVX
+#include <immintrin.h>
+#endif
+
+#if defined(SIMD_AVX) && defined(__AVX2__)
+#define SIMD_AVX2
+#endif
+
+// SIMD_NO_FP_CONTRACT, at file scope before the first function, stops the
+// compiler from fusing multiplies and adds into FMA instructions in the
+// rest of the translation unit. Vector paths that promise the results of
+// their scalar code need it when the compiler targets FMA (e.g. AVX2),
+// because the two paths would otherwise be contracted differently.
+#if defined(__clang__)
+#define SIMD_NO_FP_CONTRACT _Pragma("STDC FP_CONTRACT OFF")
+#elif defined(_MSC_VER)
+#define SIMD_NO_FP_CONTRACT __pragma(fp_contract (off))
+#elif defined(__GNUC__)
+#define SIMD_NO_FP_CONTRACT _Pragma("GCC optimize (\"fp-contract=off\")")
+#else
+#define SIMD_NO_FP_CONTRACT
+#endif
+
+#endif // !__SIMD_H
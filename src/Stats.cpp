@@ -0,0 +1,276 @@
+#include "Stats.h"
+#include <Windows.h>
+#include <psapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#pragma comment(lib, "psapi.lib")
+
+// =======================================================================
+// Heap allocation count
+// The global operator new is replaced to count its calls once counting
+// is switched on, so that runs without -stats only pay for a relaxed load.
+// Array and nothrow forms go through it; all matching deletes, including
+// the sized ones, release with free. Aligned forms are left to the library.
+
+static std::atomic<bool> g_countHeapAllocs(false);
+static std::atomic<size_t> g_heapAllocs(0);
+
+void *operator new (size_t size)
+{
+	if (g_countHeapAllocs.load (std::memory_order_relaxed))
+		g_heapAllocs.fetch_add (1, std::memory_order_relaxed);
+	for (;;) {
+		if (void *p = malloc (size ? size : 1)) return p;
+		std::new_handler handler = std::get_new_handler ();
+		if (!handler) throw std::bad_alloc ();
+		handler ();
+	}
+}
+
+void *operator new[] (size_t size)
+{
+	return operator new (size);
+}
+
+void *operator new (size_t size, const std::nothrow_t &) noexcept
+{
+	try { return operator new (size); }
+	catch (...) { return 0; }
+}
+
+void *operator new[] (size_t size, const std::nothrow_t &) noexcept
+{
+	try { return operator new (size); }
+	catch (...) { return 0; }
+}
+
+void operator delete (void *p) noexcept { free (p); }
+void operator delete[] (void *p) noexcept { free (p); }
+void operator delete (void *p, const std::nothrow_t &) noexcept { free (p); }
+void operator delete[] (void *p, const std::nothrow_t &) noexcept { free (p); }
+void operator delete (void *p, size_t) noexcept { free (p); }
+void operator delete[] (void *p, size_t) noexcept { free (p); }
+
+// =======================================================================
+// JSON output
+
+static void WriteString (std::ostream &os, const char *str)
+{
+	os << '"';
+	for (; *str; str++) {
+		unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\') os << '\\' << (char)c;
+		else if (c < 0x20) {
+			char buf[8];
+			sprintf (buf, "\\u%04x", c);
+			os << buf;
+		} else os << (char)c;
+	}
+	os << '"';
+}
+
+// Integers up to 2^53 exactly, other values with 15 significant digits
+static void WriteNumber (std::ostream &os, double v)
+{
+	char buf[32];
+	if (!isfinite (v)) v = 0.0;
+	sprintf (buf, "%.15g", v);
+	os << buf;
+}
+
+static void WriteCounter (std::ostream &os, const char *indent, const char *key, double value, bool last)
+{
+	os << indent;
+	WriteString (os, key);
+	os << ": ";
+	WriteNumber (os, value);
+	os << (last ? "\n" : ",\n");
+}
+
+// =======================================================================
+// Class RunStats
+
+RunStats::RunStats ()
+{
+	Start = std::chrono::steady_clock::now ();
+}
+
+void RunStats::AddEntry (std::vector<Entry> &list, const char *name, double value, bool accumulate)
+{
+	for (size_t i = 0; i < list.size (); i++)
+		if (list[i].Name == name) {
+			list[i].Value = accumulate ? list[i].Value + value : value;
+			return;
+		}
+	Entry e = { name, value };
+	list.push_back (e);
+}
+
+void RunStats::AddPhase (const char *name, double seconds)
+{
+	AddEntry (Phases, name, seconds, true);
+}
+
+void RunStats::Set (const char *name, double value)
+{
+	AddEntry (Counters, name, value, false);
+}
+
+double RunStats::Get (const char *name) const
+{
+	for (size_t i = 0; i < Counters.size (); i++)
+		if (Counters[i].Name == name) return Counters[i].Value;
+	return 0.0;
+}
+
+void RunStats::SetFile (const char *key, const char *name)
+{
+	for (size_t i = 0; i < Files.size (); i++)
+		if (Files[i].first == key) { Files[i].second = name; return; }
+	Files.push_back (std::make_pair (std::string(key), std::string(name)));
+}
+
+double RunStats::Seconds () const
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now () - Start).count ();
+}
+
+void RunStats::WriteJson (std::ostream &os) const
+{
+	size_t i;
+	os << "{\n";
+	for (i = 0; i < Files.size (); i++) {
+		os << "  ";
+		WriteString (os, Files[i].first.c_str ());
+		os << ": ";
+		WriteString (os, Files[i].second.c_str ());
+		os << ",\n";
+	}
+	os << "  \"seconds\": ";
+	WriteNumber (os, Seconds ());
+	os << ",\n  \"phases\": [";
+	for (i = 0; i < Phases.size (); i++) {
+		os << (i ? ",\n" : "\n") << "    { \"name\": ";
+		WriteString (os, Phases[i].Name.c_str ());
+		os << ", \"seconds\": ";
+		WriteNumber (os, Phases[i].Value);
+		os << " }";
+	}
+	os << (Phases.size () ? "\n  ],\n" : "],\n");
+	os << "  \"counters\": {\n";
+	for (i = 0; i < Counters.size (); i++)
+		WriteCounter (os, "    ", Counters[i].Name.c_str (), Counters[i].Value, false);
+	WriteCounter (os, "    ", "heap_allocations", (double)HeapAllocations (), false);
+	WriteCounter (os, "    ", "peak_memory_bytes", (double)PeakMemory (), true);
+	os << "  }\n}\n";
+}
+
+void RunStats::Merge (const RunStats &stats)
+{
+	size_t i;
+	for (i = 0; i < stats.Phases.size (); i++)
+		AddEntry (Phases, stats.Phases[i].Name.c_str (), stats.Phases[i].Value, true);
+	for (i = 0; i < stats.Counters.size (); i++)
+		AddEntry (Counters, stats.Counters[i].Name.c_str (), stats.Counters[i].Value, true);
+}
+
+void RunStats::CountHeapAllocations ()
+{
+	g_countHeapAllocs.store (true, std::memory_order_relaxed);
+}
+
+size_t RunStats::HeapAllocations ()
+{
+	return g_heapAllocs.load (std::memory_order_relaxed);
+}
+
+size_t RunStats::PeakMemory ()
+{
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo (GetCurrentProcess (), &pmc, sizeof (pmc))) return 0;
+	return pmc.PeakWorkingSetSize;
+}
+
+// =======================================================================
+// Class TraceLog
+
+static std::atomic<int> g_threadCount(0);
+
+int TraceLog::ThreadId ()
+{
+	static thread_local int id = ++g_threadCount;
+	return id;
+}
+
+TraceLog::TraceLog ()
+{
+	Start = std::chrono::steady_clock::now ();
+	MainTid = ThreadId ();
+}
+
+void TraceLog::Span (const std::string &name, const char *cat, Time start, Time end, const Args &args)
+{
+	Event e;
+	e.Name = name;
+	e.Cat = cat;
+	e.Start = std::chrono::duration<double, std::micro>(start - Start).count ();
+	e.Duration = std::chrono::duration<double, std::micro>(end - start).count ();
+	e.Tid = ThreadId ();
+	e.Values = args;
+	std::lock_guard<std::mutex> lock(Lock);
+	Events.push_back (e);
+}
+
+// Thread names, then the spans in the order they ended. Viewers sort
+// events by time themselves.
+void TraceLog::Write (std::ostream &os) const
+{
+	std::lock_guard<std::mutex> lock(Lock);
+	std::vector<int> tids(1, MainTid);
+	size_t i, j;
+	for (i = 0; i < Events.size (); i++)
+		if (std::find (tids.begin (), tids.end (), Events[i].Tid) == tids.end ())
+			tids.push_back (Events[i].Tid);
+
+	os << "{\"traceEvents\": [\n";
+	os << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"mshcmp\"}}";
+	for (i = 0; i < tids.size (); i++) {
+		char name[32];
+		if (tids[i] == MainTid) strcpy (name, "main");
+		else sprintf (name, "worker %d", (int)i);
+		os << ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tids[i]
+			<< ", \"args\": {\"name\": ";
+		WriteString (os, name);
+		os << "}}";
+	}
+	for (i = 0; i < Events.size (); i++) {
+		const Event &e = Events[i];
+		os << ",\n  {\"name\": ";
+		WriteString (os, e.Name.c_str ());
+		os << ", \"cat\": ";
+		WriteString (os, e.Cat);
+		os << ", \"ph\": \"X\", \"ts\": ";
+		WriteNumber (os, floor (e.Start * 1000.0 + 0.5) / 1000.0);
+		os << ", \"dur\": ";
+		WriteNumber (os, floor (e.Duration * 1000.0 + 0.5) / 1000.0);
+		os << ", \"pid\": 1, \"tid\": " << e.Tid;
+		if (e.Values.size ()) {
+			os << ", \"args\": {";
+			for (j = 0; j < e.Values.size (); j++) {
+				if (j) os << ", ";
+				WriteString (os, e.Values[j].first);
+				os << ": ";
+				WriteNumber (os, e.Values[j].second);
+			}
+			os << "}";
+		}
+		os << "}";
+	}
+	os << "\n],\n\"displayTimeUnit\": \"ms\"}\n";
+}
@@ -0,0 +1,143 @@
+// =======================================================================
+// Run statistics
+// Wall time of the phases of a compile, named counters and the memory
+// use of the process, written as a JSON report (see -stats), and a
+// timeline of the same phases in the trace event format read by
+// chrome://tracing and Perfetto (see -trace).
+// =======================================================================
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stddef.h>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class RunStats {
+public:
+	RunStats ();
+	// Starts the clock of the total time
+
+	void AddPhase (const char *name, double seconds);
+	// Add seconds to phase name, adding the phase on first use. Phases are
+	// reported in the order they were first added.
+
+	void Set (const char *name, double value);
+	// Set counter name, adding it on first use
+
+	double Get (const char *name) const;
+	// Value of counter name, 0 if it is not set
+
+	void SetFile (const char *key, const char *name);
+	// Report file name under key ("input", "output")
+
+	double Seconds () const;
+	// Seconds since construction
+
+	void Merge (const RunStats &stats);
+	// Add the phase times and counters of stats (e.g. of one file of a
+	// batch) to this report. Files are not merged.
+
+	void WriteJson (std::ostream &os) const;
+	// Write the report: files, total time, phases, counters and memory
+
+	static void CountHeapAllocations ();
+	// Start counting operator new calls. Off by default, so that runs
+	// without a report do not pay for the count.
+
+	static size_t HeapAllocations ();
+	// number of operator new calls since CountHeapAllocations
+
+	static size_t PeakMemory ();
+	// peak working set (resident size) of the process in bytes, 0 if unknown
+
+private:
+	struct Entry {
+		std::string Name;
+		double Value;
+	};
+	static void AddEntry (std::vector<Entry> &list, const char *name, double value, bool accumulate);
+
+	std::chrono::steady_clock::time_point Start;
+	std::vector<Entry> Phases;
+	std::vector<Entry> Counters;
+	std::vector<std::pair<std::string, std::string> > Files;
+};
+
+class TraceLog {
+public:
+	typedef std::chrono::steady_clock::time_point Time;
+	typedef std::vector<std::pair<const char*, double> > Args;
+
+	TraceLog ();
+	// Starts the clock of the timeline. The calling thread is reported
+	// as "main".
+
+	void Span (const std::string &name, const char *cat, Time start, Time end, const Args &args);
+	// Add a complete event on the calling thread. cat must be a string
+	// literal. Thread-safe.
+
+	void Write (std::ostream &os) const;
+	// Write all events as a JSON trace object
+
+	static int ThreadId ();
+	// Small number of the calling thread, in order of first use
+
+private:
+	struct Event {
+		std::string Name;
+		const char *Cat;
+		double Start, Duration; // microseconds
+		int Tid;
+		Args Values;
+	};
+
+	Time Start;
+	int MainTid;
+	mutable std::mutex Lock;
+	std::vector<Event> Events;
+};
+
+// Adds the time from construction to destruction as a span to trace.
+// Does nothing if trace is 0.
+class TraceSpan {
+public:
+	TraceSpan (TraceLog *trace, const std::string &name, const char *cat)
+		: Trace(trace), Name(trace ? name : std::string()), Cat(cat), Start(std::chrono::steady_clock::now()) {}
+	~TraceSpan ()
+	{ if (Trace) Trace->Span (Name, Cat, Start, std::chrono::steady_clock::now(), Values); }
+
+	void Arg (const char *key, double value)
+	{ if (Trace) Values.push_back (std::make_pair (key, value)); }
+	// Tag the span with a value; key must be a string literal
+
+private:
+	TraceLog *Trace;
+	std::string Name;
+	const char *Cat;
+	std::chrono::steady_clock::time_point Start;
+	TraceLog::Args Values;
+};
+
+// Adds the time from construction to destruction to a phase of stats,
+// and as a span of category "phase" to trace if it is given
+class PhaseTimer {
+public:
+	PhaseTimer (RunStats &stats, const char *name, TraceLog *trace = 0)
+		: Stats(stats), Name(name), Span(trace, name, "phase"), Start(std::chrono::steady_clock::now()) {}
+	~PhaseTimer ()
+	{ Stats.AddPhase (Name, std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count()); }
+
+	void Arg (const char *key, double value) { Span.Arg (key, value); }
+
+private:
+	RunStats &Stats;
+	const char *Name;
+	TraceSpan Span;
+	std::chrono::steady_clock::time_point Start;
+};
+
+#endif // !__STATS_H
@@ -0,0 +1,140 @@
+#include "StringPool.h"
+#include <string.h>
+
+// =======================================================================
+// Class StringPool
+
+StringPool::StringPool ()
+{
+	nBufMax = 256;
+	Buf = new char[nBufMax];
+	nSlot = 16;
+	Slot = new DWORD[nSlot];
+	Clear ();
+}
+
+StringPool::StringPool (const StringPool &pool)
+{
+	Buf = 0;
+	Slot = 0;
+	*this = pool;
+}
+
+StringPool::StringPool (StringPool &&pool): StringPool ()
+{
+	*this = static_cast<StringPool&&>(pool);
+}
+
+StringPool::~StringPool ()
+{
+	delete []Buf;
+	delete []Slot;
+}
+
+StringPool &StringPool::operator= (const StringPool &pool)
+{
+	if (this == &pool) return *this;
+	delete []Buf;
+	delete []Slot;
+	nBuf = pool.nBuf;
+	nBufMax = pool.nBufMax;
+	Buf = new char[nBufMax];
+	memcpy (Buf, pool.Buf, nBuf);
+	nSlot = pool.nSlot;
+	Slot = new DWORD[nSlot];
+	memcpy (Slot, pool.Slot, nSlot*sizeof(DWORD));
+	nStr = pool.nStr;
+	return *this;
+}
+
+StringPool &StringPool::operator= (StringPool &&pool)
+{
+	if (this == &pool) return *this;
+	// swap the buffers, so that pool keeps valid (empty) ones
+	char *buf = Buf;
+	DWORD *slot = Slot, nbufmax = nBufMax, nslot = nSlot;
+	Buf = pool.Buf, nBuf = pool.nBuf, nBufMax = pool.nBufMax;
+	Slot = pool.Slot, nSlot = pool.nSlot, nStr = pool.nStr;
+	pool.Buf = buf, pool.nBufMax = nbufmax;
+	pool.Slot = slot, pool.nSlot = nslot;
+	pool.Clear ();
+	return *this;
+}
+
+void StringPool::Clear ()
+{
+	for (DWORD i = 0; i < nSlot; i++) Slot[i] = NOSTR;
+	Buf[0] = '\0';
+	nBuf = 1;
+	nStr = 1;
+}
+
+// FNV-1a
+DWORD StringPool::Hash (const char *str, DWORD len)
+{
+	DWORD h = 2166136261u;
+	for (DWORD i = 0; i < len; i++)
+		h = (h ^ (unsigned char)str[i]) * 16777619u;
+	return h;
+}
+
+// Return the slot holding str, or the empty slot where it would go
+DWORD StringPool::Lookup (const char *str, DWORD len, DWORD hash) const
+{
+	DWORD mask = nSlot-1, i = hash & mask;
+	while (Slot[i] != NOSTR) {
+		const char *s = Buf+Slot[i];
+		if (!strncmp (s, str, len) && s[len] == '\0') break; // strncmp stops at the end of s
+		i = (i+1) & mask;
+	}
+	return i;
+}
+
+void StringPool::Rehash (DWORD nslot)
+{
+	DWORD *old = Slot, nold = nSlot;
+	Slot = new DWORD[nSlot = nslot];
+	for (DWORD i = 0; i < nSlot; i++) Slot[i] = NOSTR;
+	for (DWORD i = 0; i < nold; i++) {
+		if (old[i] == NOSTR) continue;
+		const char *s = Buf+old[i];
+		DWORD len = (DWORD)strlen (s);
+		Slot[Lookup (s, len, Hash (s, len))] = old[i];
+	}
+	delete []old;
+}
+
+DWORD StringPool::Add (const char *str)
+{
+	if (!str || !str[0]) return 0;
+	DWORD len = (DWORD)strlen (str), hash = Hash (str, len);
+	DWORD i = Lookup (str, len, hash);
+	if (Slot[i] != NOSTR) return Slot[i];
+
+	if (nBuf+len+1 > nBufMax) {
+		while (nBuf+len+1 > nBufMax) nBufMax *= 2;
+		char *tmp = new char[nBufMax];
+		memcpy (tmp, Buf, nBuf);
+		delete []Buf;
+		Buf = tmp;
+	}
+	DWORD ofs = nBuf;
+	memcpy (Buf+ofs, str, len+1);
+	nBuf += len+1;
+	nStr++;
+
+	if (2*nStr > nSlot) { // keep the load factor below 1/2
+		Rehash (2*nSlot);
+		i = Lookup (str, len, hash);
+	}
+	Slot[i] = ofs;
+	return ofs;
+}
+
+DWORD StringPool::Find (const char *str) const
+{
+	if (!str || !str[0]) return 0;
+	DWORD len = (DWORD)strlen (str);
+	DWORD i = Lookup (str, len, Hash (str, len));
+	return Slot[i];
+}
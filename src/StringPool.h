@@ -0,0 +1,60 @@
+// =======================================================================
+// Class StringPool
+// Interned, null-terminated strings stored back to back in one buffer.
+// Strings are referred to by their byte offset into the buffer, so the
+// buffer can be written out as a string table as is.
+// =======================================================================
+
+#ifndef __STRINGPOOL_H
+#define __STRINGPOOL_H
+
+#include <windows.h>
+
+class StringPool {
+public:
+	StringPool ();
+	StringPool (const StringPool &pool);
+	StringPool (StringPool &&pool);
+	~StringPool ();
+
+	StringPool &operator= (const StringPool &pool);
+	StringPool &operator= (StringPool &&pool);
+	// Moving takes over the buffers and leaves "pool" empty
+
+	DWORD Add (const char *str);
+	// Intern str and return its offset. Equal strings always get the same
+	// offset, so interned names can be compared by offset. The empty string
+	// (and str = 0) is always at offset 0.
+
+	DWORD Find (const char *str) const;
+	// Return the offset of str, or NOSTR if it has not been added
+
+	inline const char *Get (DWORD ofs) const { return Buf+ofs; }
+	// Return the string at offset ofs. The pointer is invalidated by Add.
+
+	inline const char *Data () const { return Buf; }
+	inline DWORD Size () const { return nBuf; }
+	// The string buffer and its size in bytes, including all terminators
+
+	inline DWORD Count () const { return nStr; }
+	// Number of distinct strings, including the empty string
+
+	void Clear ();
+	// Remove all strings except the empty string
+
+	static const DWORD NOSTR = (DWORD)-1;
+
+private:
+	static DWORD Hash (const char *str, DWORD len);
+	DWORD Lookup (const char *str, DWORD len, DWORD hash) const;
+	void Rehash (DWORD nslot);
+
+	char *Buf;          // string data
+	DWORD nBuf;         // bytes used in Buf
+	DWORD nBufMax;      // bytes allocated for Buf
+	DWORD *Slot;        // open addressing hash table of string offsets
+	DWORD nSlot;        // size of Slot, a power of 2
+	DWORD nStr;         // number of strings
+};
+
+#endif // !__STRINGPOOL_H
@@ -165,6 +165,9 @@ public:
 		double data[3];
 		struct { double x, y, z; };
 	};
+	// Storage is exactly three doubles (x,y,z) without padding, so an array
+	// of n vectors is a packed array of 3n doubles. The bulk functions
+	// below rely on this.
 };
 
 // =======================================================================
@@ -172,11 +175,16 @@ public:
 
 class Matrix {
 public:
-	Matrix ();
-	Matrix (const Matrix &A);
-	Matrix (double a11, double a12, double a13,
+	inline Matrix ()
+	{ memset (data, 0, 9*sizeof(double)); }
+
+	inline Matrix (const Matrix &A)
+	{ memcpy (data, A.data, 9*sizeof(double)); }
+
+	inline Matrix (double a11, double a12, double a13,
 		    double a21, double a22, double a23,
-			double a31, double a32, double a33);
+			double a31, double a32, double a33)
+	{ m11=a11, m12=a12, m13=a13, m21=a21, m22=a22, m23=a23, m31=a31, m32=a32, m33=a33; }
 
 	void Set (double a11, double a12, double a13,
 			  double a21, double a22, double a23,
@@ -192,10 +200,11 @@ public:
 	// Set from axis rotation vector
 
 	inline double &operator() (int i, int j)
-	{ return data[i*4+j]; }
+	{ return data[i*3+j]; }
 
 	inline double operator() (int i, int j) const
-	{ return data[i*4+j]; }
+	{ return data[i*3+j]; }
+	// Element in row i, column j (0-based)
 
 	Matrix &operator= (const Matrix &A);
 	Matrix operator* (const Matrix &A) const;
@@ -229,8 +238,34 @@ public:
 		double data[9];
 		struct { double m11, m12, m13, m21, m22, m23, m31, m32, m33; };
 	};
+	// Row-major storage: data[i*3+j] is the element in row i, column j
+	// (0-based), i.e. m11 m12 m13 m21 ... m33.
 };
 
+// =======================================================================
+// Bulk operations on arrays of n vectors (VecmatBulk.cpp)
+// Vectorised with AVX double lanes where the compiler targets AVX. Each
+// result is bit-identical to that of the same routine called for that
+// vector alone, on any code path. The inline single-vector operations give
+// the same results unless the calling code is compiled with fused
+// multiply-adds, which may change the last bit. Destination arrays may be
+// the same as source arrays.
+
+void mul (const Matrix &A, const Vector *b, Vector *r, int n);
+// r[i] = A * b[i]
+
+void tmul (const Matrix &A, const Vector *b, Vector *r, int n);
+// r[i] = A^T * b[i]
+
+void unify (Vector *v, int n);
+// set length of each v[i] to unity
+
+void dotp (const Vector *a, const Vector *b, double *r, int n);
+// r[i] = a[i] & b[i]
+
+void crossp (const Vector *a, const Vector *b, Vector *r, int n);
+// r[i] = crossp (a[i], b[i])
+
 // =======================================================================
 // class Vector4:  4-element vector
 
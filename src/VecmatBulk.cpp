@@ -0,0 +1,162 @@
+// Copyright (c) Martin Schweiger
+// Licensed under the MIT License
+
+// =======================================================================
+// Bulk Vector/Matrix operations
+// The AVX paths load four packed vectors (12 doubles) into three registers
+// and transpose them so that each register holds one component of all
+// four vectors. The arithmetic is then done in the same order as the
+// scalar code, without fused multiply-adds, and SIMD_NO_FP_CONTRACT keeps
+// the compiler from fusing those of the scalar loops, so that results do
+// not depend on the code path.
+// =======================================================================
+
+#include "Vecmat.h"
+#include "Simd.h"
+
+SIMD_NO_FP_CONTRACT
+
+static_assert (sizeof (Vector) == 3*sizeof (double), "Vector must be packed");
+
+#ifdef SIMD_AVX
+
+// x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3  ->  x0..x3 | y0..y3 | z0..z3
+static inline void Load4 (const Vector *v, __m256d &x, __m256d &y, __m256d &z)
+{
+	const double *p = v->data;
+	__m256d r0 = _mm256_loadu_pd (p);
+	__m256d r1 = _mm256_loadu_pd (p+4);
+	__m256d r2 = _mm256_loadu_pd (p+8);
+	__m256d a = _mm256_permute2f128_pd (r0, r1, 0x30); // x0 y0 | x2 y2
+	__m256d b = _mm256_permute2f128_pd (r0, r2, 0x31); // z0 x1 | y3 z3
+	__m256d c = _mm256_permute2f128_pd (r1, r2, 0x20); // y1 z1 | z2 x3
+	__m256d d = _mm256_blend_pd (b, c, 0xC);            // z0 x1 | z2 x3
+	__m256d e = _mm256_blend_pd (c, b, 0xC);            // y1 z1 | y3 z3
+	x = _mm256_shuffle_pd (a, d, 0xA);
+	y = _mm256_shuffle_pd (a, e, 0x5);
+	z = _mm256_shuffle_pd (d, e, 0xA);
+}
+
+// Inverse of Load4
+static inline void Store4 (Vector *v, __m256d x, __m256d y, __m256d z)
+{
+	double *p = v->data;
+	__m256d a = _mm256_shuffle_pd (x, y, 0x0);         // x0 y0 | x2 y2
+	__m256d d = _mm256_shuffle_pd (z, x, 0xA);         // z0 x1 | z2 x3
+	__m256d e = _mm256_shuffle_pd (y, z, 0xF);         // y1 z1 | y3 z3
+	_mm256_storeu_pd (p,   _mm256_permute2f128_pd (a, d, 0x20));
+	_mm256_storeu_pd (p+4, _mm256_permute2f128_pd (e, a, 0x30));
+	_mm256_storeu_pd (p+8, _mm256_permute2f128_pd (d, e, 0x31));
+}
+
+// (a1*x + a2*y) + a3*z
+static inline __m256d Dot3 (__m256d a1, __m256d a2, __m256d a3, __m256d x, __m256d y, __m256d z)
+{
+	return _mm256_add_pd (_mm256_add_pd (_mm256_mul_pd (a1, x), _mm256_mul_pd (a2, y)), _mm256_mul_pd (a3, z));
+}
+
+#endif // SIMD_AVX
+
+// =======================================================================
+
+void mul (const Matrix &A, const Vector *b, Vector *r, int n)
+{
+	int i = 0;
+#ifdef SIMD_AVX
+	const __m256d m11 = _mm256_set1_pd (A.m11), m12 = _mm256_set1_pd (A.m12), m13 = _mm256_set1_pd (A.m13);
+	const __m256d m21 = _mm256_set1_pd (A.m21), m22 = _mm256_set1_pd (A.m22), m23 = _mm256_set1_pd (A.m23);
+	const __m256d m31 = _mm256_set1_pd (A.m31), m32 = _mm256_set1_pd (A.m32), m33 = _mm256_set1_pd (A.m33);
+	for (; i+4 <= n; i += 4) {
+		__m256d x, y, z;
+		Load4 (b+i, x, y, z);
+		Store4 (r+i, Dot3 (m11, m12, m13, x, y, z), Dot3 (m21, m22, m23, x, y, z), Dot3 (m31, m32, m33, x, y, z));
+	}
+#endif
+	for (; i < n; i++) {
+		const Vector &v = b[i];
+		r[i].Set (A.m11*v.x + A.m12*v.y + A.m13*v.z,
+		          A.m21*v.x + A.m22*v.y + A.m23*v.z,
+		          A.m31*v.x + A.m32*v.y + A.m33*v.z);
+	}
+}
+
+// =======================================================================
+
+void tmul (const Matrix &A, const Vector *b, Vector *r, int n)
+{
+	int i = 0;
+#ifdef SIMD_AVX
+	const __m256d m11 = _mm256_set1_pd (A.m11), m12 = _mm256_set1_pd (A.m12), m13 = _mm256_set1_pd (A.m13);
+	const __m256d m21 = _mm256_set1_pd (A.m21), m22 = _mm256_set1_pd (A.m22), m23 = _mm256_set1_pd (A.m23);
+	const __m256d m31 = _mm256_set1_pd (A.m31), m32 = _mm256_set1_pd (A.m32), m33 = _mm256_set1_pd (A.m33);
+	for (; i+4 <= n; i += 4) {
+		__m256d x, y, z;
+		Load4 (b+i, x, y, z);
+		Store4 (r+i, Dot3 (m11, m21, m31, x, y, z), Dot3 (m12, m22, m32, x, y, z), Dot3 (m13, m23, m33, x, y, z));
+	}
+#endif
+	for (; i < n; i++) {
+		const Vector &v = b[i];
+		r[i].Set (A.m11*v.x + A.m21*v.y + A.m31*v.z,
+		          A.m12*v.x + A.m22*v.y + A.m32*v.z,
+		          A.m13*v.x + A.m23*v.y + A.m33*v.z);
+	}
+}
+
+// =======================================================================
+
+void unify (Vector *v, int n)
+{
+	int i = 0;
+#ifdef SIMD_AVX
+	for (; i+4 <= n; i += 4) {
+		__m256d x, y, z;
+		Load4 (v+i, x, y, z);
+		__m256d len = _mm256_sqrt_pd (Dot3 (x, y, z, x, y, z));
+		Store4 (v+i, _mm256_div_pd (x, len), _mm256_div_pd (y, len), _mm256_div_pd (z, len));
+	}
+#endif
+	for (; i < n; i++) {
+		double len = v[i].length();
+		v[i].x /= len, v[i].y /= len, v[i].z /= len;
+	}
+}
+
+// =======================================================================
+
+void dotp (const Vector *a, const Vector *b, double *r, int n)
+{
+	int i = 0;
+#ifdef SIMD_AVX
+	for (; i+4 <= n; i += 4) {
+		__m256d ax, ay, az, bx, by, bz;
+		Load4 (a+i, ax, ay, az);
+		Load4 (b+i, bx, by, bz);
+		_mm256_storeu_pd (r+i, Dot3 (ax, ay, az, bx, by, bz));
+	}
+#endif
+	for (; i < n; i++)
+		r[i] = a[i].x*b[i].x + a[i].y*b[i].y + a[i].z*b[i].z;
+}
+
+// =======================================================================
+
+void crossp (const Vector *a, const Vector *b, Vector *r, int n)
+{
+	int i = 0;
+#ifdef SIMD_AVX
+	for (; i+4 <= n; i += 4) {
+		__m256d ax, ay, az, bx, by, bz;
+		Load4 (a+i, ax, ay, az);
+		Load4 (b+i, bx, by, bz);
+		Store4 (r+i,
+			_mm256_sub_pd (_mm256_mul_pd (ay, bz), _mm256_mul_pd (by, az)),
+			_mm256_sub_pd (_mm256_mul_pd (az, bx), _mm256_mul_pd (bz, ax)),
+			_mm256_sub_pd (_mm256_mul_pd (ax, by), _mm256_mul_pd (bx, ay)));
+	}
+#endif
+	for (; i < n; i++) {
+		const Vector &u = a[i], &v = b[i];
+		r[i].Set (u.y*v.z - v.y*u.z, u.z*v.x - v.z*u.x, u.x*v.y - v.x*u.y);
+	}
+}
@@ -2,21 +2,58 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include <cfloat>
 #include "Mesh.h"
+#include "D3dmath.h"
+#include "StringPool.h"
+#include "PerfectHash.h"
+#include "CmshFormat.h"
+#include "CmshQuery.h"
+#include "Bvh.h"
+#include "Arena.h"
+#include "Stats.h"
+#include "Vecmat.h"
 
 struct vtx9 { float x, y, z, nx, ny, nz, tu, tv; };
 struct vtx3 { float x, y, z; };
 struct vtx2 { float x, y; };
+struct vtx4 { float x, y, z, w; };
 
+// Sort key of a float that orders like the value, with -0 equal to 0.
+// Every NaN is equal to itself, so that sorting and grouping by these keys
+// stays well defined for any input.
+inline uint32_t FloatKey(float f)
+{
+	uint32_t u;
+	memcpy(&u, &f, sizeof(u));
+	if (u == 0x80000000u) u = 0;
+	return (u & 0x80000000u) ? ~u : u | 0x80000000u;
+}
+
+// Names of groups, materials and textures are offsets into the string pool
+// of the owning ExMesh.  Offset 0 is the empty string.
 class ExMeshGroup
 {
 public:
-	char Label[256];
+	unsigned Label;
 	int MaterialIndex;
 	int TextureIndex;
 	unsigned Flags;
 	unsigned UserFlags;
 	unsigned ZBias;
+	bool NoNormal;	// normals were generated, not read from the source
+
+	// Bounding sphere, as computed by Mesh::SetupGroup.
+	vtx3 Centre;
+	float Radius;
 
 	int VertexCount;
 	int IndexCount;
@@ -24,23 +61,40 @@ public:
 	vtx3 *Positions;
 	vtx3 *Normals;
 	vtx2 *UVCoords;
+	vtx4 *Tangents;
 	int *Indices;
 
+	// Positions welded on position alone, for depth and shadow passes.
+	int WeldedVertexCount;
+	int WeldedIndexCount;
+	vtx3 *WeldedPositions;
+	int *WeldedIndices;
+
+	// Edge adjacency of the welded geometry (see cmsh2_adjacency_group).
+	int EdgeCount;
+	int OpenEdgeCount;
+	int NonManifoldEdgeCount;
+	cmsh2_edge *Edges;
+	vtx3 *FaceNormals;
+
+	// Allocator of the arrays above, nullptr for the heap.  Arrays from an
+	// arena are released with the arena, not by the destructor.
+	Arena *Pool;
+
 public:
-	ExMeshGroup(GroupSpec *parent, char *label)
+	ExMeshGroup(const GroupSpec *parent, unsigned label, Arena *pool = nullptr)
 	{
-		ZeroMemory(Label, 256);
-		if (label)
-		{
-			int len = strlen(label);
-			for (int i = 0; i < len; i++) Label[i] = label[i];
-		}
+		Label = label;
+		Pool = pool;
 
 		MaterialIndex = 0;
 		TextureIndex = 0;
 		Flags = 0;
 		UserFlags = 0;
 		ZBias = 0;
+		NoNormal = false;
+		Centre.x = Centre.y = Centre.z = 0.0f;
+		Radius = 0.0f;
 
 		VertexCount = 0;
 		IndexCount = 0;
@@ -48,14 +102,27 @@ public:
 		Positions = nullptr;
 		Normals = nullptr;
 		UVCoords = nullptr;
+		Tangents = nullptr;
 		Indices = nullptr;
 
+		WeldedVertexCount = 0;
+		WeldedIndexCount = 0;
+		WeldedPositions = nullptr;
+		WeldedIndices = nullptr;
+
+		EdgeCount = 0;
+		OpenEdgeCount = 0;
+		NonManifoldEdgeCount = 0;
+		Edges = nullptr;
+		FaceNormals = nullptr;
+
 		if (!parent) return;
 
 		// Copy parent material data.
 		MaterialIndex = (int)parent->MtrlIdx;
 		TextureIndex = (int)parent->TexIdx;
 		Flags = (unsigned)parent->Flags;
+		NoNormal = parent->NoNormal;
 		UserFlags = (unsigned)parent->UsrFlag;
 		ZBias = (unsigned)parent->zBias;
 
@@ -64,15 +131,15 @@ public:
 		IndexCount = parent->nIdx;
 
 		// Allocate room for vertices.
-		Positions = new(std::nothrow) vtx3[VertexCount];
-		Normals = new(std::nothrow) vtx3[VertexCount];
-		UVCoords = new(std::nothrow) vtx2[VertexCount];
+		Positions = ArenaNewArray<vtx3>(Pool, VertexCount);
+		Normals = ArenaNewArray<vtx3>(Pool, VertexCount);
+		UVCoords = ArenaNewArray<vtx2>(Pool, VertexCount);
 
 		if (!Positions || !Normals || !UVCoords)
 		{
-			if (Positions) delete[] Positions;
-			if (Normals) delete[] Normals;
-			if (UVCoords) delete[] UVCoords;
+			if (Positions) ArenaDeleteArray(Pool, Positions);
+			if (Normals) ArenaDeleteArray(Pool, Normals);
+			if (UVCoords) ArenaDeleteArray(Pool, UVCoords);
 			Positions = nullptr;
 			Normals = nullptr;
 			UVCoords = nullptr;
@@ -93,14 +160,14 @@ public:
 		}
 
 		// Allocate room for indices.
-		Indices = new(std::nothrow) int[IndexCount];
+		Indices = ArenaNewArray<int>(Pool, IndexCount);
 		if (!Indices)
 		{
-			delete[] Positions;
+			ArenaDeleteArray(Pool, Positions);
 			Positions = nullptr;
-			delete[] Normals;
+			ArenaDeleteArray(Pool, Normals);
 			Normals = nullptr;
-			delete[] UVCoords;
+			ArenaDeleteArray(Pool, UVCoords);
 			UVCoords = nullptr;
 			return;
 		}
@@ -112,6 +179,466 @@ public:
 		}
 	}
 
+	// Generate a tangent for each vertex from the positions, normals and UV
+	// coords with the rules of MikkTSpace.  Vertices equal in position,
+	// normal and UV coords count as one vertex, as in MikkTSpace.  The
+	// corners around a vertex are split into groups of faces that are
+	// connected by edges and have the same UV orientation; faces without UV
+	// area join the first group that reaches them.  The tangent of a group
+	// is the sum of the face tangents projected into the tangent plane and
+	// weighted by the corner angles in that plane.  Corners of degenerate
+	// faces take the result of another corner of their vertex.  A vertex
+	// whose corners end up with different results is duplicated, so that
+	// every corner gets the tangent of its group.  The w component holds
+	// the orientation of the group as bitangent sign, so that
+	// bitangent = w * cross(normal, tangent).  Replaces the tangents of a
+	// previous call.
+	bool GenerateTangents()
+	{
+		if (Tangents) ArenaDeleteArray(Pool, Tangents);
+		Tangents = nullptr;
+		if (!VertexCount) return true;
+		int faceCount = IndexCount / 3;
+
+		// Representative (lowest index) of the vertices equal to each vertex.
+		auto attributes = [this](int i, uint32_t *a)
+		{
+			a[0] = FloatKey(Positions[i].x); a[1] = FloatKey(Positions[i].y); a[2] = FloatKey(Positions[i].z);
+			a[3] = FloatKey(Normals[i].x); a[4] = FloatKey(Normals[i].y); a[5] = FloatKey(Normals[i].z);
+			a[6] = FloatKey(UVCoords[i].x); a[7] = FloatKey(UVCoords[i].y);
+		};
+		auto compare = [&attributes](int i, int j)
+		{
+			uint32_t a[8], b[8];
+			attributes(i, a);
+			attributes(j, b);
+			for (int k = 0; k < 8; k++)
+				if (a[k] != b[k]) return a[k] < b[k] ? -1 : 1;
+			return 0;
+		};
+		std::vector<int> order(VertexCount), canon(VertexCount);
+		for (int i = 0; i < VertexCount; i++) order[i] = i;
+		std::sort(order.begin(), order.end(), [&compare](int a, int b)
+		{
+			int c = compare(a, b);
+			return c ? c < 0 : a < b;
+		});
+		for (int i = 0, j; i < VertexCount; i = j)
+		{
+			canon[order[i]] = order[i];
+			for (j = i + 1; j < VertexCount && compare(order[j], order[i]) == 0; j++)
+				canon[order[j]] = order[i];
+		}
+
+		// Unit face tangents, oriented by the sign of the UV area.
+		struct Face
+		{
+			vtx3 Tangent;
+			bool Degenerate;	// repeated vertex or index out of range
+			bool AnyOrient;	// no UV area, joins groups of either orientation
+			bool Orient;	// UV area is positive
+			bool Assigned;	// a corner belongs to a group
+		};
+		std::vector<Face> faces(faceCount);
+		for (int f = 0; f < faceCount; f++)
+		{
+			Face &face = faces[f];
+			const int *v = Indices + f * 3;
+			face.Tangent = { 0.0f, 0.0f, 0.0f };
+			face.Assigned = false;
+			face.Degenerate = v[0] < 0 || v[1] < 0 || v[2] < 0 || v[0] >= VertexCount || v[1] >= VertexCount ||
+				v[2] >= VertexCount || canon[v[0]] == canon[v[1]] || canon[v[1]] == canon[v[2]] || canon[v[2]] == canon[v[0]];
+			if (face.Degenerate) continue;
+
+			vtx3 &p0 = Positions[v[0]], &p1 = Positions[v[1]], &p2 = Positions[v[2]];
+			vtx3 d1 = { p1.x - p0.x, p1.y - p0.y, p1.z - p0.z };
+			vtx3 d2 = { p2.x - p0.x, p2.y - p0.y, p2.z - p0.z };
+			float s1 = UVCoords[v[1]].x - UVCoords[v[0]].x, t1 = UVCoords[v[1]].y - UVCoords[v[0]].y;
+			float s2 = UVCoords[v[2]].x - UVCoords[v[0]].x, t2 = UVCoords[v[2]].y - UVCoords[v[0]].y;
+			float area = s1 * t2 - s2 * t1;
+			face.Orient = area > 0.0f;
+			face.AnyOrient = !(fabsf(area) > FLT_MIN);
+			if (face.AnyOrient) continue;
+			float sign = face.Orient ? 1.0f : -1.0f;
+			vtx3 t = { t2 * d1.x - t1 * d2.x, t2 * d1.y - t1 * d2.y, t2 * d1.z - t1 * d2.z };
+			float len = sqrtf(t.x * t.x + t.y * t.y + t.z * t.z);
+			if (len > FLT_MIN) face.Tangent = { sign * t.x / len, sign * t.y / len, sign * t.z / len };
+		}
+
+		// Neighbour across each edge: a face with the same edge in the
+		// opposite direction.  Edge e of face f runs from corner e to e + 1.
+		struct Edge
+		{
+			int From, To, Corner;
+			bool operator<(const Edge &e) const
+			{
+				return From != e.From ? From < e.From : To != e.To ? To < e.To : Corner < e.Corner;
+			}
+		};
+		std::vector<Edge> edges;
+		edges.reserve(faceCount * 3);
+		for (int f = 0; f < faceCount; f++)
+			if (!faces[f].Degenerate)
+				for (int e = 0; e < 3; e++)
+					edges.push_back({ canon[Indices[f * 3 + e]], canon[Indices[f * 3 + (e + 1) % 3]], f * 3 + e });
+		std::sort(edges.begin(), edges.end());
+		std::vector<int> neighbour(faceCount * 3, -1);
+		for (size_t k = 0; k < edges.size(); k++)
+		{
+			Edge key = { edges[k].To, edges[k].From, -1 };
+			std::vector<Edge>::iterator it = std::lower_bound(edges.begin(), edges.end(), key);
+			for (; it != edges.end() && it->From == key.From && it->To == key.To; ++it)
+				if (it->Corner / 3 != edges[k].Corner / 3)
+				{
+					neighbour[edges[k].Corner] = it->Corner / 3;
+					break;
+				}
+		}
+
+		// Group the corners of each vertex by flooding over the edges at the
+		// vertex, as long as the UV orientation stays the same.
+		std::vector<int> group(faceCount * 3, -1);
+		std::vector<char> groupOrient;
+		std::vector<int> pending;
+		for (int start = 0; start < faceCount * 3; start++)
+		{
+			if (group[start] >= 0 || faces[start / 3].Degenerate) continue;
+			int g = (int)groupOrient.size(), vertex = canon[Indices[start]];
+			bool orient = faces[start / 3].Orient;
+			groupOrient.push_back(orient);
+			pending.push_back(start);
+			while (!pending.empty())
+			{
+				int k = pending.back(), f = k / 3, c = k % 3;
+				pending.pop_back();
+				if (group[k] >= 0) continue;
+				Face &face = faces[f];
+				if (face.AnyOrient && !face.Assigned) face.Orient = orient;
+				if (face.Orient != orient) continue;
+				group[k] = g;
+				face.Assigned = true;
+				int across[2] = { neighbour[f * 3 + c], neighbour[f * 3 + (c + 2) % 3] };
+				for (int n = 0; n < 2; n++)
+				{
+					if (across[n] < 0) continue;
+					for (int j = 0; j < 3; j++)
+						if (canon[Indices[across[n] * 3 + j]] == vertex) pending.push_back(across[n] * 3 + j);
+				}
+			}
+		}
+
+		// Sum the projected face tangents of each group, weighted by the
+		// corner angles.
+		int groupCount = (int)groupOrient.size();
+		std::vector<vtx3> result(groupCount, vtx3{ 0.0f, 0.0f, 0.0f });
+		std::vector<int> vertexGroup(VertexCount, -1);
+		for (int k = 0; k < faceCount * 3; k++)
+		{
+			int g = group[k];
+			if (g < 0) continue;
+			int f = k / 3, c = k % 3, i = Indices[k];
+			vertexGroup[canon[i]] = g;
+			const vtx3 &n = Normals[i], &p = Positions[i];
+			const vtx3 &pn = Positions[Indices[f * 3 + (c + 1) % 3]], &pp = Positions[Indices[f * 3 + (c + 2) % 3]];
+			vtx3 e1 = { pn.x - p.x, pn.y - p.y, pn.z - p.z };
+			vtx3 e2 = { pp.x - p.x, pp.y - p.y, pp.z - p.z };
+			float cosa = 0.0f;
+			if (ProjectNormalize(e1, n) && ProjectNormalize(e2, n)) cosa = e1.x * e2.x + e1.y * e2.y + e1.z * e2.z;
+			float angle = acosf(cosa < -1.0f ? -1.0f : cosa > 1.0f ? 1.0f : cosa);
+			vtx3 t = faces[f].Tangent;
+			if (!ProjectNormalize(t, n)) continue;
+			result[g].x += t.x * angle;
+			result[g].y += t.y * angle;
+			result[g].z += t.z * angle;
+		}
+		for (int g = 0; g < groupCount; g++)
+		{
+			vtx3 &t = result[g];
+			float len = sqrtf(t.x * t.x + t.y * t.y + t.z * t.z);
+			if (len > FLT_MIN) t = { t.x / len, t.y / len, t.z / len };
+		}
+
+		// Result of each corner: its group, or any group of its vertex for
+		// corners of degenerate faces, or -1 for none.
+		auto cornerResult = [&](int k)
+		{
+			if (group[k] >= 0) return group[k];
+			int i = Indices[k];
+			return i >= 0 && i < VertexCount ? vertexGroup[canon[i]] : -1;
+		};
+		auto sameResult = [&](int a, int b)
+		{
+			if (a == b) return true;
+			if (a < 0 || b < 0) return false;
+			return groupOrient[a] == groupOrient[b] && result[a].x == result[b].x &&
+				result[a].y == result[b].y && result[a].z == result[b].z;
+		};
+
+		// Give each vertex the result of its first corner, and duplicate it
+		// for corners with other results.
+		const int UNSET = -2;
+		std::vector<int> vertexResult(VertexCount, UNSET), source, firstCopy(VertexCount, -1), nextCopy;
+		for (int k = 0; k < faceCount * 3; k++)
+		{
+			int i = Indices[k];
+			if (i < 0 || i >= VertexCount) continue;
+			int r = cornerResult(k);
+			if (vertexResult[i] == UNSET) vertexResult[i] = r;
+			if (sameResult(vertexResult[i], r)) continue;
+			int copy = firstCopy[i];
+			while (copy >= 0 && !sameResult(vertexResult[copy], r)) copy = nextCopy[copy - VertexCount];
+			if (copy < 0)
+			{
+				copy = VertexCount + (int)source.size();
+				source.push_back(i);
+				nextCopy.push_back(firstCopy[i]);
+				firstCopy[i] = copy;
+				vertexResult.push_back(r);
+			}
+			Indices[k] = copy;
+		}
+
+		int count = VertexCount + (int)source.size();
+		Tangents = ArenaNewArray<vtx4>(Pool, count);
+		if (!Tangents) return false;
+		if (!source.empty())
+		{
+			vtx3 *positions = ArenaNewArray<vtx3>(Pool, count);
+			vtx3 *normals = ArenaNewArray<vtx3>(Pool, count);
+			vtx2 *uvCoords = ArenaNewArray<vtx2>(Pool, count);
+			if (!positions || !normals || !uvCoords)
+			{
+				if (positions) ArenaDeleteArray(Pool, positions);
+				if (normals) ArenaDeleteArray(Pool, normals);
+				if (uvCoords) ArenaDeleteArray(Pool, uvCoords);
+				ArenaDeleteArray(Pool, Tangents);
+				Tangents = nullptr;
+				return false;
+			}
+			memcpy(positions, Positions, VertexCount * sizeof(vtx3));
+			memcpy(normals, Normals, VertexCount * sizeof(vtx3));
+			memcpy(uvCoords, UVCoords, VertexCount * sizeof(vtx2));
+			for (size_t j = 0; j < source.size(); j++)
+			{
+				positions[VertexCount + j] = Positions[source[j]];
+				normals[VertexCount + j] = Normals[source[j]];
+				uvCoords[VertexCount + j] = UVCoords[source[j]];
+			}
+			ArenaDeleteArray(Pool, Positions);
+			ArenaDeleteArray(Pool, Normals);
+			ArenaDeleteArray(Pool, UVCoords);
+			Positions = positions;
+			Normals = normals;
+			UVCoords = uvCoords;
+			VertexCount = count;
+		}
+
+		for (int i = 0; i < VertexCount; i++)
+		{
+			int r = vertexResult[i];
+			vtx3 &n = Normals[i];
+			vtx3 t = r >= 0 ? result[r] : vtx3{ 0.0f, 0.0f, 0.0f };
+			if (t.x == 0.0f && t.y == 0.0f && t.z == 0.0f)
+			{
+				// No usable UV gradient: pick any direction in the tangent plane.
+				if (fabs(n.x) < 0.9f) t = { 1.0f, 0.0f, 0.0f };
+				else t = { 0.0f, 1.0f, 0.0f };
+				if (!ProjectNormalize(t, n)) t = { 1.0f, 0.0f, 0.0f };
+			}
+			Tangents[i].x = t.x;
+			Tangents[i].y = t.y;
+			Tangents[i].z = t.z;
+			Tangents[i].w = r < 0 || groupOrient[r] ? 1.0f : -1.0f;
+		}
+		return true;
+	}
+
+	// Merge all vertices with equal positions into one, and index them with
+	// a separate index list.  Welded vertices keep the order of their first
+	// use.  Triangles that become degenerate are left out.
+	bool WeldPositions()
+	{
+		WeldedPositions = ArenaNewArray<vtx3>(Pool, VertexCount);
+		WeldedIndices = ArenaNewArray<int>(Pool, IndexCount);
+		int *order = ArenaNewArray<int>(Pool, VertexCount);
+		int *remap = ArenaNewArray<int>(Pool, VertexCount);
+		if (!WeldedPositions || !WeldedIndices || !order || !remap)
+		{
+			if (WeldedPositions) ArenaDeleteArray(Pool, WeldedPositions);
+			if (WeldedIndices) ArenaDeleteArray(Pool, WeldedIndices);
+			if (order) ArenaDeleteArray(Pool, order);
+			if (remap) ArenaDeleteArray(Pool, remap);
+			WeldedPositions = nullptr;
+			WeldedIndices = nullptr;
+			return false;
+		}
+
+		// Sort the vertices by position, so that equal positions are adjacent.
+		// Note that -0 and 0 compare equal (see FloatKey).
+		const vtx3 *p = Positions;
+		auto samePosition = [p](int a, int b)
+		{
+			return FloatKey(p[a].x) == FloatKey(p[b].x) && FloatKey(p[a].y) == FloatKey(p[b].y) &&
+				FloatKey(p[a].z) == FloatKey(p[b].z);
+		};
+		for (int i = 0; i < VertexCount; i++) order[i] = i;
+		std::sort(order, order + VertexCount, [p](int a, int b)
+		{
+			if (FloatKey(p[a].x) != FloatKey(p[b].x)) return FloatKey(p[a].x) < FloatKey(p[b].x);
+			if (FloatKey(p[a].y) != FloatKey(p[b].y)) return FloatKey(p[a].y) < FloatKey(p[b].y);
+			if (FloatKey(p[a].z) != FloatKey(p[b].z)) return FloatKey(p[a].z) < FloatKey(p[b].z);
+			return a < b;
+		});
+
+		// Map each vertex to the first vertex with its position.
+		for (int i = 0, j; i < VertexCount; i = j)
+		{
+			remap[order[i]] = order[i];
+			for (j = i + 1; j < VertexCount && samePosition(order[j], order[i]); j++)
+				remap[order[j]] = order[i];
+		}
+
+		// Number the welded vertices in the order of their first vertex.
+		WeldedVertexCount = 0;
+		for (int i = 0; i < VertexCount; i++)
+		{
+			if (remap[i] == i)
+			{
+				WeldedPositions[WeldedVertexCount] = p[i];
+				remap[i] = WeldedVertexCount++;
+			}
+			else remap[i] = remap[remap[i]];
+		}
+
+		WeldedIndexCount = 0;
+		for (int t = 0; t + 2 < IndexCount; t += 3)
+		{
+			if (Indices[t] >= VertexCount || Indices[t + 1] >= VertexCount || Indices[t + 2] >= VertexCount) continue;
+			int a = remap[Indices[t]], b = remap[Indices[t + 1]], c = remap[Indices[t + 2]];
+			if (a == b || b == c || a == c) continue;
+			WeldedIndices[WeldedIndexCount++] = a;
+			WeldedIndices[WeldedIndexCount++] = b;
+			WeldedIndices[WeldedIndexCount++] = c;
+		}
+
+		ArenaDeleteArray(Pool, order);
+		ArenaDeleteArray(Pool, remap);
+		return true;
+	}
+
+	// Build the edge adjacency and face normals of the welded geometry
+	// (see WeldPositions).  Edges are found with a hash map keyed on their
+	// sorted vertex pair.
+	bool BuildAdjacency()
+	{
+		int triangleCount = WeldedIndexCount / 3;
+		int maxEdges = WeldedIndexCount;
+		int slotCount = 16;
+		while (slotCount < 2 * maxEdges) slotCount *= 2;
+
+		// Per unique edge: vertices (lower first), the first triangle using
+		// it in each direction, and the number of triangles in each direction.
+		struct EdgeInfo { int v0, v1, forward, backward, forwardCount, backwardCount; };
+		EdgeInfo *info = ArenaNewArray<EdgeInfo>(Pool, maxEdges);
+		int *slots = ArenaNewArray<int>(Pool, slotCount);
+		Edges = ArenaNewArray<cmsh2_edge>(Pool, maxEdges);
+		FaceNormals = ArenaNewArray<vtx3>(Pool, triangleCount);
+		if (!info || !slots || !Edges || !FaceNormals)
+		{
+			if (info) ArenaDeleteArray(Pool, info);
+			if (slots) ArenaDeleteArray(Pool, slots);
+			if (Edges) ArenaDeleteArray(Pool, Edges);
+			if (FaceNormals) ArenaDeleteArray(Pool, FaceNormals);
+			Edges = nullptr;
+			FaceNormals = nullptr;
+			return false;
+		}
+		for (int i = 0; i < slotCount; i++) slots[i] = -1;
+
+		int uniqueCount = 0;
+		for (int t = 0; t < triangleCount; t++)
+		{
+			const int *tri = WeldedIndices + 3 * t;
+			for (int e = 0; e < 3; e++)
+			{
+				int a = tri[e], b = tri[(e + 1) % 3];
+				int v0 = a < b ? a : b, v1 = a < b ? b : a;
+				unsigned hash = ((unsigned)v0 * 0x9E3779B1u) ^ ((unsigned)v1 * 0x85EBCA77u);
+				int slot = (int)(hash & (slotCount - 1));
+				while (slots[slot] >= 0 && (info[slots[slot]].v0 != v0 || info[slots[slot]].v1 != v1))
+					slot = (slot + 1) & (slotCount - 1);
+				if (slots[slot] < 0)
+				{
+					slots[slot] = uniqueCount;
+					info[uniqueCount++] = { v0, v1, -1, -1, 0, 0 };
+				}
+				EdgeInfo &edge = info[slots[slot]];
+				if (a == v0)
+				{
+					if (!edge.forwardCount++) edge.forward = t;
+				}
+				else
+				{
+					if (!edge.backwardCount++) edge.backward = t;
+				}
+			}
+		}
+
+		// Manifold edges first, then open edges, then non-manifold edges.
+		EdgeCount = 0;
+		for (int i = 0; i < uniqueCount; i++)
+		{
+			if (info[i].forwardCount == 1 && info[i].backwardCount == 1)
+				Edges[EdgeCount++] = { { (uint32_t)info[i].v0, (uint32_t)info[i].v1 }, { (uint32_t)info[i].forward, (uint32_t)info[i].backward } };
+		}
+		for (int i = 0; i < uniqueCount; i++)
+		{
+			if (info[i].forwardCount + info[i].backwardCount != 1) continue;
+			if (info[i].forwardCount)
+				Edges[EdgeCount++] = { { (uint32_t)info[i].v0, (uint32_t)info[i].v1 }, { (uint32_t)info[i].forward, CMSH2_NO_TRIANGLE } };
+			else
+				Edges[EdgeCount++] = { { (uint32_t)info[i].v1, (uint32_t)info[i].v0 }, { (uint32_t)info[i].backward, CMSH2_NO_TRIANGLE } };
+			OpenEdgeCount++;
+		}
+		// A non-manifold edge gets one record per triangle using it, so the
+		// triangles are scanned again for these edges only.
+		for (int t = 0; t < triangleCount; t++)
+		{
+			const int *tri = WeldedIndices + 3 * t;
+			for (int e = 0; e < 3; e++)
+			{
+				int a = tri[e], b = tri[(e + 1) % 3];
+				int v0 = a < b ? a : b, v1 = a < b ? b : a;
+				unsigned hash = ((unsigned)v0 * 0x9E3779B1u) ^ ((unsigned)v1 * 0x85EBCA77u);
+				int slot = (int)(hash & (slotCount - 1));
+				while (info[slots[slot]].v0 != v0 || info[slots[slot]].v1 != v1)
+					slot = (slot + 1) & (slotCount - 1);
+				const EdgeInfo &edge = info[slots[slot]];
+				int count = edge.forwardCount + edge.backwardCount;
+				if (count == 1 || (edge.forwardCount == 1 && edge.backwardCount == 1)) continue;
+				Edges[EdgeCount++] = { { (uint32_t)a, (uint32_t)b }, { (uint32_t)t, CMSH2_NO_TRIANGLE } };
+				NonManifoldEdgeCount++;
+			}
+		}
+
+		for (int t = 0; t < triangleCount; t++)
+		{
+			const vtx3 &p0 = WeldedPositions[WeldedIndices[3 * t]];
+			const vtx3 &p1 = WeldedPositions[WeldedIndices[3 * t + 1]];
+			const vtx3 &p2 = WeldedPositions[WeldedIndices[3 * t + 2]];
+			vtx3 d1 = { p1.x - p0.x, p1.y - p0.y, p1.z - p0.z };
+			vtx3 d2 = { p2.x - p0.x, p2.y - p0.y, p2.z - p0.z };
+			vtx3 n = { d1.y * d2.z - d1.z * d2.y, d1.z * d2.x - d1.x * d2.z, d1.x * d2.y - d1.y * d2.x };
+			float len = (float)sqrt(n.x * n.x + n.y * n.y + n.z * n.z);
+			if (len > 0.0f) n.x /= len, n.y /= len, n.z /= len;
+			FaceNormals[t] = n;
+		}
+
+		ArenaDeleteArray(Pool, info);
+		ArenaDeleteArray(Pool, slots);
+		return true;
+	}
+
 	bool Validate()
 	{
 		if (IndexCount && !Indices) return false;
@@ -121,34 +648,52 @@ public:
 
 	~ExMeshGroup()
 	{
-		if (Indices) delete[] Indices;
-		if (Positions) delete[] Positions;
-		if (Normals) delete[] Normals;
-		if (UVCoords) delete[] UVCoords;
+		if (Indices) ArenaDeleteArray(Pool, Indices);
+		if (Positions) ArenaDeleteArray(Pool, Positions);
+		if (Normals) ArenaDeleteArray(Pool, Normals);
+		if (UVCoords) ArenaDeleteArray(Pool, UVCoords);
+		if (Tangents) ArenaDeleteArray(Pool, Tangents);
+		if (WeldedPositions) ArenaDeleteArray(Pool, WeldedPositions);
+		if (WeldedIndices) ArenaDeleteArray(Pool, WeldedIndices);
+		if (Edges) ArenaDeleteArray(Pool, Edges);
+		if (FaceNormals) ArenaDeleteArray(Pool, FaceNormals);
+	}
+
+private:
+	// Remove the component of v along the unit normal n and normalize the
+	// result.  Returns false if nothing is left.
+	static bool ProjectNormalize(vtx3 &v, const vtx3 &n)
+	{
+		float d = v.x * n.x + v.y * n.y + v.z * n.z;
+		v.x -= n.x * d;
+		v.y -= n.y * d;
+		v.z -= n.z * d;
+		float len = (float)sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+		if (len < 1e-20f) return false;
+		v.x /= len;
+		v.y /= len;
+		v.z /= len;
+		return true;
 	}
 };
 
 class ExMaterial
 {
 public:
-	char Name[256];
+	unsigned Name;
 	float Diffuse[4];
 	float Ambient[3];
 	float Specular[3];
 	float Emissive[3];
 	float Power;
 
-	ExMaterial(D3DMATERIAL7 *material, char *name)
+	ExMaterial(const D3DMATERIAL7 *material, unsigned name)
 	{
 		ZeroMemory(this, sizeof(ExMaterial));
 
 		if (!material) return;
 
-		if (name)
-		{
-			int length = strlen(name);
-			for (int i = 0; i < length; i++) Name[i] = name[i];
-		}
+		Name = name;
 
 		Diffuse[0] = material->diffuse.r;
 		Diffuse[1] = material->diffuse.g;
@@ -174,13 +719,11 @@ public:
 class ExTexture
 {
 public:
-	char Name[256];
+	unsigned Name;
 
-	ExTexture(char *name)
+	ExTexture(unsigned name)
 	{
-		ZeroMemory(Name, 256);
-		unsigned length = strlen(name);
-		for (int i = 0; i < length; i++) Name[i] = name[i];
+		Name = name;
 	}
 };
 
@@ -194,9 +737,26 @@ public:
 	ExMeshGroup **GroupList;
 	ExMaterial **MaterialList;
 	ExTexture **TextureList;
+
+	// Names referenced by the lists above.  Only names that end up in the
+	// output are added, so the pool can be written out as the string table.
+	StringPool Strings;
+
+	// Triangle BVH over all groups (see cmsh2_bvh), empty unless built.
+	std::vector<cmsh2_bvh_node> BvhNodes;
+	std::vector<cmsh2_bvh_triangle> BvhTriangles;
+
+	// Hierarchy over the group bounds (see cmsh2_group_bvh), empty unless built.
+	std::vector<cmsh2_bvh_node> GroupBvhNodes;
+	std::vector<cmsh2_group_bound> GroupBounds;
+
+	// Allocator of the groups, materials and textures and their lists,
+	// nullptr for the heap.  It must outlive the mesh.
+	Arena *Pool;
 	
-	ExMesh(Mesh *mesh)
+	ExMesh(const Mesh *mesh, bool materialNames = true, Arena *pool = nullptr)
 	{
+		Pool = pool;
 		GroupCount = 0;
 		MaterialCount = 0;
 		TextureCount = 0;
@@ -213,14 +773,22 @@ public:
 		GroupCount = mesh->nGroup();
 		if (GroupCount)
 		{
-			GroupList = new(std::nothrow) ExMeshGroup * [GroupCount];
+			GroupList = ArenaNewArray<ExMeshGroup *>(Pool, GroupCount);
 			if (GroupList)
 			{
 				for (int i = 0; i < GroupCount; i++)
 				{
-					char *label = mesh->Labels[i].File;
-					if (mesh->Labels[i].File[0] == '\0') label = nullptr;
-					GroupList[i] = new(std::nothrow) ExMeshGroup(mesh->GetGroup(i), label);
+					unsigned label = Strings.Add(mesh->GetLabel(i));
+					GroupList[i] = ArenaNew<ExMeshGroup>(Pool, mesh->GetGroup(i), label, Pool);
+					D3DVECTOR centre;
+					D3DVALUE radius;
+					if (GroupList[i] && mesh->GetGroup(i)->nVtx && mesh->GetGroupBounds(i, centre, radius))
+					{
+						GroupList[i]->Centre.x = centre.x;
+						GroupList[i]->Centre.y = centre.y;
+						GroupList[i]->Centre.z = centre.z;
+						GroupList[i]->Radius = radius;
+					}
 				}
 			}
 		}
@@ -229,14 +797,13 @@ public:
 		MaterialCount = mesh->nMaterial();
 		if (MaterialCount)
 		{
-			MaterialList = new(std::nothrow) ExMaterial * [MaterialCount];
+			MaterialList = ArenaNewArray<ExMaterial *>(Pool, MaterialCount);
 			if (MaterialList)
 			{
 				for (int i = 0; i < MaterialCount; i++)
 				{
-					char *name = mesh->MatNames[i].File;
-					if (name[0] == '\0') name = nullptr;
-					MaterialList[i] = new(std::nothrow) ExMaterial(mesh->GetMaterial(i), name);
+					unsigned name = materialNames ? Strings.Add(mesh->GetMaterialName(i)) : 0;
+					MaterialList[i] = ArenaNew<ExMaterial>(Pool, mesh->GetMaterial(i), name);
 				}
 			}
 		}
@@ -245,12 +812,12 @@ public:
 		TextureCount = mesh->nTexture();
 		if (TextureCount)
 		{
-			TextureList = new(std::nothrow) ExTexture * [TextureCount];
+			TextureList = ArenaNewArray<ExTexture *>(Pool, TextureCount);
 			if (TextureList)
 			{
 				for (int i = 0; i < TextureCount; i++)
 				{
-					TextureList[i] = new(std::nothrow) ExTexture(mesh->GetTextureName(i));
+					TextureList[i] = ArenaNew<ExTexture>(Pool, Strings.Add(mesh->GetTextureName(i)));
 				}
 			}
 		}
@@ -268,13 +835,76 @@ public:
 		return true;
 	}
 
+	// Build the triangle BVH over the positions of all groups
+	void BuildTriangleBvh()
+	{
+		std::vector<cmsh2_bvh_triangle> triangles;
+		std::vector<BvhBox> boxes;
+		for (int i = 0; i < GroupCount; i++)
+		{
+			ExMeshGroup *current = GroupList[i];
+			for (int j = 0; j + 2 < current->IndexCount; j += 3)
+			{
+				const vtx3 &a = current->Positions[current->Indices[j]];
+				const vtx3 &b = current->Positions[current->Indices[j + 1]];
+				const vtx3 &c = current->Positions[current->Indices[j + 2]];
+				cmsh2_bvh_triangle t = { { a.x, a.y, a.z }, { b.x - a.x, b.y - a.y, b.z - a.z },
+					{ c.x - a.x, c.y - a.y, c.z - a.z }, (uint32_t)i, (uint32_t)(j / 3), 0 };
+				BvhBox box = { { std::min(a.x, std::min(b.x, c.x)), std::min(a.y, std::min(b.y, c.y)), std::min(a.z, std::min(b.z, c.z)) },
+					{ std::max(a.x, std::max(b.x, c.x)), std::max(a.y, std::max(b.y, c.y)), std::max(a.z, std::max(b.z, c.z)) } };
+				triangles.push_back(t);
+				boxes.push_back(box);
+			}
+		}
+
+		std::vector<uint32_t> order;
+		BuildBvh(boxes.data(), (uint32_t)boxes.size(), 4, BvhNodes, order);
+		BvhTriangles.resize(order.size());
+		for (size_t i = 0; i < order.size(); i++) BvhTriangles[i] = triangles[order[i]];
+	}
+
+	// Build the hierarchy over the group bounding spheres
+	void BuildGroupBvh()
+	{
+		std::vector<BvhBox> boxes(GroupCount);
+		for (int i = 0; i < GroupCount; i++)
+		{
+			const vtx3 &c = GroupList[i]->Centre;
+			float r = GroupList[i]->Radius;
+			BvhBox box = { { c.x - r, c.y - r, c.z - r }, { c.x + r, c.y + r, c.z + r } };
+			boxes[i] = box;
+		}
+
+		std::vector<uint32_t> order;
+		BuildBvh(boxes.data(), (uint32_t)boxes.size(), 4, GroupBvhNodes, order);
+		GroupBounds.resize(order.size());
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			const ExMeshGroup *current = GroupList[order[i]];
+			cmsh2_group_bound b = { { current->Centre.x, current->Centre.y, current->Centre.z }, current->Radius, order[i] };
+			GroupBounds[i] = b;
+		}
+	}
+
 	~ExMesh()
 	{
 		if (GroupList)
 		{
 			for (int i = 0; i < GroupCount; i++)
-				delete GroupList[i];
-			delete[] GroupList;
+				ArenaDelete(Pool, GroupList[i]);
+			ArenaDeleteArray(Pool, GroupList);
+		}
+		if (MaterialList)
+		{
+			for (int i = 0; i < MaterialCount; i++)
+				ArenaDelete(Pool, MaterialList[i]);
+			ArenaDeleteArray(Pool, MaterialList);
+		}
+		if (TextureList)
+		{
+			for (int i = 0; i < TextureCount; i++)
+				ArenaDelete(Pool, TextureList[i]);
+			ArenaDeleteArray(Pool, TextureList);
 		}
 	}
 };
@@ -287,239 +917,707 @@ struct cmsh_header
 	int TextureCount;
 	int VertexComponents : 1;
 	int MaterialNames : 1;
+	int Tangents : 1;
+	int GroupRemap : 1;
+	int StringTable : 1;
+	int NameIndex : 1;
+};
+
+// Header of a version 1 file for mesh, with all options cleared
+cmsh_header MakeCmsh1Header(const ExMesh &mesh)
+{
+	cmsh_header header;
+	ZeroMemory(&header, sizeof(cmsh_header));
+	header.Header[0] = '_';
+	header.Header[1] = 'C';
+	header.Header[2] = 'M';
+	header.Header[3] = 'S';
+	header.Header[4] = 'H';
+	header.Header[5] = 'X';
+	header.Header[6] = '1';
+	header.Header[7] = '_';
+	header.GroupCount = mesh.GroupCount;
+	header.MaterialCount = mesh.MaterialCount;
+	header.TextureCount = mesh.TextureCount;
+	return header;
+}
+
+struct cmsh_group_remap
+{
+	int Group;
+	int VertexOffset;
+	int VertexCount;
+	int IndexOffset;
+	int IndexCount;
 };
 
+// Decide which groups must not be merged.  A group is kept if its label is
+// on the deny list (or the deny list contains "*" and the group is labeled),
+// unless the label is also on the allow list.  Groups with any of the
+// userFlagMask bits set are always kept.
+bool *GetKeepList(const Mesh &mesh, const std::vector<const char *> &deny, const std::vector<const char *> &allow, unsigned userFlagMask)
+{
+	bool denyLabeled = false;
+	for (size_t i = 0; i < deny.size(); i++)
+		if (strcmp(deny[i], "*") == 0) denyLabeled = true;
+
+	// Labels are interned, so look the names up once and compare offsets.
+	const StringPool &strings = mesh.GetStrings();
+	std::vector<DWORD> denyOfs, allowOfs;
+	for (size_t i = 0; i < deny.size(); i++) denyOfs.push_back(strings.Find(deny[i]));
+	for (size_t i = 0; i < allow.size(); i++) allowOfs.push_back(strings.Find(allow[i]));
+
+	bool *keep = new(std::nothrow) bool[mesh.nGroup()];
+	if (!keep) return nullptr;
+	for (DWORD g = 0; g < mesh.nGroup(); g++)
+	{
+		keep[g] = (mesh.GetGroupUsrFlag(g) & userFlagMask) != 0;
+		DWORD label = mesh.GetGroup(g)->Label;
+		if (keep[g] || !label) continue;
+
+		bool denied = denyLabeled, allowed = false;
+		for (size_t i = 0; i < denyOfs.size(); i++)
+			if (denyOfs[i] == label) denied = true;
+		for (size_t i = 0; i < allowOfs.size(); i++)
+			if (allowOfs[i] == label) allowed = true;
+		keep[g] = denied && !allowed;
+	}
+	return keep;
+}
 
-int main(int argCount, char **argList)
+struct TransformStep
 {
-	char *inputFile = nullptr;
-	char *outputFile = nullptr;
+	enum Type { SCALE, TRANSLATE, ROTATE, TEXSCALE, MATRIX } Kind;
+	Mesh::RotAxis Axis;
+	float Values[16];
+};
 
-	bool straightConvert = false;
-	bool inputNext = false;
-	bool outputNext = false;
-	bool noMatNames = false;
+// Parse one transform step.  Keyword is one of "scale", "translate", "rotate",
+// "texscale" or "matrix" and args holds the parameters that follow it.  Each
+// number and the axis must be a whole parameter, so "1.5abc" and "xy" are
+// invalid.  Returns the number of parameters used, or -1 if the step is
+// invalid.
+int ParseTransform(const char *keyword, char **args, int argCount, TransformStep &step)
+{
+	int count;
+	ZeroMemory(&step, sizeof(TransformStep));
+	if (strcmp(keyword, "scale") == 0) step.Kind = TransformStep::SCALE, count = 3;
+	else if (strcmp(keyword, "translate") == 0) step.Kind = TransformStep::TRANSLATE, count = 3;
+	else if (strcmp(keyword, "rotate") == 0) step.Kind = TransformStep::ROTATE, count = 2;
+	else if (strcmp(keyword, "texscale") == 0) step.Kind = TransformStep::TEXSCALE, count = 2;
+	else if (strcmp(keyword, "matrix") == 0) step.Kind = TransformStep::MATRIX, count = 16;
+	else return -1;
+	if (argCount < count) return -1;
+
+	int first = 0;
+	if (step.Kind == TransformStep::ROTATE)
+	{
+		// Rotation axis followed by the angle in degrees.
+		char axis = args[0][1] == '\0' ? (char)tolower(args[0][0]) : '\0';
+		if (axis == 'x') step.Axis = Mesh::ROTATE_X;
+		else if (axis == 'y') step.Axis = Mesh::ROTATE_Y;
+		else if (axis == 'z') step.Axis = Mesh::ROTATE_Z;
+		else return -1;
+		first = 1;
+	}
+	for (int i = first; i < count; i++)
+	{
+		char *end;
+		step.Values[i - first] = (float)strtod(args[i], &end);
+		if (end == args[i] || *end != '\0') return -1;
+	}
+	return count;
+}
 
-	for (int i = 1; i < argCount; i++)
+// Read a transform spec file.  Each line holds one step in the same form as
+// on the command line, without the leading dash, e.g. "rotate y 90".  Lines
+// starting with '#' are comments.
+bool ReadTransformSpec(const char *fileName, std::vector<TransformStep> &steps)
+{
+	std::ifstream file(fileName);
+	if (!file.is_open()) return false;
+
+	std::string line;
+	for (int lineNum = 1; std::getline(file, line); lineNum++)
 	{
-		if (!inputNext && !outputNext)
+		// Split the line into words.
+		std::vector<char *> words;
+		char *context = &line[0];
+		for (char *c = context; *c; c++)
 		{
-			if (strcmp(argList[i], "-s") == 0) straightConvert = true;
-			else if (strcmp(argList[i], "-i") == 0) inputNext = true;
-			else if (strcmp(argList[i], "-o") == 0) outputNext = true;
-			else if (strcmp(argList[i], "-m") == 0) noMatNames = true;
-			else if (!inputFile) inputFile = argList[i];
-			else if (!outputFile) outputFile = argList[i];
+			if (*c == '#') { *c = '\0'; break; }
+			if (isspace((unsigned char)*c)) *c = '\0';
+			else if (c == context || c[-1] == '\0') words.push_back(c);
 		}
-		else
+		if (words.empty()) continue;
+
+		TransformStep step;
+		int count = ParseTransform(words[0], words.data() + 1, (int)words.size() - 1, step);
+		if (count < 0 || count != (int)words.size() - 1)
 		{
-			if (inputNext)
-			{
-				inputNext = false;
-				inputFile = argList[i];
-			}
-			else if (outputNext)
-			{
-				outputNext = false;
-				outputFile = argList[i];
-			}
+			std::cout << "Error:  Invalid transform in \"" << fileName << "\" line " << lineNum << "." << std::endl;
+			return false;
 		}
+		steps.push_back(step);
 	}
+	return true;
+}
 
-	if (!inputFile)
+// Apply the transform steps to all groups of the mesh in order.  The group
+// bounds are updated once at the end.
+void ApplyTransforms(Mesh &mesh, const std::vector<TransformStep> &steps)
+{
+	if (steps.empty()) return;
+	mesh.BeginUpdate();
+	for (size_t i = 0; i < steps.size(); i++)
 	{
-		std::cout << "Usage:" << std::endl;
-		std::cout << "\t-i:\tInput File" << std::endl;
-		std::cout << "\t-o:\tOutput File" << std::endl;
-		std::cout << "\t-m:\tDo Not Preserve Material Names" << std::endl;
-		std::cout << "\t-s:\tAll Vertex Elements in Single Array" << std::endl << std::endl;
-		return 0;
+		const TransformStep &step = steps[i];
+		const float *v = step.Values;
+		switch (step.Kind)
+		{
+		case TransformStep::SCALE: mesh.Scale(v[0], v[1], v[2]); break;
+		case TransformStep::TRANSLATE: mesh.Translate(v[0], v[1], v[2]); break;
+		case TransformStep::ROTATE: mesh.Rotate(step.Axis, v[0] * g_DEGTORAD); break;
+		case TransformStep::TEXSCALE: mesh.TexScale(v[0], v[1]); break;
+		case TransformStep::MATRIX:
+		{
+			D3DMATRIX mat;
+			memcpy(&mat, v, sizeof(D3DMATRIX));
+			mesh.Transform(mat);
+			break;
+		}
+		}
 	}
+	mesh.EndUpdate();
+}
 
-	bool outputAllocated = false;
-	if (!outputFile)
+// Vertex layout of a version 2 file: the attributes of each vertex stream,
+// rules for dropping attributes from some groups, and the number of
+// vertices per block if the streams are blocked.
+struct VertexLayout
+{
+	struct DropRule
 	{
-		outputAllocated = true;
+		uint32_t Attributes;
+		bool NoNormal;		// applies to groups whose normals were generated
+		unsigned UserFlags;	// applies to groups with any of these user flags
+	};
 
-		// Length of input file name.
-		int length = strlen(inputFile);
+	std::vector<uint32_t> Streams;
+	std::vector<DropRule> Drops;
+	uint32_t Block = 0;
 
-		// Index of decimal point.
-		int index = -1;
+	// Attributes of a group after applying the drop rules.
+	uint32_t GroupAttributes(const ExMeshGroup *group, uint32_t available) const
+	{
+		for (size_t i = 0; i < Drops.size(); i++)
+			if ((Drops[i].NoNormal && group->NoNormal) || (group->UserFlags & Drops[i].UserFlags))
+				available &= ~Drops[i].Attributes;
+		return available;
+	}
+};
 
-		// Search for extension.
-		for (int i = 0; i < length; i++)
+// Parse attribute letters (p = position, n = normal, u = uv, t = tangent).
+// Returns 0 if the string is empty or has an unknown letter.
+uint32_t ParseAttributes(const char *str)
+{
+	uint32_t attributes = 0;
+	for (; *str; str++)
+	{
+		if (*str == 'p') attributes |= CMSH2_ATTR_POSITION;
+		else if (*str == 'n') attributes |= CMSH2_ATTR_NORMAL;
+		else if (*str == 'u') attributes |= CMSH2_ATTR_UV;
+		else if (*str == 't') attributes |= CMSH2_ATTR_TANGENT;
+		else return 0;
+	}
+	return attributes;
+}
+
+// Add a stream to the layout.  Each attribute may appear in one stream only.
+bool AddStream(VertexLayout &layout, const char *str)
+{
+	uint32_t attributes = ParseAttributes(str), used = 0;
+	for (size_t i = 0; i < layout.Streams.size(); i++) used |= layout.Streams[i];
+	if (!attributes || (attributes & used) || layout.Streams.size() == CMSH2_MAX_STREAMS) return false;
+	layout.Streams.push_back(attributes);
+	return true;
+}
+
+// Parse a comma-separated stream list, e.g. "p,nu".
+bool ParseLayout(const char *str, VertexLayout &layout)
+{
+	std::string list(str);
+	size_t start = 0, end;
+	do
+	{
+		end = list.find(',', start);
+		if (!AddStream(layout, list.substr(start, end == std::string::npos ? end : end - start).c_str())) return false;
+		start = end + 1;
+	} while (end != std::string::npos);
+	return true;
+}
+
+// Parse a drop rule: the attributes to drop, followed by "nonormal" or a
+// hexadecimal user flag mask selecting the groups.
+bool ParseDropRule(const char *attributes, const char *selector, VertexLayout &layout)
+{
+	VertexLayout::DropRule rule;
+	rule.Attributes = ParseAttributes(attributes);
+	rule.NoNormal = strcmp(selector, "nonormal") == 0;
+	rule.UserFlags = rule.NoNormal ? 0 : (unsigned)strtoul(selector, nullptr, 16);
+	if (!rule.Attributes || (!rule.NoNormal && !rule.UserFlags)) return false;
+	layout.Drops.push_back(rule);
+	return true;
+}
+
+// Set the block size of the layout.  Must be a power of 2 from 2 to 64.
+bool SetBlock(const char *str, VertexLayout &layout)
+{
+	uint32_t block = (uint32_t)atoi(str);
+	if (block < 2 || block > 64 || (block & (block - 1))) return false;
+	layout.Block = block;
+	return true;
+}
+
+// Read a layout profile.  Each line is either "stream <attributes>",
+// "drop <attributes> <nonormal|hex flags>" or "block <n>".  Everything after
+// a # is a comment.
+bool ReadLayoutProfile(const char *fileName, VertexLayout &layout)
+{
+	std::ifstream file(fileName);
+	if (!file.is_open()) return false;
+
+	std::string line;
+	for (int lineNum = 1; std::getline(file, line); lineNum++)
+	{
+		// Split the line into words.
+		std::vector<char *> words;
+		char *context = &line[0];
+		for (char *c = context; *c; c++)
 		{
-			if (inputFile[i] == '.')
-			{
-				index = i;
-				break;
-			}
+			if (*c == '#') { *c = '\0'; break; }
+			if (isspace((unsigned char)*c)) *c = '\0';
+			else if (c == context || c[-1] == '\0') words.push_back(c);
 		}
+		if (words.empty()) continue;
 
-		// No extension found.
-		if (index == -1)
+		bool valid = false;
+		if (strcmp(words[0], "stream") == 0 && words.size() == 2) valid = AddStream(layout, words[1]);
+		else if (strcmp(words[0], "drop") == 0 && words.size() == 3) valid = ParseDropRule(words[1], words[2], layout);
+		else if (strcmp(words[0], "block") == 0 && words.size() == 2) valid = SetBlock(words[1], layout);
+		if (!valid)
 		{
-			// Set output file and designate extension.
-			int outLength = length + 6;
-			outputFile = new(std::nothrow) char[outLength];
-			if (!outputFile)
-			{
-				std::cout << "Error:  Could not generate output file." << std::endl;
-				return -1;
-			}
-			for (int i = 0; i < length; i++) outputFile[i] = inputFile[i];
+			std::cout << "Error:  Invalid layout in \"" << fileName << "\" line " << lineNum << "." << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
 
-			// Append mesh extension.
-			outputFile[length + 0] = '.';
-			outputFile[length + 1] = 'c';
-			outputFile[length + 2] = 'm';
-			outputFile[length + 3] = 's';
-			outputFile[length + 4] = 'h';
-			outputFile[length + 5] = '\0';
+// Write a name either as its offset into the string table, or inline as
+// length (including the terminator) followed by the characters.
+void WriteName(std::ostream &file, const StringPool &strings, unsigned name, bool stringTable)
+{
+	if (stringTable)
+	{
+		file.write((char *)&name, 4);
+		return;
+	}
+	const char *str = strings.Get(name);
+	int length = (int)strlen(str) + 1;
+	file.write((char *)&length, 4);
+	file.write(str, length);
+}
+
+// Build a name index section (see PerfectHash.h) mapping each distinct,
+// non-empty name of the list to the first index it appears at.
+bool BuildNameIndex(const StringPool &strings, const std::vector<unsigned> &names, std::vector<int> &section)
+{
+	std::vector<const char *> keys;
+	std::vector<int> entries;
+	std::vector<bool> seen(strings.Size(), false);
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (!names[i] || seen[names[i]]) continue;
+		seen[names[i]] = true;
+		keys.push_back(strings.Get(names[i]));
+		entries.push_back((int)names[i]);
+		entries.push_back((int)i);
+	}
+
+	int keyCount = (int)keys.size();
+	int bucketCount = (int)PerfectHashBuckets(keyCount);
+	std::vector<int> displace(bucketCount);
+	std::vector<unsigned> slot(keyCount);
+	if (!PerfectHashBuild(keys.data(), keyCount, displace.data(), slot.data())) return false;
+
+	section.assign(2 + bucketCount + 2 * keyCount, 0);
+	section[0] = keyCount;
+	section[1] = bucketCount;
+	for (int i = 0; i < bucketCount; i++) section[2 + i] = displace[i];
+	int *table = section.data() + 2 + bucketCount;
+	for (int i = 0; i < keyCount; i++)
+	{
+		table[2 * slot[i]] = entries[2 * i];
+		table[2 * slot[i] + 1] = entries[2 * i + 1];
+	}
+	return true;
+}
+
+// Write an array to the file, starting at the next multiple of alignment
+// and zero-padded to the following one.  Returns the offset of the array.
+uint64_t WriteAligned(std::ostream &file, const void *data, size_t size, uint32_t alignment)
+{
+	static const char zeros[256] = { 0 };
+	uint64_t offset = (uint64_t)file.tellp();
+	for (uint64_t pad = (alignment - offset % alignment) % alignment; pad; )
+	{
+		uint64_t count = pad < sizeof(zeros) ? pad : sizeof(zeros);
+		file.write(zeros, count);
+		pad -= count;
+	}
+	offset = (uint64_t)file.tellp();
+	if (size) file.write((const char *)data, size);
+	for (uint64_t pad = (alignment - size % alignment) % alignment; pad; )
+	{
+		uint64_t count = pad < sizeof(zeros) ? pad : sizeof(zeros);
+		file.write(zeros, count);
+		pad -= count;
+	}
+	return offset;
+}
+
+// Interleave the attributes ATTR of all vertices of a group.  ATTR is a
+// template parameter, so the attribute tests are resolved at compile time
+// and every layout gets its own loop without per-vertex branches.
+template <uint32_t ATTR>
+void PackVertices(const ExMeshGroup *group, float *out)
+{
+	for (int v = 0; v < group->VertexCount; v++)
+	{
+		if (ATTR & CMSH2_ATTR_POSITION)
+		{
+			out[0] = group->Positions[v].x; out[1] = group->Positions[v].y; out[2] = group->Positions[v].z;
+			out += 3;
 		}
-		// Extension found.
-		else
+		if (ATTR & CMSH2_ATTR_NORMAL)
 		{
-			// The length of the extension.
-			int extLength = length - index - 1;	// Extension length minus the decimal point.
-			int outLength = length - extLength + 4;	// Output length.
-			int lenNoExt = length - extLength + 1;	// Make sure to copy the decimal point.
+			out[0] = group->Normals[v].x; out[1] = group->Normals[v].y; out[2] = group->Normals[v].z;
+			out += 3;
+		}
+		if (ATTR & CMSH2_ATTR_UV)
+		{
+			out[0] = group->UVCoords[v].x; out[1] = group->UVCoords[v].y;
+			out += 2;
+		}
+		if (ATTR & CMSH2_ATTR_TANGENT)
+		{
+			out[0] = group->Tangents[v].x; out[1] = group->Tangents[v].y; out[2] = group->Tangents[v].z; out[3] = group->Tangents[v].w;
+			out += 4;
+		}
+	}
+}
 
-			int finalLength = outLength + 1;
-			outputFile = new(std::nothrow) char[finalLength];
-			if (!outputFile)
+typedef void (*VertexPacker)(const ExMeshGroup *group, float *out);
+
+// One packer for each combination of attributes.
+static const VertexPacker VertexPackers[16] =
+{
+	PackVertices<0>, PackVertices<1>, PackVertices<2>, PackVertices<3>,
+	PackVertices<4>, PackVertices<5>, PackVertices<6>, PackVertices<7>,
+	PackVertices<8>, PackVertices<9>, PackVertices<10>, PackVertices<11>,
+	PackVertices<12>, PackVertices<13>, PackVertices<14>, PackVertices<15>
+};
+
+// Rearrange interleaved vertices into blocks of block vertices, with all
+// values of one component consecutive in each block.
+void BlockVertices(std::vector<float> &data, int vertexCount, int components, uint32_t block)
+{
+	if (!block || !vertexCount) return;
+	std::vector<float> interleaved;
+	interleaved.swap(data);
+	int blocks = (vertexCount + block - 1) / block;
+	data.resize(blocks * block * components);
+	float *dst = data.data();
+	for (int b = 0; b < blocks; b++)
+	{
+		for (int c = 0; c < components; c++)
+		{
+			for (uint32_t l = 0; l < block; l++)
 			{
-				std::cout << "Error:  Could not generate output file." << std::endl;
-				return -1;
+				int v = b * block + l;
+				if (v >= vertexCount) v = vertexCount - 1; // pad with the last vertex
+				*dst++ = interleaved[v * components + c];
 			}
+		}
+	}
+}
 
-			// Copy input file name without extension, but including the decimal point.
-			for (int i = 0; i < lenNoExt; i++) outputFile[i] = inputFile[i];
+// Interleave the attributes of one vertex stream, blocked if block is not 0.
+void PackStream(const ExMeshGroup *group, uint32_t attributes, uint32_t block, std::vector<float> &out)
+{
+	int components = Cmsh2AttributeSize(attributes) / 4;
+	out.resize(group->VertexCount * components);
+	if (out.empty()) return;
+	VertexPackers[attributes & 15](group, out.data());
+	BlockVertices(out, group->VertexCount, components, block);
+}
 
-			// Copy the extension.
-			outputFile[outLength - 4] = 'c';
-			outputFile[outLength - 3] = 'm';
-			outputFile[outLength - 2] = 's';
-			outputFile[outLength - 1] = 'h';
-			outputFile[outLength - 0] = '\0';
-		}
+// Write the mesh in the version 2 format (see CmshFormat.h), with the
+// vertex streams given by layout.  Returns false if a name index could not
+// be built.
+bool WriteCmsh2(std::ostream &file, ExMesh &mesh, uint32_t alignment, const VertexLayout &layout,
+	bool nameIndex, const Mesh::GroupRemap *remap, int remapCount)
+{
+	std::vector<cmsh2_stream> streams;
+	uint32_t written = 0;
+	for (size_t i = 0; i < layout.Streams.size(); i++)
+	{
+		streams.push_back({ layout.Streams[i], Cmsh2AttributeSize(layout.Streams[i]) });
+		written |= layout.Streams[i];
 	}
 
-	// Read Mesh File
-	Mesh *iMesh = new(std::nothrow) Mesh();
-	if (!iMesh)
+	std::vector<int> labelIndex, materialIndex;
+	if (nameIndex)
 	{
-		std::cout << "Error:  Could not initialize mesh file for \"" << inputFile << "\"." << std::endl;
-		if (outputAllocated) delete[] outputFile;
-		return -2;
+		std::vector<unsigned> labels, materials;
+		for (int i = 0; i < mesh.GroupCount; i++) labels.push_back(mesh.GroupList[i]->Label);
+		for (int i = 0; i < mesh.MaterialCount; i++) materials.push_back(mesh.MaterialList[i]->Name);
+		if (!BuildNameIndex(mesh.Strings, labels, labelIndex) || !BuildNameIndex(mesh.Strings, materials, materialIndex))
+			return false;
 	}
 
-	std::ifstream iMeshFile(inputFile);
-	if (!iMeshFile.is_open())
+	cmsh2_header header;
+	ZeroMemory(&header, sizeof(cmsh2_header));
+	memcpy(header.Magic, CMSH2_MAGIC, 8);
+	header.HeaderSize = sizeof(cmsh2_header);
+	header.Alignment = alignment;
+	header.GroupCount = mesh.GroupCount;
+	header.MaterialCount = mesh.MaterialCount;
+	header.TextureCount = mesh.TextureCount;
+	header.StreamCount = (uint32_t)streams.size();
+	bool welded = mesh.GroupCount && mesh.GroupList[0]->WeldedPositions;
+	bool adjacency = mesh.GroupCount && mesh.GroupList[0]->Edges;
+	bool bvh = !mesh.BvhNodes.empty();
+	bool groupBvh = !mesh.GroupBvhNodes.empty();
+	header.SectionCount = 6 + (remap ? 1 : 0) + (nameIndex ? 2 : 0) + (welded ? 1 : 0) + (adjacency ? 1 : 0) + (bvh ? 1 : 0) +
+		(groupBvh ? 1 : 0);
+	header.VertexBlock = layout.Block;
+
+	// Header and section directory are written last, once all offsets are known.
+	std::vector<cmsh2_section> sections(header.SectionCount);
+	ZeroMemory(sections.data(), sections.size() * sizeof(cmsh2_section));
+	file.write((char *)&header, sizeof(cmsh2_header));
+	file.write((char *)sections.data(), sections.size() * sizeof(cmsh2_section));
+	int s = 0;
+
+	sections[s].Type = CMSH2_SECTION_STRINGS;
+	sections[s].Size = mesh.Strings.Size();
+	sections[s++].Offset = WriteAligned(file, mesh.Strings.Data(), mesh.Strings.Size(), alignment);
+
+	sections[s].Type = CMSH2_SECTION_STREAMS;
+	sections[s].Size = streams.size() * sizeof(cmsh2_stream);
+	sections[s++].Offset = WriteAligned(file, streams.data(), streams.size() * sizeof(cmsh2_stream), alignment);
+
+	// Vertex streams and indices, group by group.
+	std::vector<cmsh2_group> groups(mesh.GroupCount);
+	ZeroMemory(groups.data(), groups.size() * sizeof(cmsh2_group));
+	std::vector<cmsh2_welded_group> weldedGroups(welded ? mesh.GroupCount : 0);
+	std::vector<cmsh2_adjacency_group> adjacencyGroups(adjacency ? mesh.GroupCount : 0);
+	std::vector<float> packed;
+	uint64_t geometryStart = 0, geometryEnd = 0;
+	for (int i = 0; i < mesh.GroupCount; i++)
 	{
-		std::cout << "Error:  Could not open \"" << inputFile << "\"." << std::endl;
-		if (outputAllocated) delete[] outputFile;
-		delete iMesh;
-		return -3;
+		ExMeshGroup *current = mesh.GroupList[i];
+		cmsh2_group &g = groups[i];
+		g.NameOffset = current->Label;
+		g.MaterialIndex = current->MaterialIndex;
+		g.TextureIndex = current->TextureIndex;
+		g.Flags = current->Flags;
+		g.UserFlags = current->UserFlags;
+		g.ZBias = current->ZBias;
+		g.VertexCount = current->VertexCount;
+		g.IndexCount = current->IndexCount;
+		g.Attributes = layout.GroupAttributes(current, written & (CMSH2_ATTR_POSITION | CMSH2_ATTR_NORMAL | CMSH2_ATTR_UV |
+			(current->Tangents ? CMSH2_ATTR_TANGENT : 0)));
+		for (size_t j = 0; j < streams.size(); j++)
+		{
+			uint32_t attributes = streams[j].Attributes & g.Attributes;
+			if (!attributes) continue;
+			PackStream(current, attributes, layout.Block, packed);
+			g.StreamOffset[j] = WriteAligned(file, packed.data(), packed.size() * sizeof(float), alignment);
+			if (!geometryStart) geometryStart = g.StreamOffset[j];
+		}
+		g.IndexOffset = WriteAligned(file, current->Indices, current->IndexCount * sizeof(uint32_t), alignment);
+		if (!geometryStart) geometryStart = g.IndexOffset;
+		geometryEnd = g.IndexOffset + current->IndexCount * sizeof(uint32_t);
+
+		if (welded)
+		{
+			cmsh2_welded_group &w = weldedGroups[i];
+			w.VertexCount = current->WeldedVertexCount;
+			w.IndexCount = current->WeldedIndexCount;
+			float *positions = &current->WeldedPositions[0].x;
+			packed.assign(positions, positions + 3 * w.VertexCount);
+			BlockVertices(packed, w.VertexCount, 3, layout.Block);
+			w.PositionOffset = WriteAligned(file, packed.data(), packed.size() * sizeof(float), alignment);
+			w.IndexOffset = WriteAligned(file, current->WeldedIndices, w.IndexCount * sizeof(uint32_t), alignment);
+			geometryEnd = w.IndexOffset + w.IndexCount * sizeof(uint32_t);
+		}
+
+		if (adjacency)
+		{
+			cmsh2_adjacency_group &a = adjacencyGroups[i];
+			a.EdgeCount = current->EdgeCount;
+			a.OpenCount = current->OpenEdgeCount;
+			a.NonManifoldCount = current->NonManifoldEdgeCount;
+			a.TriangleCount = current->WeldedIndexCount / 3;
+			a.EdgeOffset = WriteAligned(file, current->Edges, a.EdgeCount * sizeof(cmsh2_edge), alignment);
+			a.NormalOffset = WriteAligned(file, current->FaceNormals, a.TriangleCount * sizeof(vtx3), alignment);
+			geometryEnd = a.NormalOffset + a.TriangleCount * sizeof(vtx3);
+		}
 	}
+	cmsh2_bvh bvhHeader = { (uint32_t)mesh.BvhNodes.size(), (uint32_t)mesh.BvhTriangles.size(), 0, 0 };
+	if (bvh)
+	{
+		bvhHeader.NodeOffset = WriteAligned(file, mesh.BvhNodes.data(), bvhHeader.NodeCount * sizeof(cmsh2_bvh_node), alignment);
+		bvhHeader.TriangleOffset = WriteAligned(file, mesh.BvhTriangles.data(), bvhHeader.TriangleCount * sizeof(cmsh2_bvh_triangle), alignment);
+		geometryEnd = bvhHeader.TriangleOffset + bvhHeader.TriangleCount * sizeof(cmsh2_bvh_triangle);
+	}
+	cmsh2_group_bvh groupBvhHeader = { (uint32_t)mesh.GroupBvhNodes.size(), (uint32_t)mesh.GroupBounds.size(), 0, 0 };
+	if (groupBvh)
+	{
+		groupBvhHeader.NodeOffset = WriteAligned(file, mesh.GroupBvhNodes.data(), groupBvhHeader.NodeCount * sizeof(cmsh2_bvh_node), alignment);
+		groupBvhHeader.BoundOffset = WriteAligned(file, mesh.GroupBounds.data(), groupBvhHeader.GroupCount * sizeof(cmsh2_group_bound), alignment);
+		geometryEnd = groupBvhHeader.BoundOffset + groupBvhHeader.GroupCount * sizeof(cmsh2_group_bound);
+	}
+	sections[s].Type = CMSH2_SECTION_GEOMETRY;
+	sections[s].Offset = geometryStart;
+	sections[s++].Size = geometryEnd - geometryStart;
 
-	iMeshFile >> *iMesh;
-	iMeshFile.close();
+	sections[s].Type = CMSH2_SECTION_GROUPS;
+	sections[s].Size = groups.size() * sizeof(cmsh2_group);
+	sections[s++].Offset = WriteAligned(file, groups.data(), groups.size() * sizeof(cmsh2_group), alignment);
 
-	// Convert Mesh File.
-	ExMesh *oMesh = new(std::nothrow) ExMesh(iMesh);
-	if (!oMesh)
+	std::vector<cmsh2_material> materials(mesh.MaterialCount);
+	for (int i = 0; i < mesh.MaterialCount; i++)
 	{
-		std::cout << "Error:  Could not convert \"" << inputFile << "\" data." << std::endl;
-		if (outputAllocated) delete[] outputFile;
-		delete iMesh;
-		return -4;
+		ExMaterial *current = mesh.MaterialList[i];
+		cmsh2_material &m = materials[i];
+		m.NameOffset = current->Name;
+		memcpy(m.Diffuse, current->Diffuse, sizeof(m.Diffuse));
+		memcpy(m.Ambient, current->Ambient, sizeof(m.Ambient));
+		memcpy(m.Specular, current->Specular, sizeof(m.Specular));
+		memcpy(m.Emissive, current->Emissive, sizeof(m.Emissive));
+		m.Power = current->Power;
 	}
+	sections[s].Type = CMSH2_SECTION_MATERIALS;
+	sections[s].Size = materials.size() * sizeof(cmsh2_material);
+	sections[s++].Offset = WriteAligned(file, materials.data(), materials.size() * sizeof(cmsh2_material), alignment);
 
-	// Delete Mesh File
-	delete iMesh;
+	std::vector<uint32_t> textures(mesh.TextureCount);
+	for (int i = 0; i < mesh.TextureCount; i++) textures[i] = mesh.TextureList[i]->Name;
+	sections[s].Type = CMSH2_SECTION_TEXTURES;
+	sections[s].Size = textures.size() * sizeof(uint32_t);
+	sections[s++].Offset = WriteAligned(file, textures.data(), textures.size() * sizeof(uint32_t), alignment);
 
-	if (!oMesh->Validate())
+	if (remap)
 	{
-		std::cout << "Converted mesh failed validation." << std::endl;
-		delete oMesh;
-		return -10;
+		std::vector<cmsh2_group_remap> entries(remapCount);
+		for (int i = 0; i < remapCount; i++)
+			entries[i] = { (uint32_t)remap[i].Grp, (uint32_t)remap[i].VtxOfs, (uint32_t)remap[i].nVtx,
+				(uint32_t)remap[i].IdxOfs, (uint32_t)remap[i].nIdx };
+		sections[s].Type = CMSH2_SECTION_GROUP_REMAP;
+		sections[s].Size = entries.size() * sizeof(cmsh2_group_remap);
+		sections[s++].Offset = WriteAligned(file, entries.data(), entries.size() * sizeof(cmsh2_group_remap), alignment);
 	}
 
-	if (!oMesh->GroupList)
+	if (welded)
 	{
-		std::cout << "Error:  Could not convert \"" << inputFile << "\" data." << std::endl;
-		if (outputAllocated) delete[] outputFile;
-		return -4;
+		sections[s].Type = CMSH2_SECTION_WELDED;
+		sections[s].Size = weldedGroups.size() * sizeof(cmsh2_welded_group);
+		sections[s++].Offset = WriteAligned(file, weldedGroups.data(), weldedGroups.size() * sizeof(cmsh2_welded_group), alignment);
 	}
 
-	cmsh_header header;
-	ZeroMemory(&header, sizeof(cmsh_header));
-	header.Header[0] = '_';
-	header.Header[1] = 'C';
-	header.Header[2] = 'M';
-	header.Header[3] = 'S';
-	header.Header[4] = 'H';
-	header.Header[5] = 'X';
-	header.Header[6] = '1';
-	header.Header[7] = '_';
-	header.GroupCount = oMesh->GroupCount;
-	header.MaterialCount = oMesh->MaterialCount;
-	header.TextureCount = oMesh->TextureCount;
-	header.VertexComponents = straightConvert ? 0 : 1;
-	header.MaterialNames = noMatNames ? 0 : 1;
+	if (adjacency)
+	{
+		sections[s].Type = CMSH2_SECTION_ADJACENCY;
+		sections[s].Size = adjacencyGroups.size() * sizeof(cmsh2_adjacency_group);
+		sections[s++].Offset = WriteAligned(file, adjacencyGroups.data(), adjacencyGroups.size() * sizeof(cmsh2_adjacency_group), alignment);
+	}
 
-	std::cout << "Group Count:\t" << header.GroupCount << std::endl;
-	std::cout << "Material Count:\t" << header.MaterialCount << std::endl;
-	std::cout << "Texture Count:\t" << header.TextureCount << std::endl << std::endl;
+	if (bvh)
+	{
+		sections[s].Type = CMSH2_SECTION_BVH;
+		sections[s].Size = sizeof(cmsh2_bvh);
+		sections[s++].Offset = WriteAligned(file, &bvhHeader, sizeof(cmsh2_bvh), alignment);
+	}
 
+	if (groupBvh)
+	{
+		sections[s].Type = CMSH2_SECTION_GROUP_BVH;
+		sections[s].Size = sizeof(cmsh2_group_bvh);
+		sections[s++].Offset = WriteAligned(file, &groupBvhHeader, sizeof(cmsh2_group_bvh), alignment);
+	}
 
-	std::ofstream oMeshFile(outputFile, std::ios::binary);
-	if (!oMeshFile.is_open())
+	if (nameIndex)
 	{
-		std::cout << "Error:  Could not create \"" << outputFile << "\"." << std::endl;
-		if (outputAllocated) delete[] outputFile;
-		delete oMesh;
-		return -5;
+		sections[s].Type = CMSH2_SECTION_LABEL_INDEX;
+		sections[s].Size = labelIndex.size() * sizeof(int);
+		sections[s++].Offset = WriteAligned(file, labelIndex.data(), labelIndex.size() * sizeof(int), alignment);
+		sections[s].Type = CMSH2_SECTION_MATERIAL_INDEX;
+		sections[s].Size = materialIndex.size() * sizeof(int);
+		sections[s++].Offset = WriteAligned(file, materialIndex.data(), materialIndex.size() * sizeof(int), alignment);
 	}
 
-	oMeshFile.write((char *)&header, sizeof(cmsh_header));
+	header.FileSize = (uint64_t)file.tellp();
+	file.seekp(0);
+	file.write((char *)&header, sizeof(cmsh2_header));
+	file.write((char *)sections.data(), sections.size() * sizeof(cmsh2_section));
+	file.seekp(0, std::ios::end);
+	return true;
+}
+
+// Write the mesh in the version 1 format described by header.  Returns
+// false if a name index could not be built.
+bool WriteCmsh1(std::ostream &file, ExMesh &mesh, const cmsh_header &header, const Mesh::GroupRemap *remap, int remapCount)
+{
+	file.write((char *)&header, sizeof(cmsh_header));
+
+	// Write string table.
+	if (header.StringTable)
+	{
+		int size = (int)mesh.Strings.Size();
+		file.write((char *)&size, 4);
+		file.write(mesh.Strings.Data(), size);
+	}
 
 	// Write mesh group data.
-	if (oMesh->GroupList)
+	if (mesh.GroupList)
 	{
-		for (int i = 0; i < oMesh->GroupCount; i++)
+		for (int i = 0; i < mesh.GroupCount; i++)
 		{
 			// The current mesh group.
-			ExMeshGroup *current = oMesh->GroupList[i];
-
-			std::cout << "Mesh Group: " << current->Label << std::endl;
-			std::cout << "\tMat Index:\t" << current->MaterialIndex << std::endl;
-			std::cout << "\tTexture Index:\t" << current->TextureIndex << std::endl;
-			std::cout << "\tVertex Count:\t" << current->VertexCount << std::endl;
-			std::cout << "\tIndex Count:\t" << current->IndexCount << std::endl << std::endl;
+			ExMeshGroup *current = mesh.GroupList[i];
 
 			// Write group header.
-			int length = strlen(current->Label) + 1;
-			oMeshFile.write((char *)&length, 4);
-			if (length) oMeshFile.write(current->Label, length);
-			oMeshFile.write((char *)&current->MaterialIndex, 4);
-			oMeshFile.write((char *)&current->TextureIndex, 4);
-			oMeshFile.write((char *)&current->Flags, 4);
-			oMeshFile.write((char *)&current->UserFlags, 4);
-			oMeshFile.write((char *)&current->ZBias, 4);
-			oMeshFile.write((char *)&current->VertexCount, 4);
-			oMeshFile.write((char *)&current->IndexCount, 4);
+			WriteName(file, mesh.Strings, current->Label, header.StringTable);
+			file.write((char *)&current->MaterialIndex, 4);
+			file.write((char *)&current->TextureIndex, 4);
+			file.write((char *)&current->Flags, 4);
+			file.write((char *)&current->UserFlags, 4);
+			file.write((char *)&current->ZBias, 4);
+			file.write((char *)&current->VertexCount, 4);
+			file.write((char *)&current->IndexCount, 4);
 
 			// Write vertex data (all components in one array).
-			if (straightConvert)
+			if (!header.VertexComponents)
 			{
 				for (int v = 0; v < current->VertexCount; v++)
 				{
-					oMeshFile.write((char *)&current->Positions[v], 12);
-					oMeshFile.write((char *)&current->Normals[v], 12);
-					oMeshFile.write((char *)&current->UVCoords[v], 8);
+					file.write((char *)&current->Positions[v], 12);
+					file.write((char *)&current->Normals[v], 12);
+					file.write((char *)&current->UVCoords[v], 8);
 				}
 			}
 			// Write vertex data (each component in separate array).
@@ -527,56 +1625,2212 @@ int main(int argCount, char **argList)
 			{
 				int posBytes = 12 * current->VertexCount;
 				int texBytes = 8 * current->VertexCount;
-				oMeshFile.write((char *)current->Positions, posBytes);
-				oMeshFile.write((char *)current->Normals, posBytes);
-				oMeshFile.write((char *)current->UVCoords, texBytes);
+				file.write((char *)current->Positions, posBytes);
+				file.write((char *)current->Normals, posBytes);
+				file.write((char *)current->UVCoords, texBytes);
+			}
+
+			// Write tangent data.
+			if (header.Tangents)
+			{
+				int tanBytes = 16 * current->VertexCount;
+				file.write((char *)current->Tangents, tanBytes);
 			}
 
 			// Write index data.
 			int iBytes = 4 * current->IndexCount;
-			oMeshFile.write((char *)current->Indices, iBytes);
+			file.write((char *)current->Indices, iBytes);
 		}
 	}
 
 	// Write material data.
-	if (oMesh->MaterialList)
+	if (mesh.MaterialList)
 	{
-		for (int i = 0; i < oMesh->MaterialCount; i++)
+		for (int i = 0; i < mesh.MaterialCount; i++)
 		{
-			ExMaterial *current = oMesh->MaterialList[i];
+			ExMaterial *current = mesh.MaterialList[i];
 
 			// Preserve material names.
 			if (header.MaterialNames)
-			{
-				int length = strlen(current->Name) + 1;
-				oMeshFile.write((char *)&length, 4);
-				oMeshFile.write((char *)current->Name, length);
-			}
+				WriteName(file, mesh.Strings, current->Name, header.StringTable);
 
 			// Write the rest of the file.
-			oMeshFile.write((char *)current->Diffuse, 16);
-			oMeshFile.write((char *)current->Ambient, 12);
-			oMeshFile.write((char *)current->Specular, 12);
-			oMeshFile.write((char *)current->Emissive, 12);
-			oMeshFile.write((char *)&current->Power, 4);
+			file.write((char *)current->Diffuse, 16);
+			file.write((char *)current->Ambient, 12);
+			file.write((char *)current->Specular, 12);
+			file.write((char *)current->Emissive, 12);
+			file.write((char *)&current->Power, 4);
 		}
 	}
 
 	// Write texture data.
-	if (oMesh->TextureList)
+	if (mesh.TextureList)
 	{
-		for (int i = 0; i < oMesh->TextureCount; i++)
+		for (int i = 0; i < mesh.TextureCount; i++)
 		{
-			ExTexture *current = oMesh->TextureList[i];
-			int length = strlen(current->Name) + 1;
-			oMeshFile.write((char *)&length, 4);
-			oMeshFile.write(current->Name, length);
+			ExTexture *current = mesh.TextureList[i];
+			WriteName(file, mesh.Strings, current->Name, header.StringTable);
 		}
 	}
 
-	oMeshFile.close();
-	delete oMesh;
-	if (outputAllocated) delete[] outputFile;
+	// Write group remap table.
+	if (header.GroupRemap)
+	{
+		file.write((char *)&remapCount, 4);
+		for (int i = 0; i < remapCount; i++)
+		{
+			cmsh_group_remap entry;
+			entry.Group = (int)remap[i].Grp;
+			entry.VertexOffset = (int)remap[i].VtxOfs;
+			entry.VertexCount = (int)remap[i].nVtx;
+			entry.IndexOffset = (int)remap[i].IdxOfs;
+			entry.IndexCount = (int)remap[i].nIdx;
+			file.write((char *)&entry, sizeof(cmsh_group_remap));
+		}
+	}
 
-	return 0;
+	// Write group label and material name indices.
+	if (header.NameIndex)
+	{
+		std::vector<unsigned> labels, materials;
+		for (int i = 0; i < mesh.GroupCount; i++) labels.push_back(mesh.GroupList[i]->Label);
+		for (int i = 0; i < mesh.MaterialCount; i++) materials.push_back(mesh.MaterialList[i]->Name);
+		std::vector<int> labelIndex, materialIndex;
+		if (!BuildNameIndex(mesh.Strings, labels, labelIndex) || !BuildNameIndex(mesh.Strings, materials, materialIndex))
+			return false;
+		file.write((char *)labelIndex.data(), labelIndex.size() * sizeof(int));
+		file.write((char *)materialIndex.data(), materialIndex.size() * sizeof(int));
+	}
+
+	return true;
+}
+
+// Time ray and sphere queries against the triangle BVH of the mesh and
+// against a brute force loop over all triangles, and check that both
+// agree.  Queries are generated from a fixed seed, so runs are comparable.
+// The results are printed to log.
+void BenchmarkBvh(const ExMesh &mesh, int queryCount, std::ostream &log)
+{
+	const cmsh2_bvh_node *nodes = mesh.BvhNodes.data();
+	const cmsh2_bvh_triangle *tris = mesh.BvhTriangles.data();
+	uint32_t triCount = (uint32_t)mesh.BvhTriangles.size();
+	if (!triCount || queryCount <= 0) return;
+
+	const float *lo = nodes[0].Min, *hi = nodes[0].Max;
+	float centre[3], size[3], radius = 0.0f;
+	for (int k = 0; k < 3; k++)
+	{
+		centre[k] = 0.5f * (lo[k] + hi[k]);
+		size[k] = hi[k] - lo[k];
+		radius += size[k] * size[k];
+	}
+	radius = 0.5f * sqrtf(radius);
+
+	// Rays start on a sphere around the mesh and aim at a point inside its
+	// bounds, which is also the centre of the sphere query.
+	std::vector<float> queries(6 * queryCount), targets(3 * queryCount);
+	uint32_t seed = 12345;
+	for (int i = 0; i < queryCount; i++)
+	{
+		float *q = &queries[6 * i];
+		float d[3], len = 0.0f;
+		for (int k = 0; k < 3; k++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			d[k] = (float)(seed >> 8) / 8388608.0f - 1.0f;
+			len += d[k] * d[k];
+		}
+		len = len > 0.0f ? 2.0f * radius / sqrtf(len) : 0.0f;
+		for (int k = 0; k < 3; k++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			float target = lo[k] + size[k] * (float)(seed >> 8) / 16777216.0f;
+			q[k] = centre[k] + d[k] * len;
+			q[3 + k] = target - q[k];
+			targets[3 * i + k] = target;
+		}
+	}
+	float sphereRadius = 0.05f * radius;
+
+	typedef std::chrono::high_resolution_clock Clock;
+	int rayHits = 0, rayMismatch = 0, sphereHits = 0, sphereMismatch = 0;
+	std::vector<float> distance(queryCount);
+	std::vector<uint32_t> count(queryCount);
+
+	Clock::time_point t0 = Clock::now();
+	for (int i = 0; i < queryCount; i++)
+	{
+		cmsh2_ray_hit hit;
+		distance[i] = Cmsh2RayQuery(nodes, tris, &queries[6 * i], &queries[6 * i + 3], 1.0f, hit) ? hit.Distance : 1.0f;
+	}
+	Clock::time_point t1 = Clock::now();
+	for (int i = 0; i < queryCount; i++)
+	{
+		float u, v, d = 1.0f;
+		for (uint32_t j = 0; j < triCount; j++)
+			d = Cmsh2RayTriangle(tris[j], &queries[6 * i], &queries[6 * i + 3], d, u, v);
+		if (d < 1.0f) rayHits++;
+		if (d != distance[i]) rayMismatch++;
+	}
+	Clock::time_point t2 = Clock::now();
+	for (int i = 0; i < queryCount; i++)
+		count[i] = Cmsh2SphereQuery(nodes, tris, &targets[3 * i], sphereRadius, nullptr, 0);
+	Clock::time_point t3 = Clock::now();
+	float r2 = sphereRadius * sphereRadius;
+	for (int i = 0; i < queryCount; i++)
+	{
+		uint32_t n = 0;
+		for (uint32_t j = 0; j < triCount; j++)
+			if (Cmsh2PointTriangleDist2(tris[j], &targets[3 * i]) <= r2) n++;
+		sphereHits += n;
+		if (n != count[i]) sphereMismatch++;
+	}
+	Clock::time_point t4 = Clock::now();
+
+	double bvhRay = std::chrono::duration<double>(t1 - t0).count();
+	double bruteRay = std::chrono::duration<double>(t2 - t1).count();
+	double bvhSphere = std::chrono::duration<double>(t3 - t2).count();
+	double bruteSphere = std::chrono::duration<double>(t4 - t3).count();
+	log << "BVH Benchmark:\t" << mesh.BvhNodes.size() << " nodes, " << triCount << " triangles, " << queryCount << " queries" << std::endl;
+	log << "\tRays/s:\t" << queryCount / bvhRay << " BVH, " << queryCount / bruteRay << " brute force (x"
+		<< bruteRay / bvhRay << "), " << rayHits << " hits, " << rayMismatch << " mismatches" << std::endl;
+	log << "\tSpheres/s:\t" << queryCount / bvhSphere << " BVH, " << queryCount / bruteSphere << " brute force (x"
+		<< bruteSphere / bvhSphere << "), " << sphereHits << " hits, " << sphereMismatch << " mismatches" << std::endl << std::endl;
+}
+
+// Estimate how many bound tests the group BVH saves over testing every
+// group, by culling with 90 degree view frustums along a fixed set of
+// directions spread evenly over the sphere.  Views are taken from the
+// centre of the mesh, as for interior or close-up views, and from outside
+// its bounding sphere.  The results are printed to log.
+void ReportGroupCulling(const ExMesh &mesh, std::ostream &log)
+{
+	const int VIEWS = 64;
+	const cmsh2_bvh_node *nodes = mesh.GroupBvhNodes.data();
+	uint32_t groupCount = (uint32_t)mesh.GroupBounds.size();
+	if (!groupCount) return;
+
+	float centre[3], radius = 0.0f;
+	for (int k = 0; k < 3; k++)
+	{
+		centre[k] = 0.5f * (nodes[0].Min[k] + nodes[0].Max[k]);
+		radius += (nodes[0].Max[k] - centre[k]) * (nodes[0].Max[k] - centre[k]);
+	}
+	radius = sqrtf(radius);
+
+	log << "Group BVH:\t" << mesh.GroupBvhNodes.size() << " nodes, " << groupCount << " groups" << std::endl;
+	std::vector<uint32_t> visible(groupCount);
+	for (int pass = 0; pass < 2; pass++)
+	{
+		double tests = 0.0, shown = 0.0;
+		for (int i = 0; i < VIEWS; i++)
+		{
+			// Fibonacci sphere direction and an orthonormal frame around it
+			float z = 1.0f - (2.0f * i + 1.0f) / VIEWS, r = sqrtf(1.0f - z * z);
+			float phi = 2.39996323f * i;
+			float f[3] = { r * cosf(phi), r * sinf(phi), z };
+			float a[3] = { fabsf(f[0]) < 0.9f ? 1.0f : 0.0f, fabsf(f[0]) < 0.9f ? 0.0f : 1.0f, 0.0f };
+			float u[3] = { f[1] * a[2] - f[2] * a[1], f[2] * a[0] - f[0] * a[2], f[0] * a[1] - f[1] * a[0] };
+			float ul = sqrtf(u[0] * u[0] + u[1] * u[1] + u[2] * u[2]);
+			for (int k = 0; k < 3; k++) u[k] /= ul;
+			float v[3] = { f[1] * u[2] - f[2] * u[1], f[2] * u[0] - f[0] * u[2], f[0] * u[1] - f[1] * u[0] };
+
+			float eye[3];
+			for (int k = 0; k < 3; k++) eye[k] = centre[k] - (pass ? 2.0f * radius : 0.0f) * f[k];
+			float plane[5][4];
+			for (int k = 0; k < 3; k++)
+			{
+				plane[0][k] = f[k];
+				plane[1][k] = (f[k] + u[k]) * 0.70710678f;
+				plane[2][k] = (f[k] - u[k]) * 0.70710678f;
+				plane[3][k] = (f[k] + v[k]) * 0.70710678f;
+				plane[4][k] = (f[k] - v[k]) * 0.70710678f;
+			}
+			for (int j = 0; j < 5; j++)
+				plane[j][3] = -(plane[j][0] * eye[0] + plane[j][1] * eye[1] + plane[j][2] * eye[2]);
+
+			uint32_t count;
+			shown += Cmsh2CullGroups(nodes, mesh.GroupBounds.data(), plane, 5, visible.data(), count);
+			tests += count;
+		}
+		log << (pass ? "\tOutside Views:\t" : "\tInside Views:\t") << shown / VIEWS << " groups visible, "
+			<< tests / VIEWS << " tests instead of " << groupCount << " (" << 100.0 * tests / VIEWS / groupCount
+			<< "%)" << std::endl;
+	}
+	log << std::endl;
+}
+
+// Parameters of a sphere patch set, as for CreateSpherePatch, and the
+// trigonometric tables shared by all tiles.  Every tile ilng of band ilat
+// covers the same latitudes as patch ilat of CreateSpherePatch, rotated by
+// ilng/nlng of a full turn; tile ilng = 0 matches it bit for bit.
+struct PatchSet
+{
+	int LngCount;
+	int LatCount;
+	int Res;
+	int BandSegments;	// bseg, < 0 for the CreateSpherePatch default
+	bool Reduce;
+	bool Outside;
+
+	std::vector<std::vector<double> > LatSin, LatCos;	// [ilat][row]
+	std::map<int, std::vector<double> > LngSin, LngCos;	// [nseg][ilng * (nseg + 1) + j]
+
+	int Segments(int ilat) const
+	{
+		return BandSegments < 0 || ilat == LatCount - 1 ? (LatCount - ilat) * Res : BandSegments;
+	}
+
+	// Evaluate sin and cos once for every latitude row and every longitude
+	// a row of any tile uses, with the expressions of CreateSpherePatch.
+	void BuildTables()
+	{
+		LatSin.assign(LatCount, std::vector<double>(Res + 1));
+		LatCos.assign(LatCount, std::vector<double>(Res + 1));
+		for (int ilat = 0; ilat < LatCount; ilat++)
+		{
+			double minlat = Pi05 * (double)ilat / (double)LatCount;
+			double maxlat = Pi05 * (double)(ilat + 1) / (double)LatCount;
+			for (int i = 0; i <= Res; i++)
+			{
+				double lat = minlat + (maxlat - minlat) * (double)i / (double)Res;
+				LatSin[ilat][i] = sin(lat);
+				LatCos[ilat][i] = cos(lat);
+			}
+			int bseg = Segments(ilat);
+			for (int i = 0; i <= Res; i++)
+			{
+				int nseg = Reduce ? bseg - i : bseg;
+				if (LngSin.count(nseg)) continue;
+				std::vector<double> &ls = LngSin[nseg], &lc = LngCos[nseg];
+				ls.resize(LngCount * (nseg + 1));
+				lc.resize(LngCount * (nseg + 1));
+				for (int ilng = 0; ilng < LngCount; ilng++)
+				{
+					double minlng = Pi2 * (double)ilng / (double)LngCount;
+					double maxlng = Pi2 * (double)(ilng + 1) / (double)LngCount;
+					for (int j = 0; j <= nseg; j++)
+					{
+						double lng = nseg ? minlng + (maxlng - minlng) * (double)j / (double)nseg : minlng;
+						ls[ilng * (nseg + 1) + j] = sin(lng);
+						lc[ilng * (nseg + 1) + j] = cos(lng);
+					}
+				}
+			}
+		}
+	}
+
+	// Build tile (ilat, ilng) as a single-group mesh, with its arrays
+	// allocated from pool (nullptr for the heap).  Returns nullptr if out
+	// of memory.
+	ExMesh *CreateTile(int ilat, int ilng, Arena *pool = nullptr) const
+	{
+		const float c1 = 1.0f, c2 = 0.0f;	// as in CreateSpherePatch
+		int bseg = Segments(ilat);
+		int vertexCount = (bseg + 1) * (Res + 1);
+		if (Reduce) vertexCount -= ((Res + 1) * Res) / 2;
+		int indexCount = (Reduce ? Res * (2 * bseg - Res) : 2 * Res * bseg) * 3;
+
+		ExMesh *mesh = new(std::nothrow) ExMesh(nullptr, true, pool);
+		if (!mesh) return nullptr;
+		mesh->GroupList = ArenaNewArray<ExMeshGroup *>(pool, 1);
+		if (!mesh->GroupList) { delete mesh; return nullptr; }
+		ExMeshGroup *group = mesh->GroupList[0] = ArenaNew<ExMeshGroup>(pool, nullptr, 0u, pool);
+		if (!group) { ArenaDeleteArray(pool, mesh->GroupList); mesh->GroupList = nullptr; delete mesh; return nullptr; }
+		mesh->GroupCount = 1;
+		group->MaterialIndex = (int)SPEC_INHERIT;
+		group->TextureIndex = (int)SPEC_INHERIT;
+		group->VertexCount = vertexCount;
+		group->IndexCount = indexCount;
+		group->Positions = ArenaNewArray<vtx3>(pool, vertexCount);
+		group->Normals = ArenaNewArray<vtx3>(pool, vertexCount);
+		group->UVCoords = ArenaNewArray<vtx2>(pool, vertexCount);
+		group->Indices = ArenaNewArray<int>(pool, indexCount);
+		if (!group->Validate()) { delete mesh; return nullptr; }
+
+		float sign = Outside ? 1.0f : -1.0f;
+		for (int i = 0, n = 0; i <= Res; i++)
+		{
+			double slat = LatSin[ilat][i], clat = LatCos[ilat][i];
+			int nseg = Reduce ? bseg - i : bseg;
+			const double *slng = &LngSin.find(nseg)->second[ilng * (nseg + 1)];
+			const double *clng = &LngCos.find(nseg)->second[ilng * (nseg + 1)];
+			for (int j = 0; j <= nseg; j++, n++)
+			{
+				vtx3 &p = group->Positions[n];
+				p.x = (float)(clat * clng[j]);
+				p.y = (float)slat;
+				p.z = (float)(clat * slng[j]);
+				group->Normals[n].x = sign * p.x;
+				group->Normals[n].y = sign * p.y;
+				group->Normals[n].z = sign * p.z;
+				group->UVCoords[n].x = (float)(nseg ? (c1 * j) / nseg + c2 : 0.5);
+				group->UVCoords[n].y = (float)((c1 * (Res - i)) / Res + c2);
+			}
+		}
+
+		// Faces, with the second and third corner swapped for inside patches.
+		int *idx = group->Indices, b = Outside ? 1 : 2, c = Outside ? 2 : 1;
+		for (int i = 0, n = 0, nofs0 = 0; i < Res; i++)
+		{
+			int nseg = Reduce ? bseg - i : bseg;
+			int nofs1 = nofs0 + nseg + 1;
+			for (int j = 0; j < nseg; j++)
+			{
+				idx[n] = nofs0 + j;
+				idx[n + b] = nofs1 + j;
+				idx[n + c] = nofs0 + j + 1;
+				n += 3;
+				if (Reduce && j == nseg - 1) break;
+				idx[n] = nofs0 + j + 1;
+				idx[n + b] = nofs1 + j;
+				idx[n + c] = nofs1 + j + 1;
+				n += 3;
+			}
+			nofs0 = nofs1;
+		}
+		return mesh;
+	}
+};
+
+// Generate all tiles of a sphere patch set on threadCount threads and write
+// them to <prefix>_<ilat>_<ilng>.cmsh, or to the archive <prefix>.cmsa (see
+// cmsh_archive_header).  Prints a summary unless quiet.  Adds a span for
+// every tile to trace if it is given.  Returns 0 or the error code for main.
+int GeneratePatches(PatchSet &set, const char *prefix, bool archive, int threadCount,
+	int format, uint32_t alignment, const VertexLayout &layout, bool straightConvert, bool genTangents, bool quiet,
+	TraceLog *trace)
+{
+	set.BuildTables();
+	int tileCount = set.LatCount * set.LngCount;
+
+	std::ofstream archiveFile;
+	std::vector<cmsh_archive_tile> table(tileCount);
+	cmsh_archive_header archiveHeader;
+	ZeroMemory(&archiveHeader, sizeof(cmsh_archive_header));
+	if (archive)
+	{
+		std::string name = std::string(prefix) + ".cmsa";
+		archiveFile.open(name.c_str(), std::ios::binary);
+		if (!archiveFile.is_open())
+		{
+			std::cout << "Error:  Could not create \"" << name << "\"." << std::endl;
+			return -5;
+		}
+		memcpy(archiveHeader.Magic, CMSH_ARCHIVE_MAGIC, 8);
+		archiveHeader.TileCount = tileCount;
+		archiveHeader.NLng = set.LngCount;
+		archiveHeader.NLat = set.LatCount;
+		archiveHeader.Res = set.Res;
+		archiveHeader.Flags = set.Outside ? 0 : CMSH_ARCHIVE_INSIDE;
+		archiveHeader.Alignment = alignment;
+		archiveFile.write((char *)&archiveHeader, sizeof(cmsh_archive_header));
+		archiveFile.write((char *)table.data(), table.size() * sizeof(cmsh_archive_tile));
+	}
+
+	// Archive tiles are written in index order: a tile that is done before
+	// the ones before it waits in pending.
+	std::atomic<int> next(0), failed(0);
+	std::mutex archiveLock;
+	std::vector<std::string> pending(archive ? tileCount : 0);
+	std::vector<bool> done(archive ? tileCount : 0, false);
+	int nextWrite = 0;
+	auto worker = [&]()
+	{
+		// Each tile is built in the arena of its thread, which is reset
+		// rather than freed between tiles.
+		Arena pool;
+		for (int t; (t = next++) < tileCount && !failed; )
+		{
+			int ilat = t / set.LngCount, ilng = t % set.LngCount;
+			TraceSpan span(trace, "tile " + std::to_string(ilat) + "_" + std::to_string(ilng), "file");
+			ExMesh *mesh = set.CreateTile(ilat, ilng, &pool);
+			if (!mesh || (genTangents && !mesh->GroupList[0]->GenerateTangents()))
+			{
+				failed = -6;
+				delete mesh;
+				break;
+			}
+
+			std::ostringstream buffer;
+			std::ofstream tileFile;
+			std::ostream *out = &buffer;
+			if (!archive)
+			{
+				std::string name = std::string(prefix) + "_" + std::to_string(ilat) + "_" + std::to_string(ilng) + ".cmsh";
+				tileFile.open(name.c_str(), std::ios::binary);
+				if (!tileFile.is_open())
+				{
+					failed = -5;
+					delete mesh;
+					break;
+				}
+				out = &tileFile;
+			}
+			bool written;
+			if (format == 2) written = WriteCmsh2(*out, *mesh, alignment, layout, false, nullptr, 0);
+			else
+			{
+				cmsh_header header = MakeCmsh1Header(*mesh);
+				header.VertexComponents = straightConvert ? 0 : 1;
+				header.Tangents = genTangents ? 1 : 0;
+				written = WriteCmsh1(*out, *mesh, header, nullptr, 0);
+			}
+			span.Arg("bytes", (double)out->tellp());
+			span.Arg("vertices", mesh->GroupList[0]->VertexCount);
+			delete mesh;
+			pool.Reset();
+			if (!written || !*out)
+			{
+				failed = -5;
+				break;
+			}
+
+			if (archive)
+			{
+				std::lock_guard<std::mutex> lock(archiveLock);
+				pending[t] = buffer.str();
+				done[t] = true;
+				for (; nextWrite < tileCount && done[nextWrite]; nextWrite++)
+				{
+					std::string &data = pending[nextWrite];
+					cmsh_archive_tile &entry = table[nextWrite];
+					entry.Lat = nextWrite / set.LngCount;
+					entry.Lng = nextWrite % set.LngCount;
+					entry.Size = data.size();
+					entry.Offset = WriteAligned(archiveFile, data.data(), data.size(), alignment);
+					std::string().swap(data);
+				}
+				if (!archiveFile) failed = -5;
+			}
+		}
+	};
+
+	if (threadCount < 1) threadCount = 1;
+	if (threadCount > tileCount) threadCount = tileCount;
+	std::vector<std::thread> threads;
+	for (int i = 1; i < threadCount; i++) threads.push_back(std::thread(worker));
+	worker();
+	for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+
+	if (failed)
+	{
+		std::cout << "Error:  Could not " << (failed == -5 ? "write" : "generate") << " sphere patches." << std::endl;
+		return failed;
+	}
+	if (archive)
+	{
+		archiveFile.seekp(sizeof(cmsh_archive_header));
+		archiveFile.write((char *)table.data(), table.size() * sizeof(cmsh_archive_tile));
+		archiveFile.close();
+		if (!archiveFile)
+		{
+			std::cout << "Error:  Could not write sphere patches." << std::endl;
+			return -5;
+		}
+	}
+	if (!quiet)
+		std::cout << "Generated " << tileCount << " sphere patches (" << set.LatCount << " x " << set.LngCount
+			<< ", resolution " << set.Res << ") on " << threadCount << " threads." << std::endl;
+	return 0;
+}
+
+// Write the JSON report to file, or to the console if file is "-"
+bool WriteStats(const RunStats &stats, const char *file)
+{
+	if (strcmp(file, "-") == 0)
+	{
+		stats.WriteJson(std::cout);
+		std::cout.flush();
+		return true;
+	}
+	std::ofstream out(file);
+	if (!out.is_open())
+	{
+		std::cout << "Error:  Could not create \"" << file << "\"." << std::endl;
+		return false;
+	}
+	stats.WriteJson(out);
+	return true;
+}
+
+// Write the trace events to file
+bool WriteTrace(const TraceLog &trace, const char *file)
+{
+	std::ofstream out(file);
+	if (!out.is_open())
+	{
+		std::cout << "Error:  Could not create \"" << file << "\"." << std::endl;
+		return false;
+	}
+	trace.Write(out);
+	return true;
+}
+
+// Options of the compile of one mesh file, as set on the command line.
+struct CompileOptions
+{
+	bool StraightConvert = false;
+	bool NoMatNames = false;
+	bool StringTable = false;
+	bool NameIndex = false;
+	int Format = 1;
+	uint32_t Alignment = 16;
+	VertexLayout Layout;
+	bool WeldPositions = false;
+	bool BuildAdjacency = false;
+	bool BuildBvh = false;
+	bool BuildGroupBvh = false;
+	int BvhQueries = 0;
+	bool RecalcNormals = false;
+	bool Cleanup = false;
+	bool GenTangents = false;
+	Mesh::NormalWeight NormalWeight = Mesh::NMLWEIGHT_ANGLE;
+	float CreaseAngle = 0.0f;
+	std::vector<TransformStep> Transforms;
+	bool Dedup = false;
+	bool MergeGroups = false;
+	std::vector<const char *> MergeDeny;
+	std::vector<const char *> MergeAllow;
+	unsigned MergeKeepFlags = 0;
+	bool Quiet = false;
+};
+
+// Fill in the default vertex streams of the layout, and switch to the
+// version 2 format if an option needs it.
+void ResolveLayout(CompileOptions &options)
+{
+	// Custom layouts are only supported by the version 2 format.
+	if (!options.Layout.Streams.empty() || !options.Layout.Drops.empty() || options.Layout.Block || options.WeldPositions || options.BuildBvh || options.BuildGroupBvh) options.Format = 2;
+	uint32_t layoutAttributes = 0;
+	for (size_t i = 0; i < options.Layout.Streams.size(); i++) layoutAttributes |= options.Layout.Streams[i];
+	if (layoutAttributes & CMSH2_ATTR_TANGENT) options.GenTangents = true;
+	if (options.Layout.Streams.empty())
+	{
+		if (options.StraightConvert) options.Layout.Streams.push_back(CMSH2_ATTR_POSITION | CMSH2_ATTR_NORMAL | CMSH2_ATTR_UV);
+		else
+		{
+			options.Layout.Streams.push_back(CMSH2_ATTR_POSITION);
+			options.Layout.Streams.push_back(CMSH2_ATTR_NORMAL);
+			options.Layout.Streams.push_back(CMSH2_ATTR_UV);
+		}
+		layoutAttributes = CMSH2_ATTR_POSITION | CMSH2_ATTR_NORMAL | CMSH2_ATTR_UV;
+	}
+	if (options.GenTangents && !(layoutAttributes & CMSH2_ATTR_TANGENT))
+	{
+		if (options.StraightConvert && options.Layout.Streams.size() == 1) options.Layout.Streams[0] |= CMSH2_ATTR_TANGENT;
+		else options.Layout.Streams.push_back(CMSH2_ATTR_TANGENT);
+	}
+}
+
+// Compile inputFile to outputFile, or to inputFile with the extension
+// .cmsh if outputFile is nullptr.  The vertex and index lists of the meshes
+// come from arena, which the caller may reset afterwards.  Phase times and
+// counters are added to stats and, if trace is given, spans for the file
+// and its phases to trace.  Messages go to log.  Returns 0 or the error
+// code for main.
+int CompileMesh(const CompileOptions &options, const char *inputFile, char *outputFile,
+	Arena &arena, RunStats &stats, TraceLog *trace, std::ostream &log)
+{
+	TraceSpan fileSpan(trace, inputFile, "file");
+	bool outputAllocated = false;
+	if (!outputFile)
+	{
+		outputAllocated = true;
+
+		// Length of input file name.
+		int length = strlen(inputFile);
+
+		// Index of decimal point.
+		int index = -1;
+
+		// Search for extension.
+		for (int i = 0; i < length; i++)
+		{
+			if (inputFile[i] == '.')
+			{
+				index = i;
+				break;
+			}
+		}
+
+		// No extension found.
+		if (index == -1)
+		{
+			// Set output file and designate extension.
+			int outLength = length + 6;
+			outputFile = new(std::nothrow) char[outLength];
+			if (!outputFile)
+			{
+				log << "Error:  Could not generate output file." << std::endl;
+				return -1;
+			}
+			for (int i = 0; i < length; i++) outputFile[i] = inputFile[i];
+
+			// Append mesh extension.
+			outputFile[length + 0] = '.';
+			outputFile[length + 1] = 'c';
+			outputFile[length + 2] = 'm';
+			outputFile[length + 3] = 's';
+			outputFile[length + 4] = 'h';
+			outputFile[length + 5] = '\0';
+		}
+		// Extension found.
+		else
+		{
+			// The length of the extension.
+			int extLength = length - index - 1;	// Extension length minus the decimal point.
+			int outLength = length - extLength + 4;	// Output length.
+			int lenNoExt = length - extLength + 1;	// Make sure to copy the decimal point.
+
+			int finalLength = outLength + 1;
+			outputFile = new(std::nothrow) char[finalLength];
+			if (!outputFile)
+			{
+				log << "Error:  Could not generate output file." << std::endl;
+				return -1;
+			}
+
+			// Copy input file name without extension, but including the decimal point.
+			for (int i = 0; i < lenNoExt; i++) outputFile[i] = inputFile[i];
+
+			// Copy the extension.
+			outputFile[outLength - 4] = 'c';
+			outputFile[outLength - 3] = 'm';
+			outputFile[outLength - 2] = 's';
+			outputFile[outLength - 1] = 'h';
+			outputFile[outLength - 0] = '\0';
+		}
+	}
+
+	// Read Mesh File.  The vertex and index lists of both meshes come from
+	// the arena.
+	Mesh *iMesh = new(std::nothrow) Mesh(&arena);
+	if (!iMesh)
+	{
+		log << "Error:  Could not initialize mesh file for \"" << inputFile << "\"." << std::endl;
+		if (outputAllocated) delete[] outputFile;
+		return -2;
+	}
+
+	iMesh->SetNormalOptions(options.NormalWeight, options.CreaseAngle * g_DEGTORAD);
+
+	std::ifstream iMeshFile(inputFile);
+	if (!iMeshFile.is_open())
+	{
+		log << "Error:  Could not open \"" << inputFile << "\"." << std::endl;
+		if (outputAllocated) delete[] outputFile;
+		delete iMesh;
+		return -3;
+	}
+
+	iMeshFile.seekg(0, std::ios::end);
+	double inputBytes = (double)iMeshFile.tellg();
+	iMeshFile.seekg(0, std::ios::beg);
+	double vertexCount = 0, triangleCount = 0;
+	{
+		PhaseTimer timer(stats, "parse", trace);
+		iMeshFile >> *iMesh;
+		for (DWORD g = 0; g < iMesh->nGroup(); g++)
+		{
+			vertexCount += iMesh->GetGroup(g)->nVtx;
+			triangleCount += iMesh->GetGroup(g)->nIdx / 3;
+		}
+		timer.Arg("bytes", inputBytes);
+		timer.Arg("vertices", vertexCount);
+	}
+	iMeshFile.close();
+
+	// Remove dead geometry.
+	if (options.Cleanup)
+	{
+		PhaseTimer timer(stats, "cleanup", trace);
+		Mesh::CleanupCount total = { 0, 0, 0 };
+		for (DWORD g = 0; g < iMesh->nGroup(); g++)
+		{
+			Mesh::CleanupCount count;
+			if (!iMesh->CleanupGroup(g, &count) || options.Quiet) continue;
+			const char *label = iMesh->GetLabel(g);
+			log << "Cleaned group " << g << (label ? " (" : "") << (label ? label : "") << (label ? ")" : "") << ": "
+				<< count.nDegenerate << " zero-area and " << count.nDuplicate << " duplicate triangles, "
+				<< count.nUnused << " unused vertices.\n";
+			total.nDegenerate += count.nDegenerate;
+			total.nDuplicate += count.nDuplicate;
+			total.nUnused += count.nUnused;
+		}
+		if (!options.Quiet)
+			log << "Removed " << total.nDegenerate << " zero-area and " << total.nDuplicate << " duplicate triangles, "
+				<< total.nUnused << " unused vertices." << std::endl;
+	}
+
+	// Recalculate normals.
+	if (options.RecalcNormals)
+	{
+		PhaseTimer timer(stats, "normals", trace);
+		timer.Arg("vertices", vertexCount);
+		DWORD degenerate = 0;
+		for (DWORD g = 0; g < iMesh->nGroup(); g++) degenerate += iMesh->CalcNormals(g, false);
+		if (degenerate)
+			log << "Warning:  " << degenerate << " zero-area triangles (see -cleanup)." << std::endl;
+	}
+
+	// Bake transforms.
+	if (!options.Transforms.empty())
+	{
+		PhaseTimer timer(stats, "transform", trace);
+		ApplyTransforms(*iMesh, options.Transforms);
+	}
+
+	// Remove duplicate materials and textures.
+	if (options.Dedup)
+	{
+		PhaseTimer timer(stats, "dedup", trace);
+		DWORD materials = iMesh->RemoveDuplicateMaterials();
+		DWORD textures = iMesh->RemoveDuplicateTextures();
+		if (!options.Quiet) log << "Removed " << materials << " materials and " << textures << " textures." << std::endl;
+	}
+
+	// Merge groups.
+	int remapCount = 0;
+	Mesh::GroupRemap *remap = nullptr;
+	if (options.MergeGroups)
+	{
+		PhaseTimer timer(stats, "merge", trace);
+		remapCount = (int)iMesh->nGroup();
+		remap = new(std::nothrow) Mesh::GroupRemap[remapCount];
+		bool *keep = GetKeepList(*iMesh, options.MergeDeny, options.MergeAllow, options.MergeKeepFlags);
+		if (!remap || !keep)
+		{
+			log << "Error:  Could not merge groups of \"" << inputFile << "\"." << std::endl;
+			if (remap) delete[] remap;
+			if (keep) delete[] keep;
+			if (outputAllocated) delete[] outputFile;
+			delete iMesh;
+			return -8;
+		}
+		iMesh->MergeGroups(keep, remap);
+		delete[] keep;
+		if (!options.Quiet) log << "Merged " << remapCount << " groups into " << iMesh->nGroup() << "." << std::endl;
+	}
+
+	// Convert Mesh File.
+	ExMesh *oMesh;
+	{
+		PhaseTimer timer(stats, "convert", trace);
+		timer.Arg("vertices", vertexCount);
+		oMesh = new(std::nothrow) ExMesh(iMesh, !options.NoMatNames, &arena);
+	}
+	if (!oMesh)
+	{
+		log << "Error:  Could not convert \"" << inputFile << "\" data." << std::endl;
+		if (outputAllocated) delete[] outputFile;
+		delete iMesh;
+		if (remap) delete[] remap;
+		return -4;
+	}
+
+	// Delete Mesh File
+	delete iMesh;
+
+	if (!oMesh->Validate())
+	{
+		log << "Converted mesh failed validation." << std::endl;
+		if (outputAllocated) delete[] outputFile;
+		delete oMesh;
+		if (remap) delete[] remap;
+		return -10;
+	}
+
+	if (!oMesh->GroupList)
+	{
+		log << "Error:  Could not convert \"" << inputFile << "\" data." << std::endl;
+		if (outputAllocated) delete[] outputFile;
+		delete oMesh;
+		if (remap) delete[] remap;
+		return -4;
+	}
+
+	// Generate tangents.
+	if (options.GenTangents)
+	{
+		PhaseTimer timer(stats, "tangents", trace);
+		for (int i = 0; i < oMesh->GroupCount; i++)
+		{
+			if (!oMesh->GroupList[i]->GenerateTangents())
+			{
+				log << "Error:  Could not generate tangents for \"" << inputFile << "\"." << std::endl;
+				if (outputAllocated) delete[] outputFile;
+				delete oMesh;
+				if (remap) delete[] remap;
+				return -6;
+			}
+		}
+	}
+
+	// Weld positions for depth and shadow passes.
+	if (options.WeldPositions)
+	{
+		PhaseTimer timer(stats, "weld", trace);
+		for (int i = 0; i < oMesh->GroupCount; i++)
+		{
+			if (!oMesh->GroupList[i]->WeldPositions())
+			{
+				log << "Error:  Could not weld positions of \"" << inputFile << "\"." << std::endl;
+				if (outputAllocated) delete[] outputFile;
+				delete oMesh;
+				if (remap) delete[] remap;
+				return -14;
+			}
+		}
+	}
+	if (options.BuildAdjacency)
+	{
+		PhaseTimer timer(stats, "adjacency", trace);
+		for (int i = 0; i < oMesh->GroupCount; i++)
+		{
+			if (!oMesh->GroupList[i]->BuildAdjacency())
+			{
+				log << "Error:  Could not build edge adjacency of \"" << inputFile << "\"." << std::endl;
+				if (outputAllocated) delete[] outputFile;
+				delete oMesh;
+				if (remap) delete[] remap;
+				return -14;
+			}
+		}
+	}
+
+	// Build the triangle BVH.
+	if (options.BuildBvh)
+	{
+		{
+			PhaseTimer timer(stats, "bvh", trace);
+			oMesh->BuildTriangleBvh();
+		}
+		BenchmarkBvh(*oMesh, options.BvhQueries, log);
+	}
+	if (options.BuildGroupBvh)
+	{
+		{
+			PhaseTimer timer(stats, "groupbvh", trace);
+			oMesh->BuildGroupBvh();
+		}
+		if (!options.Quiet) ReportGroupCulling(*oMesh, log);
+	}
+
+	cmsh_header header = MakeCmsh1Header(*oMesh);
+	header.VertexComponents = options.StraightConvert ? 0 : 1;
+	header.MaterialNames = options.NoMatNames ? 0 : 1;
+	header.Tangents = options.GenTangents ? 1 : 0;
+	header.GroupRemap = remap ? 1 : 0;
+	header.StringTable = options.StringTable ? 1 : 0;
+	header.NameIndex = options.NameIndex ? 1 : 0;
+
+	if (!options.Quiet)
+	{
+		PhaseTimer timer(stats, "report", trace);
+		log << "Group Count:\t" << header.GroupCount << '\n';
+		log << "Material Count:\t" << header.MaterialCount << '\n';
+		log << "Texture Count:\t" << header.TextureCount << "\n\n";
+
+		for (int i = 0; i < oMesh->GroupCount; i++)
+		{
+			ExMeshGroup *current = oMesh->GroupList[i];
+			log << "Mesh Group: " << oMesh->Strings.Get(current->Label) << '\n';
+			log << "\tMat Index:\t" << current->MaterialIndex << '\n';
+			log << "\tTexture Index:\t" << current->TextureIndex << '\n';
+			log << "\tVertex Count:\t" << current->VertexCount << '\n';
+			log << "\tIndex Count:\t" << current->IndexCount << '\n';
+			if (current->WeldedPositions)
+			{
+				log << "\tWelded Vertex Count:\t" << current->WeldedVertexCount << '\n';
+				log << "\tWelded Index Count:\t" << current->WeldedIndexCount << '\n';
+			}
+			if (current->Edges)
+			{
+				log << "\tEdge Count:\t" << current->EdgeCount << '\n';
+				log << "\tOpen Edges:\t" << current->OpenEdgeCount << '\n';
+				log << "\tNon-Manifold Edges:\t" << current->NonManifoldEdgeCount << '\n';
+			}
+			log << '\n';
+		}
+		log.flush();
+	}
+
+	std::ofstream oMeshFile(outputFile, std::ios::binary);
+	if (!oMeshFile.is_open())
+	{
+		log << "Error:  Could not create \"" << outputFile << "\"." << std::endl;
+		if (outputAllocated) delete[] outputFile;
+		delete oMesh;
+		if (remap) delete[] remap;
+		return -5;
+	}
+
+	bool written;
+	double outputBytes;
+	{
+		PhaseTimer timer(stats, "write", trace);
+		if (options.Format == 2)
+			written = WriteCmsh2(oMeshFile, *oMesh, options.Alignment, options.Layout, options.NameIndex, remap, remapCount);
+		else
+			written = WriteCmsh1(oMeshFile, *oMesh, header, remap, remapCount);
+		outputBytes = (double)oMeshFile.tellp();
+		oMeshFile.close();
+		timer.Arg("bytes", outputBytes);
+	}
+	if (!written)
+	{
+		log << "Error:  Could not build name index for \"" << inputFile << "\"." << std::endl;
+		remove(outputFile); // don't leave a partial file
+		if (remap) delete[] remap;
+		delete oMesh;
+		if (outputAllocated) delete[] outputFile;
+		return -11;
+	}
+
+	if (remap) delete[] remap;
+	delete oMesh;
+
+	stats.SetFile("input", inputFile);
+	stats.SetFile("output", outputFile);
+	stats.Set("input_bytes", inputBytes);
+	stats.Set("output_bytes", outputBytes);
+	stats.Set("vertices", vertexCount);
+	stats.Set("triangles", triangleCount);
+	stats.Set("arena_allocations", (double)arena.AllocCount());
+	stats.Set("arena_bytes", (double)arena.Used());
+	fileSpan.Arg("input_bytes", inputBytes);
+	fileSpan.Arg("output_bytes", outputBytes);
+	fileSpan.Arg("vertices", vertexCount);
+	if (outputAllocated) delete[] outputFile;
+
+	return 0;
+}
+
+// Append the file names listed in fileName, one per line, to inputs.
+// Empty lines and lines starting with '#' are skipped.
+bool ReadInputList(const char *fileName, std::vector<std::string> &inputs)
+{
+	std::ifstream file(fileName);
+	if (!file.is_open()) return false;
+	std::string line;
+	while (std::getline(file, line))
+	{
+		size_t end = line.find_last_not_of(" \t\r");
+		if (end == std::string::npos || line[0] == '#') continue;
+		inputs.push_back(line.substr(0, end + 1));
+	}
+	return true;
+}
+
+// Compile each of inputs to a .cmsh file next to it, on threadCount threads
+// with an arena each, which is reset between files.  The messages of a file
+// are printed in one piece once it is done, and a failed file does not stop
+// the others.  Phase times and counters of all files are added to stats.
+// Messages go to console.  Returns 0 or the error code of a failed file.
+int CompileBatch(const CompileOptions &options, const std::vector<std::string> &inputs, int threadCount,
+	RunStats &stats, TraceLog *trace, std::ostream &console)
+{
+	int fileCount = (int)inputs.size();
+	std::atomic<int> next(0);
+	std::mutex outputLock;
+	int result = 0, failed = 0;
+	double chunks = 0;
+	auto worker = [&]()
+	{
+		Arena arena;
+		for (int f; (f = next++) < fileCount; )
+		{
+			RunStats fileStats;
+			std::ostringstream log;
+			int code = CompileMesh(options, inputs[f].c_str(), nullptr, arena, fileStats, trace, log);
+			arena.Reset();
+
+			std::lock_guard<std::mutex> lock(outputLock);
+			console << log.str();
+			console.flush();
+			stats.Merge(fileStats);
+			if (code)
+			{
+				failed++;
+				if (!result) result = code;
+			}
+		}
+		std::lock_guard<std::mutex> lock(outputLock);
+		chunks += arena.ChunkCount();
+	};
+
+	if (threadCount < 1) threadCount = 1;
+	if (threadCount > fileCount) threadCount = fileCount;
+	std::vector<std::thread> threads;
+	for (int i = 1; i < threadCount; i++) threads.push_back(std::thread(worker));
+	worker();
+	for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+
+	stats.Set("files", fileCount);
+	stats.Set("failed_files", failed);
+	stats.Set("threads", threadCount);
+	stats.Set("arena_chunks", chunks);
+	if (!options.Quiet || failed)
+		console << "Compiled " << fileCount - failed << " of " << fileCount << " files on " << threadCount << " threads." << std::endl;
+	return result;
+}
+
+// A synthetic mesh of the benchmark.  Sphere meshes are made of
+// CreateSpherePatch patches, one latitude band per group, repeated side by
+// side.  Soups are triangles between random vertices that are close in the
+// vertex list, as in a real mesh.  Every value comes from a fixed seed, so
+// the MSH text is the same on every run and platform.
+struct BenchCase
+{
+	const char *Name;
+	bool Sphere;
+	int GroupCount;
+	int Size;	// vertices per group of a soup, res of a sphere patch
+	bool Normals;	// write normals, or NONORMAL groups the parser computes them for
+	bool Flip;	// FLIP every other group
+	int MaterialCount;	// 0 for none; there are half as many textures
+	bool Full;	// only in the full suite
+};
+
+const BenchCase BenchCases[] =
+{
+	{ "tiny", false, 1, 36, true, false, 0, false },
+	{ "soup_16k_nonormal", false, 16, 1024, false, true, 4, false },
+	{ "sphere_69k", true, 32, 32, true, false, 4, false },
+	{ "groups_10k", false, 10000, 24, true, true, 64, false },
+	{ "soup_1m", false, 32, 32768, true, false, 8, true },
+	{ "sphere_2m_nonormal", true, 240, 64, false, true, 16, true },
+};
+
+// xorshift32, so the corpus does not depend on the C library's rand
+struct BenchRandom
+{
+	uint32_t State;
+
+	uint32_t Next()
+	{
+		State ^= State << 13;
+		State ^= State >> 17;
+		State ^= State << 5;
+		return State;
+	}
+	float Uniform() { return (Next() >> 8) * (1.0f / 16777216.0f); }
+};
+
+// Append one group in MSH syntax to text.
+void AppendBenchGroup(std::string &text, const BenchCase &bench, int g, const NTVERTEX *vtx, int vertexCount,
+	const WORD *idx, int triangleCount)
+{
+	char line[256];
+	int textureCount = bench.MaterialCount / 2;
+	sprintf(line, "LABEL %s_%d\nMATERIAL %d\nTEXTURE %d\n", bench.Sphere ? "patch" : "soup", g,
+		bench.MaterialCount ? g % bench.MaterialCount + 1 : 0, textureCount ? g % textureCount + 1 : 0);
+	text += line;
+	if (!bench.Normals) text += "NONORMAL\n";
+	if (bench.Flip && (g & 1)) text += "FLIP\n";
+	sprintf(line, "GEOM %d %d\n", vertexCount, triangleCount);
+	text += line;
+	for (int i = 0; i < vertexCount; i++)
+	{
+		const NTVERTEX &v = vtx[i];
+		if (bench.Normals)
+			sprintf(line, "%.6g %.6g %.6g %.6g %.6g %.6g %.6g %.6g\n", v.x, v.y, v.z, v.nx, v.ny, v.nz, v.tu, v.tv);
+		else
+			sprintf(line, "%.6g %.6g %.6g %.6g %.6g\n", v.x, v.y, v.z, v.tu, v.tv);
+		text += line;
+	}
+	for (int i = 0; i < triangleCount; i++)
+	{
+		sprintf(line, "%d %d %d\n", idx[i * 3], idx[i * 3 + 1], idx[i * 3 + 2]);
+		text += line;
+	}
+}
+
+// Generate the MSH text of a benchmark mesh.
+void CreateBenchMsh(const BenchCase &bench, std::string &text)
+{
+	const int NLAT = 4;
+	char line[256];
+	BenchRandom random = { 0x2545F491u };
+	sprintf(line, "MSHX1\nGROUPS %d\n", bench.GroupCount);
+	text = line;
+
+	std::vector<NTVERTEX> vtx;
+	std::vector<WORD> idx;
+	for (int g = 0; g < bench.GroupCount; g++)
+	{
+		if (bench.Sphere)
+		{
+			// band g % NLAT of copy g / NLAT, copies side by side along x
+			Mesh patch;
+			CreateSpherePatch(patch, 8, NLAT, g % NLAT, bench.Size);
+			const GroupSpec *group = patch.GetGroup(0);
+			vtx.assign(group->Vtx, group->Vtx + group->nVtx);
+			idx.assign(group->Idx, group->Idx + group->nIdx);
+			for (size_t i = 0; i < vtx.size(); i++) vtx[i].x += 2.0f * (g / NLAT);
+		}
+		else
+		{
+			vtx.resize(bench.Size);
+			for (int i = 0; i < bench.Size; i++)
+			{
+				NTVERTEX &v = vtx[i];
+				v.x = random.Uniform() + (g % 32);
+				v.y = random.Uniform() + (g / 32 % 32);
+				v.z = random.Uniform() + (g / 1024);
+				float n[3], len;
+				do
+				{
+					for (int k = 0; k < 3; k++) n[k] = 2.0f * random.Uniform() - 1.0f;
+					len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				} while (len < 0.01f || len > 1.0f);
+				v.nx = n[0] / len;
+				v.ny = n[1] / len;
+				v.nz = n[2] / len;
+				v.tu = random.Uniform();
+				v.tv = random.Uniform();
+			}
+			// two triangles per vertex, corners at most 32 vertices apart
+			idx.resize(bench.Size * 6);
+			for (int i = 0; i < bench.Size * 2; i++)
+			{
+				int a = random.Next() % bench.Size;
+				int b = (a + 1 + random.Next() % 32) % bench.Size;
+				int c = (a + 1 + random.Next() % 32) % bench.Size;
+				if (c == b) c = (b + 1) % bench.Size;
+				if (c == a) c = (a + bench.Size - 1) % bench.Size;
+				idx[i * 3] = (WORD)a;
+				idx[i * 3 + 1] = (WORD)b;
+				idx[i * 3 + 2] = (WORD)c;
+			}
+		}
+		AppendBenchGroup(text, bench, g, vtx.data(), (int)vtx.size(), idx.data(), (int)idx.size() / 3);
+	}
+
+	if (bench.MaterialCount)
+	{
+		sprintf(line, "MATERIALS %d\n", bench.MaterialCount);
+		text += line;
+		for (int m = 0; m < bench.MaterialCount; m++)
+		{
+			sprintf(line, "mat%d\n", m);
+			text += line;
+		}
+		for (int m = 0; m < bench.MaterialCount; m++)
+		{
+			float r = random.Uniform(), g = random.Uniform(), b = random.Uniform();
+			sprintf(line, "MATERIAL mat%d\n%.6g %.6g %.6g 1\n%.6g %.6g %.6g 1\n0.5 0.5 0.5 1 %d\n0 0 0 1\n",
+				m, r, g, b, r, g, b, 5 + m % 20);
+			text += line;
+		}
+		sprintf(line, "TEXTURES %d\n", bench.MaterialCount / 2);
+		text += line;
+		for (int t = 0; t < bench.MaterialCount / 2; t++)
+		{
+			sprintf(line, "bench\\tex%d.dds\n", t);
+			text += line;
+		}
+	}
+}
+
+// Time parse, convert and write of each benchmark mesh in memory, without
+// file I/O, for the single array (-s) and the split vertex layout with the
+// other options as given.  Each time is the best of several runs.  The
+// results are printed as tab-separated columns with a header line, so
+// runs of different builds can be compared line by line.  If dir is given,
+// the MSH files are written there as well.  Returns 0 or the error code for
+// main.
+int RunBenchmark(const CompileOptions &options, bool full, const char *dir)
+{
+	std::cout << "# mshcmp benchmark 1, " << (full ? "full" : "quick") << " suite, format " << options.Format << '\n';
+	std::cout << "case\tlayout\tgroups\tvertices\ttriangles\tmsh_bytes\tcmsh_bytes\tparse_ms\tconvert_ms\twrite_ms\t"
+		"parse_mb_s\tconvert_mvtx_s\twrite_mb_s" << std::endl;
+
+	CompileOptions layouts[2] = { options, options };
+	layouts[0].StraightConvert = true;
+	layouts[1].StraightConvert = false;
+	for (int l = 0; l < 2; l++) ResolveLayout(layouts[l]);
+
+	typedef std::chrono::steady_clock Clock;
+	Arena arena;
+	for (size_t c = 0; c < sizeof(BenchCases) / sizeof(BenchCases[0]); c++)
+	{
+		const BenchCase &bench = BenchCases[c];
+		if (bench.Full && !full) continue;
+
+		std::string text;
+		CreateBenchMsh(bench, text);
+		if (dir)
+		{
+			std::string name = std::string(dir) + "/" + bench.Name + ".msh";
+			std::ofstream file(name.c_str(), std::ios::binary);
+			if (!file.is_open())
+			{
+				std::cout << "Error:  Could not create \"" << name << "\"." << std::endl;
+				return -5;
+			}
+			file.write(text.data(), text.size());
+		}
+
+		double parseTime = 1e30, convertTime[2] = { 1e30, 1e30 }, writeTime[2] = { 1e30, 1e30 };
+		double vertexCount = 0, triangleCount = 0, outputBytes[2] = { 0, 0 };
+		DWORD groupCount = 0;
+		int runs = text.size() > 50000000 ? 1 : text.size() > 10000000 ? 3 : 5;
+		for (int run = 0; run < runs; run++)
+		{
+			std::istringstream input(text);
+			Mesh *mesh = new(std::nothrow) Mesh(&arena);
+			if (!mesh) return -2;
+			Clock::time_point t0 = Clock::now();
+			input >> *mesh;
+			parseTime = std::min(parseTime, std::chrono::duration<double>(Clock::now() - t0).count());
+			groupCount = mesh->nGroup();
+			vertexCount = triangleCount = 0;
+			for (DWORD g = 0; g < groupCount; g++)
+			{
+				vertexCount += mesh->GetGroup(g)->nVtx;
+				triangleCount += mesh->GetGroup(g)->nIdx / 3;
+			}
+
+			for (int l = 0; l < 2; l++)
+			{
+				const CompileOptions &layout = layouts[l];
+				t0 = Clock::now();
+				ExMesh *oMesh = new(std::nothrow) ExMesh(mesh, !layout.NoMatNames, &arena);
+				Clock::time_point t1 = Clock::now();
+				if (!oMesh || !oMesh->GroupList || !oMesh->Validate())
+				{
+					std::cout << "Error:  Could not convert benchmark mesh \"" << bench.Name << "\"." << std::endl;
+					delete oMesh;
+					delete mesh;
+					return -4;
+				}
+
+				std::ostringstream output;
+				Clock::time_point t2 = Clock::now();
+				if (layout.Format == 2) WriteCmsh2(output, *oMesh, layout.Alignment, layout.Layout, layout.NameIndex, nullptr, 0);
+				else
+				{
+					cmsh_header header = MakeCmsh1Header(*oMesh);
+					header.VertexComponents = layout.StraightConvert ? 0 : 1;
+					header.MaterialNames = layout.NoMatNames ? 0 : 1;
+					header.StringTable = layout.StringTable ? 1 : 0;
+					header.NameIndex = layout.NameIndex ? 1 : 0;
+					WriteCmsh1(output, *oMesh, header, nullptr, 0);
+				}
+				Clock::time_point t3 = Clock::now();
+				convertTime[l] = std::min(convertTime[l], std::chrono::duration<double>(t1 - t0).count());
+				writeTime[l] = std::min(writeTime[l], std::chrono::duration<double>(t3 - t2).count());
+				outputBytes[l] = (double)output.tellp();
+				delete oMesh;
+			}
+			delete mesh;
+			arena.Reset();
+		}
+
+		for (int l = 0; l < 2; l++)
+		{
+			char line[512];
+			sprintf(line, "%s\t%s\t%lu\t%.0f\t%.0f\t%lu\t%.0f\t%.3f\t%.3f\t%.3f\t%.2f\t%.2f\t%.2f", bench.Name,
+				l ? "split" : "single", (unsigned long)groupCount, vertexCount, triangleCount, (unsigned long)text.size(),
+				outputBytes[l], parseTime * 1e3, convertTime[l] * 1e3, writeTime[l] * 1e3, text.size() / 1e6 / parseTime,
+				vertexCount / 1e6 / convertTime[l], outputBytes[l] / 1e6 / writeTime[l]);
+			std::cout << line << std::endl;
+		}
+	}
+	return 0;
+}
+
+// The scalar loops of ScaleGroup, RotateGroup (ROTATE_Y) and TransformGroup
+// as they were before the SSE paths, the reference of -bench kernels, except
+// that zero-length normals stay zero as they do in Mesh.
+void ReferenceScale(NTVERTEX *vtx, int vertexCount, float sx, float sy, float sz)
+{
+	for (int i = 0; i < vertexCount; i++)
+	{
+		vtx[i].x *= sx;
+		vtx[i].y *= sy;
+		vtx[i].z *= sz;
+	}
+	if (sx == sy && sx == sz) return;
+	float snx = sy * sz, sny = sx * sz, snz = sx * sy;
+	for (int i = 0; i < vertexCount; i++)
+	{
+		vtx[i].nx *= snx;
+		vtx[i].ny *= sny;
+		vtx[i].nz *= snz;
+		float len2 = vtx[i].nx * vtx[i].nx + vtx[i].ny * vtx[i].ny + vtx[i].nz * vtx[i].nz;
+		if (len2 == 0.0f) continue;
+		float ilen = (float)(1.0 / sqrt(len2));
+		vtx[i].nx *= ilen;
+		vtx[i].ny *= ilen;
+		vtx[i].nz *= ilen;
+	}
+}
+
+void ReferenceRotateY(NTVERTEX *vtx, int vertexCount, float angle)
+{
+	float cosa = (float)cos(angle), sina = (float)sin(angle);
+	for (int i = 0; i < vertexCount; i++)
+	{
+		float x = vtx[i].x, z = vtx[i].z;
+		vtx[i].x = cosa * x - sina * z;
+		vtx[i].z = sina * x + cosa * z;
+		float nx = vtx[i].nx, nz = vtx[i].nz;
+		vtx[i].nx = cosa * nx - sina * nz;
+		vtx[i].nz = sina * nx + cosa * nz;
+	}
+}
+
+void ReferenceTransform(NTVERTEX *vtx, int vertexCount, const D3DMATRIX &mat)
+{
+	for (int i = 0; i < vertexCount; i++)
+	{
+		NTVERTEX &v = vtx[i];
+		float x = v.x * mat._11 + v.y * mat._21 + v.z * mat._31 + mat._41;
+		float y = v.x * mat._12 + v.y * mat._22 + v.z * mat._32 + mat._42;
+		float z = v.x * mat._13 + v.y * mat._23 + v.z * mat._33 + mat._43;
+		float w = v.x * mat._14 + v.y * mat._24 + v.z * mat._34 + mat._44;
+		v.x = x / w;
+		v.y = y / w;
+		v.z = z / w;
+
+		x = v.nx * mat._11 + v.ny * mat._21 + v.nz * mat._31;
+		y = v.nx * mat._12 + v.ny * mat._22 + v.nz * mat._32;
+		z = v.nx * mat._13 + v.ny * mat._23 + v.nz * mat._33;
+		w = x * x + y * y + z * z;
+		w = w == 0.0f ? 1.0f : 1.0f / (float)sqrt(w);
+		v.nx = x * w;
+		v.ny = y * w;
+		v.nz = z * w;
+	}
+}
+
+// Best time of run over several rounds, in nanoseconds per item.
+template<class F> double TimeKernel(F run, int repeatCount, double itemCount)
+{
+	typedef std::chrono::steady_clock Clock;
+	double best = 1e30;
+	for (int round = 0; round < 5; round++)
+	{
+		Clock::time_point t0 = Clock::now();
+		for (int r = 0; r < repeatCount; r++) run();
+		best = std::min(best, std::chrono::duration<double>(Clock::now() - t0).count());
+	}
+	return best * 1e9 / (repeatCount * itemCount);
+}
+
+// Print the benchmark line of a kernel and of its reference.
+void PrintKernel(const char *name, const char *variant, double itemCount, double referenceTime, double time)
+{
+	char line[256];
+	sprintf(line, "%s\treference\t%.0f\t%.3f\t1.00", name, itemCount, referenceTime);
+	std::cout << line << '\n';
+	sprintf(line, "%s\t%s\t%.0f\t%.3f\t%.2f", name, variant, itemCount, time, referenceTime / time);
+	std::cout << line << std::endl;
+}
+
+// Time the vertex kernels of the Mesh class against their scalar reference
+// loops on a group of 60000 vertices, which stays in the cache of most
+// machines, so that the loops and not memory are measured.  Each kernel
+// runs in pairs that undo each other, to keep the values bounded.  Then
+// the quaternion batch functions of D3dmath against loops of their
+// single-item functions on 8192 quaternions, and the Vecmat bulk routines
+// against loops of the single-vector operations on 8192 vectors.  Returns
+// 0 or the error code for main.
+int RunKernelBenchmark()
+{
+	std::cout << "# mshcmp kernels 1\n";
+	std::cout << "kernel\tvariant\titems\tns_per_item\tspeedup" << std::endl;
+
+	const int vertexCount = 60000, repeatCount = 50;
+	BenchRandom random = { 0x2545F491u };
+	NTVERTEX *vtx = new(std::nothrow) NTVERTEX[vertexCount];
+	if (!vtx) return -2;
+	for (int i = 0; i < vertexCount; i++)
+	{
+		float n[3], len = 0;
+		for (int k = 0; k < 3; k++)
+		{
+			n[k] = random.Next() / 4294967296.0f - 0.5f;
+			len += n[k] * n[k];
+		}
+		len = sqrt(len) + 1e-6f;
+		vtx[i] = { random.Next() / 4294967296.0f, random.Next() / 4294967296.0f, random.Next() / 4294967296.0f,
+			n[0] / len, n[1] / len, n[2] / len, 0.5f, 0.5f };
+	}
+	std::vector<NTVERTEX> reference(vtx, vtx + vertexCount);
+	Mesh mesh;
+	mesh.AddGroup(vtx, vertexCount, nullptr, 0);
+	NTVERTEX *ref = reference.data();
+	double items = vertexCount * 2.0;
+
+	double referenceTime = TimeKernel([&]() { ReferenceScale(ref, vertexCount, 2.0f, 2.0f, 2.0f); ReferenceScale(ref, vertexCount, 0.5f, 0.5f, 0.5f); }, repeatCount, items);
+	double time = TimeKernel([&]() { mesh.ScaleGroup(0, 2.0f, 2.0f, 2.0f); mesh.ScaleGroup(0, 0.5f, 0.5f, 0.5f); }, repeatCount, items);
+	PrintKernel("scale_uniform", "mesh", items, referenceTime, time);
+
+	referenceTime = TimeKernel([&]() { ReferenceScale(ref, vertexCount, 2.0f, 1.0f, 0.5f); ReferenceScale(ref, vertexCount, 0.5f, 1.0f, 2.0f); }, repeatCount, items);
+	time = TimeKernel([&]() { mesh.ScaleGroup(0, 2.0f, 1.0f, 0.5f); mesh.ScaleGroup(0, 0.5f, 1.0f, 2.0f); }, repeatCount, items);
+	PrintKernel("scale", "mesh", items, referenceTime, time);
+
+	referenceTime = TimeKernel([&]() { ReferenceRotateY(ref, vertexCount, 0.5f); ReferenceRotateY(ref, vertexCount, -0.5f); }, repeatCount, items);
+	time = TimeKernel([&]() { mesh.RotateGroup(0, Mesh::ROTATE_Y, 0.5f); mesh.RotateGroup(0, Mesh::ROTATE_Y, -0.5f); }, repeatCount, items);
+	PrintKernel("rotate", "mesh", items, referenceTime, time);
+
+	D3DMATRIX mat, inv;
+	VMAT_rotation_from_axis({ 0.6f, 0.0f, 0.8f }, 0.5f, mat);
+	mat._41 = 1.0f, mat._42 = 2.0f, mat._43 = 3.0f;
+	D3DMath_MatrixInvert(inv, mat);
+	referenceTime = TimeKernel([&]() { ReferenceTransform(ref, vertexCount, mat); ReferenceTransform(ref, vertexCount, inv); }, repeatCount, items);
+	time = TimeKernel([&]() { mesh.TransformGroup(0, mat); mesh.TransformGroup(0, inv); }, repeatCount, items);
+	PrintKernel("transform", "mesh", items, referenceTime, time);
+
+	// D3DMath batch functions against loops of the single-item functions
+	const int quatCount = 8192;
+	std::vector<D3DMATH_QUATERNION> quatA(quatCount), quatB(quatCount), quatOut(quatCount);
+	std::vector<float> alpha(quatCount);
+	std::vector<D3DMATRIX> matOut(quatCount);
+	for (int i = 0; i < quatCount; i++)
+	{
+		D3DMATH_QUATERNION *q[2] = { &quatA[i], &quatB[i] };
+		for (int k = 0; k < 2; k++)
+		{
+			float c[4], len = 0;
+			for (int j = 0; j < 4; j++)
+			{
+				c[j] = random.Next() / 4294967296.0f - 0.5f;
+				len += c[j] * c[j];
+			}
+			len = sqrt(len) + 1e-6f;
+			*q[k] = { c[0] / len, c[1] / len, c[2] / len, c[3] / len };
+		}
+		alpha[i] = random.Uniform();
+	}
+	items = quatCount;
+
+	referenceTime = TimeKernel([&]() {
+		for (int i = 0; i < quatCount; i++)
+			D3DMath_MatrixFromQuaternion(matOut[i], quatA[i].x, quatA[i].y, quatA[i].z, quatA[i].w);
+	}, repeatCount, items);
+	time = TimeKernel([&]() { D3DMath_MatrixFromQuaternionBatch(matOut.data(), quatA.data(), quatCount); }, repeatCount, items);
+	PrintKernel("quat_matrix", "batch", items, referenceTime, time);
+
+	referenceTime = TimeKernel([&]() {
+		for (int i = 0; i < quatCount; i++)
+		{
+			D3DMATH_QUATERNION &q = quatOut[i], &a = quatA[i], &b = quatB[i];
+			D3DMath_QuaternionSlerp(q.x, q.y, q.z, q.w, a.x, a.y, a.z, a.w, b.x, b.y, b.z, b.w, alpha[i]);
+		}
+	}, repeatCount, items);
+	time = TimeKernel([&]() { D3DMath_QuaternionSlerpBatch(quatOut.data(), quatA.data(), quatB.data(), alpha.data(), quatCount); }, repeatCount, items);
+	PrintKernel("slerp", "batch", items, referenceTime, time);
+
+	// Vecmat bulk routines against loops of the single-vector operations
+	const int vecCount = 8192;
+	std::vector<Vector> vecA(vecCount), vecB(vecCount), vecOut(vecCount);
+	for (int i = 0; i < vecCount; i++)
+	{
+		vecA[i].Set(random.Uniform() - 0.5, random.Uniform() - 0.5, random.Uniform() + 0.5);
+		vecB[i].Set(random.Uniform() - 0.5, random.Uniform() + 0.5, random.Uniform() - 0.5);
+	}
+	Matrix rot(mat._11, mat._12, mat._13, mat._21, mat._22, mat._23, mat._31, mat._32, mat._33);
+	items = vecCount;
+
+	referenceTime = TimeKernel([&]() {
+		for (int i = 0; i < vecCount; i++)
+		{
+			const Vector &v = vecA[i];
+			vecOut[i].Set(rot.m11 * v.x + rot.m12 * v.y + rot.m13 * v.z,
+				rot.m21 * v.x + rot.m22 * v.y + rot.m23 * v.z,
+				rot.m31 * v.x + rot.m32 * v.y + rot.m33 * v.z);
+		}
+	}, repeatCount, items);
+	time = TimeKernel([&]() { mul(rot, vecA.data(), vecOut.data(), vecCount); }, repeatCount, items);
+	PrintKernel("vec_mul", "bulk", items, referenceTime, time);
+
+	referenceTime = TimeKernel([&]() {
+		for (int i = 0; i < vecCount; i++) vecOut[i] = vecA[i] / vecA[i].length();
+	}, repeatCount, items);
+	time = TimeKernel([&]() { unify(vecA.data(), vecCount); }, repeatCount, items);
+	PrintKernel("vec_unify", "bulk", items, referenceTime, time);
+
+	referenceTime = TimeKernel([&]() {
+		for (int i = 0; i < vecCount; i++) vecOut[i] = crossp(vecA[i], vecB[i]);
+	}, repeatCount, items);
+	time = TimeKernel([&]() { crossp(vecA.data(), vecB.data(), vecOut.data(), vecCount); }, repeatCount, items);
+	PrintKernel("vec_crossp", "bulk", items, referenceTime, time);
+	return 0;
+}
+
+// Group on the heap with the given vertices (x, y, z, nx, ny, nz, u, v)
+// and indices, for the checks of -selftest.
+ExMeshGroup *MakeTestGroup(const float (*vtx)[8], int vertexCount, const int *idx, int indexCount)
+{
+	ExMeshGroup *group = new ExMeshGroup(nullptr, 0u);
+	group->VertexCount = vertexCount;
+	group->IndexCount = indexCount;
+	group->Positions = new vtx3[vertexCount];
+	group->Normals = new vtx3[vertexCount];
+	group->UVCoords = new vtx2[vertexCount];
+	group->Indices = new int[indexCount];
+	for (int i = 0; i < vertexCount; i++)
+	{
+		group->Positions[i] = { vtx[i][0], vtx[i][1], vtx[i][2] };
+		group->Normals[i] = { vtx[i][3], vtx[i][4], vtx[i][5] };
+		group->UVCoords[i] = { vtx[i][6], vtx[i][7] };
+	}
+	memcpy(group->Indices, idx, indexCount * sizeof(int));
+	return group;
+}
+
+// Check that every corner of group has the tangent of its face, that is
+// the direction of increasing u, and the sign of the face's UV orientation,
+// and that it still refers to the vertex it had in the source (x, y, z, nx,
+// ny, nz, u, v) with indices idx.
+bool CheckTangents(const ExMeshGroup &group, const float (*vtx)[8], const int *idx, std::ostream &log)
+{
+	for (int k = 0; k < group.IndexCount; k++)
+	{
+		int f = k / 3 * 3, i = group.Indices[k];
+		const float *a = vtx[idx[f]], *b = vtx[idx[f + 1]], *c = vtx[idx[f + 2]], *s = vtx[idx[k]];
+		if (group.Positions[i].x != s[0] || group.Positions[i].y != s[1] || group.Positions[i].z != s[2] ||
+			group.UVCoords[i].x != s[6] || group.UVCoords[i].y != s[7])
+		{
+			log << "\tcorner " << k << " refers to the wrong vertex\n";
+			return false;
+		}
+		float s1 = b[6] - a[6], t1 = b[7] - a[7], s2 = c[6] - a[6], t2 = c[7] - a[7];
+		float area = s1 * t2 - s2 * t1, u[3];
+		for (int j = 0; j < 3; j++) u[j] = (t2 * (b[j] - a[j]) - t1 * (c[j] - a[j])) / area;
+		float len = sqrtf(u[0] * u[0] + u[1] * u[1] + u[2] * u[2]);
+		const vtx4 &t = group.Tangents[i];
+		if ((t.x * u[0] + t.y * u[1] + t.z * u[2]) / len < 0.999f || t.w != (area > 0.0f ? 1.0f : -1.0f))
+		{
+			log << "\tcorner " << k << ": tangent (" << t.x << ", " << t.y << ", " << t.z << ", " << t.w << ")\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Tangents of two quads that share an edge, once with the UV coords of the
+// second quad mirrored along the edge, of a single quad, and of a single
+// quad with two unused vertices whose normals are NaN.  The shared vertices
+// must be split at the mirror seam and nowhere else, the NaN vertices must
+// stay as they are, and running the generator again must give the same
+// result.
+bool TestTangents(std::ostream &log)
+{
+	const float vtx[6][8] =
+	{
+		{ 0, 0, 0, 0, 0, 1, 0, 0 }, { 1, 0, 0, 0, 0, 1, 1, 0 }, { 1, 1, 0, 0, 0, 1, 1, 1 },
+		{ 0, 1, 0, 0, 0, 1, 0, 1 }, { 2, 0, 0, 0, 0, 1, 0, 0 }, { 2, 1, 0, 0, 0, 1, 0, 1 }
+	};
+	const float nanVtx[6][8] =
+	{
+		{ 0, 0, 0, 0, 0, 1, 0, 0 }, { 1, 0, 0, 0, 0, 1, 1, 0 }, { 1, 1, 0, 0, 0, 1, 1, 1 },
+		{ 0, 1, 0, 0, 0, 1, 0, 1 }, { 0, 0, 0, NAN, 0, 1, 0, 0 }, { 0, 0, 0, NAN, 0, 1, 0, 0 }
+	};
+	const int idx[12] = { 0, 1, 2, 0, 2, 3, 1, 4, 5, 1, 5, 2 };
+	bool passed = true;
+	for (int test = 0; test < 3 && passed; test++)
+	{
+		int quads = test == 1 ? 2 : 1;
+		ExMeshGroup *group = MakeTestGroup(test == 2 ? nanVtx : vtx, test ? 6 : 4, idx, quads * 6);
+		int expected = test == 1 ? 8 : test ? 6 : 4;
+		for (int run = 0; run < 2 && passed; run++)
+		{
+			if (!group->GenerateTangents() || group->VertexCount != expected)
+			{
+				log << "\tcase " << test + 1 << ", run " << run + 1 << ": " << group->VertexCount << " vertices instead of "
+					<< expected << '\n';
+				passed = false;
+			}
+			else passed = CheckTangents(*group, vtx, idx, log);
+		}
+		delete group;
+	}
+	return passed;
+}
+
+// Build name indices of 0 to 1000 names, with repeated and empty names,
+// and look up every name and a few that are not in the list.
+bool TestNameIndex(std::ostream &log)
+{
+	const int counts[4] = { 0, 1, 7, 1000 };
+	for (int c = 0; c < 4; c++)
+	{
+		StringPool strings;
+		std::vector<unsigned> names;
+		char name[32];
+		for (int i = 0; i < counts[c]; i++)
+		{
+			// every third name repeats an earlier one, every tenth is empty
+			sprintf(name, "group_%d", i % 3 == 2 ? i / 2 : i);
+			names.push_back(i % 10 == 9 ? 0 : strings.Add(name));
+		}
+		std::vector<int> section;
+		if (!BuildNameIndex(strings, names, section))
+		{
+			log << "\t" << counts[c] << " names: index not built\n";
+			return false;
+		}
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			if (!names[i]) continue;
+			int expected = (int)(std::find(names.begin(), names.end(), names[i]) - names.begin());
+			int found = CmshFindName(strings.Get(names[i]), section.data(), strings.Data());
+			if (found != expected)
+			{
+				log << "\t" << counts[c] << " names: \"" << strings.Get(names[i]) << "\" found at " << found
+					<< " instead of " << expected << '\n';
+				return false;
+			}
+		}
+		const char *missing[3] = { "", "group_", "group_1000" };
+		for (int i = 0; i < 3; i++)
+		{
+			if (CmshFindName(missing[i], section.data(), strings.Data()) != -1)
+			{
+				log << "\t" << counts[c] << " names: \"" << missing[i] << "\" found\n";
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Generate small tile sets facing out and in, with and without reduced
+// rows, and check that every triangle with an area winds around the vertex
+// normals the same way: cross(p1 - p0, p2 - p0) points to the side of the
+// normals.
+bool TestPatchWinding(std::ostream &log)
+{
+	for (int mode = 0; mode < 4; mode++)
+	{
+		PatchSet set = { 3, 3, 6, -1, (mode & 1) == 0, (mode & 2) == 0 };
+		set.BuildTables();
+		for (int t = 0; t < set.LatCount * set.LngCount; t++)
+		{
+			ExMesh *mesh = set.CreateTile(t / set.LngCount, t % set.LngCount);
+			if (!mesh)
+			{
+				log << "\ttile " << t << " not created\n";
+				return false;
+			}
+			const ExMeshGroup *group = mesh->GroupList[0];
+			for (int i = 0; i < group->IndexCount; i += 3)
+			{
+				const int *idx = group->Indices + i;
+				const vtx3 &p0 = group->Positions[idx[0]], &p1 = group->Positions[idx[1]], &p2 = group->Positions[idx[2]];
+				vtx3 u = { p1.x - p0.x, p1.y - p0.y, p1.z - p0.z }, v = { p2.x - p0.x, p2.y - p0.y, p2.z - p0.z };
+				vtx3 c = { u.y * v.z - u.z * v.y, u.z * v.x - u.x * v.z, u.x * v.y - u.y * v.x };
+				if (c.x * c.x + c.y * c.y + c.z * c.z < 1e-10f) continue;	// collapsed at the pole without reduce
+				float dot = 0;
+				for (int k = 0; k < 3; k++)
+				{
+					const vtx3 &n = group->Normals[idx[k]];
+					dot += c.x * n.x + c.y * n.y + c.z * n.z;
+				}
+				if (dot <= 0)
+				{
+					log << "\t" << (set.Outside ? "outside" : "inside") << (set.Reduce ? "" : " noreduce") << " tile " << t
+						<< ": triangle " << i / 3 << " faces away from its normals\n";
+					delete mesh;
+					return false;
+				}
+			}
+			delete mesh;
+		}
+	}
+	return true;
+}
+
+// Scale a group of 37 vertices, every fifth with a zero normal, with
+// ScaleGroup and with ReferenceScale, uniformly and non-uniformly, and
+// compare the results.  Zero normals must stay zero, the others agree
+// within rounding, as the vector path divides in single precision.
+bool TestScaleGroup(std::ostream &log)
+{
+	const int n = 37;
+	const float scales[2][3] = { { 2.0f, 2.0f, 2.0f }, { 2.0f, 1.0f, 0.5f } };
+	BenchRandom random = { 0x85EBCA6Bu };
+	NTVERTEX vtx[n];
+	for (int i = 0; i < n; i++)
+	{
+		vtx[i] = { random.Uniform(), random.Uniform(), random.Uniform(), random.Uniform() - 0.5f,
+			random.Uniform() - 0.5f, random.Uniform() + 0.5f, 0.5f, 0.5f };
+		float len = sqrtf(vtx[i].nx * vtx[i].nx + vtx[i].ny * vtx[i].ny + vtx[i].nz * vtx[i].nz);
+		if (i % 5 == 0) len = 0;
+		vtx[i].nx = len ? vtx[i].nx / len : 0.0f;
+		vtx[i].ny = len ? vtx[i].ny / len : 0.0f;
+		vtx[i].nz = len ? vtx[i].nz / len : 0.0f;
+	}
+	for (int s = 0; s < 2; s++)
+	{
+		const float *f = scales[s];
+		Mesh mesh;
+		mesh.AddGroup(vtx, n, nullptr, 0, SPEC_INHERIT, SPEC_INHERIT, 0, 0, true);
+		mesh.ScaleGroup(0, f[0], f[1], f[2]);
+		NTVERTEX ref[n];
+		memcpy(ref, vtx, sizeof(ref));
+		ReferenceScale(ref, n, f[0], f[1], f[2]);
+		const NTVERTEX *out = mesh.GetGroup(0)->Vtx;
+		for (int i = 0; i < n; i++)
+		{
+			const float a[6] = { out[i].x, out[i].y, out[i].z, out[i].nx, out[i].ny, out[i].nz };
+			const float b[6] = { ref[i].x, ref[i].y, ref[i].z, ref[i].nx, ref[i].ny, ref[i].nz };
+			for (int k = 0; k < 6; k++)
+				if (!(fabsf(a[k] - b[k]) <= 1e-6f) || (i % 5 == 0 && k >= 3 && a[k] != 0.0f))
+				{
+					log << "	scale (" << f[0] << ", " << f[1] << ", " << f[2] << "): vertex " << i << " component " << k
+						<< " is " << a[k] << " instead of " << b[k] << '\n';
+					return false;
+				}
+		}
+	}
+	return true;
+}
+
+// Apply the Vecmat bulk routines to 1003 vectors, a count that also runs
+// the scalar tail of the vector paths, in place and into separate arrays.
+// Every result must equal bit for bit that of the routine called for the
+// vector alone, and lie within 1e-14 of the single-vector operation, which
+// this file may compile with fused multiply-adds.
+bool TestVecmatBulk(std::ostream &log)
+{
+	const int n = 1003;
+	const double tolerance = 1e-14;
+	BenchRandom random = { 0x9E3779B9u };
+	std::vector<Vector> a(n), b(n), r(n), s(n);
+	std::vector<double> d(n);
+	for (int i = 0; i < n; i++)
+	{
+		a[i].Set(random.Uniform() * 4 - 2, random.Uniform() * 4 - 2, random.Uniform() * 4 - 2);
+		b[i].Set(random.Uniform() * 4 - 2, random.Uniform() * 4 - 2, random.Uniform() * 4 - 2);
+	}
+	Matrix A(0.36, 0.48, -0.8, -0.8, 0.6, 0.0, 0.48, 0.64, 0.6);
+	const char *failed = nullptr, *reason = nullptr;
+	int at = 0;
+
+	// all: result for all vectors, inPlace: the same in place, single: the
+	// routine for vector i alone, expected: the single-vector operation
+	auto check = [&](const char *name, int i, const Vector &all, const Vector &inPlace, const Vector &single,
+		const Vector &expected)
+	{
+		if (memcmp(&all, &single, sizeof(Vector)) || memcmp(&inPlace, &single, sizeof(Vector)))
+			reason = "differs from the result for the vector alone";
+		else if (!(fabs(single.x - expected.x) <= tolerance && fabs(single.y - expected.y) <= tolerance &&
+			fabs(single.z - expected.z) <= tolerance))
+			reason = "is not within 1e-14 of the single-vector operation";
+		else return;
+		failed = name;
+		at = i;
+	};
+	Vector single;
+	double singleDot;
+
+	mul(A, a.data(), r.data(), n);
+	s = a;
+	mul(A, s.data(), s.data(), n);
+	for (int i = 0; i < n && !failed; i++)
+	{
+		const Vector &v = a[i];
+		mul(A, &v, &single, 1);
+		check("mul", i, r[i], s[i], single, Vector(A.m11 * v.x + A.m12 * v.y + A.m13 * v.z,
+			A.m21 * v.x + A.m22 * v.y + A.m23 * v.z, A.m31 * v.x + A.m32 * v.y + A.m33 * v.z));
+	}
+
+	tmul(A, a.data(), r.data(), n);
+	s = a;
+	tmul(A, s.data(), s.data(), n);
+	for (int i = 0; i < n && !failed; i++)
+	{
+		const Vector &v = a[i];
+		tmul(A, &v, &single, 1);
+		check("tmul", i, r[i], s[i], single, Vector(A.m11 * v.x + A.m21 * v.y + A.m31 * v.z,
+			A.m12 * v.x + A.m22 * v.y + A.m32 * v.z, A.m13 * v.x + A.m23 * v.y + A.m33 * v.z));
+	}
+
+	s = a;
+	unify(s.data(), n);
+	for (int i = 0; i < n && !failed; i++)
+	{
+		single = a[i];
+		unify(&single, 1);
+		check("unify", i, s[i], s[i], single, a[i] / a[i].length());
+	}
+
+	dotp(a.data(), b.data(), d.data(), n);
+	for (int i = 0; i < n && !failed; i++)
+	{
+		dotp(&a[i], &b[i], &singleDot, 1);
+		check("dotp", i, Vector(d[i], 0, 0), Vector(d[i], 0, 0), Vector(singleDot, 0, 0), Vector(dotp(a[i], b[i]), 0, 0));
+	}
+
+	crossp(a.data(), b.data(), r.data(), n);
+	s = a;
+	crossp(s.data(), b.data(), s.data(), n);
+	for (int i = 0; i < n && !failed; i++)
+	{
+		crossp(&a[i], &b[i], &single, 1);
+		check("crossp", i, r[i], s[i], single, crossp(a[i], b[i]));
+	}
+
+	if (failed) log << "\t" << failed << ": vector " << at << ' ' << reason << '\n';
+	return !failed;
+}
+
+// A check of -selftest
+struct SelfTest
+{
+	const char *Name;
+	bool (*Run)(std::ostream &log);
+};
+
+const SelfTest SelfTests[] =
+{
+	{ "tangents", TestTangents },
+	{ "nameindex", TestNameIndex },
+	{ "patchwinding", TestPatchWinding },
+	{ "vecmatbulk", TestVecmatBulk },
+	{ "scale", TestScaleGroup },
+};
+
+// Run all checks of the compiler on built-in data and print one line per
+// check.  Returns 0 if all passed, or the error code for main.
+int RunSelfTest()
+{
+	int count = sizeof(SelfTests) / sizeof(SelfTests[0]), failed = 0;
+	for (int i = 0; i < count; i++)
+	{
+		std::ostringstream log;
+		bool passed = SelfTests[i].Run(log);
+		std::cout << (passed ? "PASS\t" : "FAIL\t") << SelfTests[i].Name << '\n' << log.str();
+		if (!passed) failed++;
+	}
+	std::cout << count - failed << " of " << count << " checks passed." << std::endl;
+	return failed ? -16 : 0;
+}
+
+int main(int argCount, char **argList)
+{
+	char *inputFile = nullptr;
+	char *outputFile = nullptr;
+
+	bool inputNext = false;
+	bool outputNext = false;
+	CompileOptions options;
+	bool patches = false;
+	PatchSet patchSet = { 0, 0, 0, -1, true, true };
+	bool patchArchive = false;
+	int threadCount = (int)std::thread::hardware_concurrency();
+	bool batch = false;
+	const char *benchSuite = nullptr;
+	const char *benchDir = nullptr;
+	std::vector<std::string> batchInputs;
+	const char *statsFile = nullptr;
+	const char *traceFile = nullptr;
+	RunStats stats;
+	TraceLog traceLog;
+
+	for (int i = 1; i < argCount; i++)
+	{
+		if (!inputNext && !outputNext)
+		{
+			if (strcmp(argList[i], "-s") == 0) options.StraightConvert = true;
+			else if (strcmp(argList[i], "-i") == 0) inputNext = true;
+			else if (strcmp(argList[i], "-o") == 0) outputNext = true;
+			else if (strcmp(argList[i], "-m") == 0) options.NoMatNames = true;
+			else if (strcmp(argList[i], "-q") == 0) options.Quiet = true;
+			else if ((strcmp(argList[i], "-stats") == 0 || strcmp(argList[i], "--stats") == 0) && i + 1 < argCount) statsFile = argList[++i];
+			else if ((strcmp(argList[i], "-trace") == 0 || strcmp(argList[i], "--trace") == 0) && i + 1 < argCount) traceFile = argList[++i];
+			else if (strcmp(argList[i], "-batch") == 0) batch = true;
+			else if (strcmp(argList[i], "-bench") == 0 && i + 1 < argCount)
+			{
+				benchSuite = argList[++i];
+				if (strcmp(benchSuite, "quick") != 0 && strcmp(benchSuite, "full") != 0 && strcmp(benchSuite, "kernels") != 0)
+				{
+					std::cout << "Error:  Unknown benchmark suite \"" << benchSuite << "\"." << std::endl;
+					return -12;
+				}
+			}
+			else if (strcmp(argList[i], "-benchdir") == 0 && i + 1 < argCount) benchDir = argList[++i];
+			else if (strcmp(argList[i], "-selftest") == 0) return RunSelfTest();
+			else if (strcmp(argList[i], "-strtab") == 0) options.StringTable = true;
+			else if (strcmp(argList[i], "-index") == 0) options.NameIndex = options.StringTable = true;
+			else if (strcmp(argList[i], "-layout") == 0 && i + 1 < argCount)
+			{
+				if (!ParseLayout(argList[++i], options.Layout))
+				{
+					std::cout << "Error:  Invalid layout \"" << argList[i] << "\"." << std::endl;
+					return -13;
+				}
+			}
+			else if (strcmp(argList[i], "-drop") == 0 && i + 2 < argCount)
+			{
+				if (!ParseDropRule(argList[i + 1], argList[i + 2], options.Layout))
+				{
+					std::cout << "Error:  Invalid parameters for \"-drop\"." << std::endl;
+					return -13;
+				}
+				i += 2;
+			}
+			else if (strcmp(argList[i], "-weld") == 0) options.WeldPositions = true;
+			else if (strcmp(argList[i], "-adjacency") == 0) options.BuildAdjacency = options.WeldPositions = true;
+			else if (strcmp(argList[i], "-bvh") == 0) options.BuildBvh = true;
+			else if (strcmp(argList[i], "-groupbvh") == 0) options.BuildGroupBvh = true;
+			else if (strcmp(argList[i], "-bvhbench") == 0 && i + 1 < argCount)
+			{
+				options.BuildBvh = true;
+				options.BvhQueries = atoi(argList[++i]);
+			}
+			else if (strcmp(argList[i], "-block") == 0 && i + 1 < argCount)
+			{
+				if (!SetBlock(argList[++i], options.Layout))
+				{
+					std::cout << "Error:  Block size must be a power of 2 between 2 and 64." << std::endl;
+					return -13;
+				}
+			}
+			else if (strcmp(argList[i], "-profile") == 0 && i + 1 < argCount)
+			{
+				if (!ReadLayoutProfile(argList[++i], options.Layout))
+				{
+					std::cout << "Error:  Could not read layout profile \"" << argList[i] << "\"." << std::endl;
+					return -13;
+				}
+			}
+			else if (strcmp(argList[i], "-format") == 0 && i + 1 < argCount)
+			{
+				options.Format = atoi(argList[++i]);
+				if (options.Format != 1 && options.Format != 2)
+				{
+					std::cout << "Error:  Unknown format version \"" << argList[i] << "\"." << std::endl;
+					return -12;
+				}
+			}
+			else if (strcmp(argList[i], "-align") == 0 && i + 1 < argCount)
+			{
+				i++;
+				options.Alignment = strcmp(argList[i], "page") == 0 ? 4096 : (uint32_t)atoi(argList[i]);
+				if (options.Alignment < 4 || options.Alignment > 65536 || (options.Alignment & (options.Alignment - 1)))
+				{
+					std::cout << "Error:  Alignment must be a power of 2 between 4 and 65536." << std::endl;
+					return -12;
+				}
+			}
+			else if (strcmp(argList[i], "-recalc") == 0) options.RecalcNormals = true;
+			else if (strcmp(argList[i], "-cleanup") == 0) options.Cleanup = true;
+			else if (strcmp(argList[i], "-patches") == 0 && i + 3 < argCount)
+			{
+				patches = true;
+				patchSet.LngCount = atoi(argList[++i]);
+				patchSet.LatCount = atoi(argList[++i]);
+				patchSet.Res = atoi(argList[++i]);
+				if (patchSet.LngCount < 1 || patchSet.LatCount < 1 || patchSet.Res < 1)
+				{
+					std::cout << "Error:  Invalid parameters for \"-patches\"." << std::endl;
+					return -15;
+				}
+			}
+			else if (strcmp(argList[i], "-bseg") == 0 && i + 1 < argCount)
+			{
+				patchSet.BandSegments = atoi(argList[++i]);
+				if (patchSet.BandSegments < 1)
+				{
+					std::cout << "Error:  Invalid parameters for \"-bseg\"." << std::endl;
+					return -15;
+				}
+			}
+			else if (strcmp(argList[i], "-noreduce") == 0) patchSet.Reduce = false;
+			else if (strcmp(argList[i], "-inside") == 0) patchSet.Outside = false;
+			else if (strcmp(argList[i], "-archive") == 0) patchArchive = true;
+			else if (strcmp(argList[i], "-j") == 0 && i + 1 < argCount) threadCount = atoi(argList[++i]);
+			else if (strcmp(argList[i], "-tangents") == 0) options.GenTangents = true;
+			else if (strcmp(argList[i], "-normals") == 0 && i + 1 < argCount)
+			{
+				i++;
+				if (strcmp(argList[i], "area") == 0) options.NormalWeight = Mesh::NMLWEIGHT_AREA;
+				else if (strcmp(argList[i], "fast") == 0) options.NormalWeight = Mesh::NMLWEIGHT_ANGLE_FAST;
+				else if (strcmp(argList[i], "exact") == 0) options.NormalWeight = Mesh::NMLWEIGHT_ANGLE;
+				else std::cout << "Warning:  Unknown normal weighting \"" << argList[i] << "\"." << std::endl;
+			}
+			else if (strcmp(argList[i], "-crease") == 0 && i + 1 < argCount) options.CreaseAngle = (float)atof(argList[++i]);
+			else if (strcmp(argList[i], "-dedup") == 0) options.Dedup = true;
+			else if (strcmp(argList[i], "-merge") == 0) options.MergeGroups = true;
+			else if (strcmp(argList[i], "-keep") == 0 && i + 1 < argCount) options.MergeDeny.push_back(argList[++i]);
+			else if (strcmp(argList[i], "-allow") == 0 && i + 1 < argCount) options.MergeAllow.push_back(argList[++i]);
+			else if (strcmp(argList[i], "-keepflags") == 0 && i + 1 < argCount) options.MergeKeepFlags = (unsigned)strtoul(argList[++i], nullptr, 16);
+			else if (strcmp(argList[i], "-transform") == 0 && i + 1 < argCount)
+			{
+				if (!ReadTransformSpec(argList[++i], options.Transforms))
+				{
+					std::cout << "Error:  Could not read transform spec \"" << argList[i] << "\"." << std::endl;
+					return -7;
+				}
+			}
+			else if (argList[i][0] == '-' && (strcmp(argList[i] + 1, "scale") == 0 || strcmp(argList[i] + 1, "translate") == 0 ||
+				strcmp(argList[i] + 1, "rotate") == 0 || strcmp(argList[i] + 1, "texscale") == 0))
+			{
+				TransformStep step;
+				int count = ParseTransform(argList[i] + 1, argList + i + 1, argCount - i - 1, step);
+				if (count < 0)
+				{
+					std::cout << "Error:  Invalid parameters for \"" << argList[i] << "\"." << std::endl;
+					return -7;
+				}
+				options.Transforms.push_back(step);
+				i += count;
+			}
+			else if (batch && argList[i][0] == '@')
+			{
+				if (!ReadInputList(argList[i] + 1, batchInputs))
+				{
+					std::cout << "Error:  Could not read input list \"" << argList[i] + 1 << "\"." << std::endl;
+					return -3;
+				}
+			}
+			else if (batch) batchInputs.push_back(argList[i]);
+			else if (!inputFile) inputFile = argList[i];
+			else if (!outputFile) outputFile = argList[i];
+		}
+		else
+		{
+			if (inputNext)
+			{
+				inputNext = false;
+				if (batch) batchInputs.push_back(argList[i]);
+				else inputFile = argList[i];
+			}
+			else if (outputNext)
+			{
+				outputNext = false;
+				outputFile = argList[i];
+			}
+		}
+	}
+
+	if (batch && outputFile)
+	{
+		std::cout << "Error:  \"-o\" cannot be used with \"-batch\"." << std::endl;
+		return -1;
+	}
+
+	// Heap allocations are only counted for the report.  A report on the
+	// console implies -q, and the remaining messages go to stderr, so that
+	// the console output is the JSON alone.
+	if (statsFile) RunStats::CountHeapAllocations();
+	bool statsToConsole = statsFile && strcmp(statsFile, "-") == 0;
+	if (statsToConsole) options.Quiet = true;
+	std::ostream &console = statsToConsole ? std::cerr : std::cout;
+
+	if (benchSuite && strcmp(benchSuite, "kernels") == 0) return RunKernelBenchmark();
+	if (benchSuite) return RunBenchmark(options, strcmp(benchSuite, "full") == 0, benchDir);
+
+	if (!inputFile && !patches && batchInputs.empty())
+	{
+		std::cout << "Usage:" << std::endl;
+		std::cout << "\t-i:\tInput File" << std::endl;
+		std::cout << "\t-o:\tOutput File" << std::endl;
+		std::cout << "\t-m:\tDo Not Preserve Material Names" << std::endl;
+		std::cout << "\t-s:\tAll Vertex Elements in Single Array" << std::endl;
+		std::cout << "\t-strtab:\tWrite Names to a Shared String Table" << std::endl;
+		std::cout << "\t-index:\tWrite Hash Index of Group Labels and Material Names" << std::endl;
+		std::cout << "\t-format <1|2>:\tOutput Format Version" << std::endl;
+		std::cout << "\t-align <n|page>:\tArray Alignment in Bytes (Format 2)" << std::endl;
+		std::cout << "\t-layout <streams>:\tVertex Streams, e.g. p,nu (Format 2)" << std::endl;
+		std::cout << "\t-drop <attributes> <nonormal|hex>:\tDrop Attributes From Groups (Format 2)" << std::endl;
+		std::cout << "\t-profile <file>:\tRead Vertex Layout From Profile (Format 2)" << std::endl;
+		std::cout << "\t-block <n>:\tStore Vertices in Blocks of <n> (Format 2)" << std::endl;
+		std::cout << "\t-weld:\tAdd Welded Position-Only Geometry (Format 2)" << std::endl;
+		std::cout << "\t-adjacency:\tAdd Edge Adjacency for Shadow Volumes (Format 2)" << std::endl;
+		std::cout << "\t-bvh:\tAdd Triangle BVH for Ray and Sphere Queries (Format 2)" << std::endl;
+		std::cout << "\t-bvhbench <n>:\tAdd BVH and Time <n> Queries Against Brute Force (Format 2)" << std::endl;
+		std::cout << "\t-groupbvh:\tAdd Hierarchy Over Group Bounds for Culling (Format 2)" << std::endl;
+		std::cout << "\t-normals <area|fast|exact>:\tNormal Weighting" << std::endl;
+		std::cout << "\t-crease <deg>:\tSplit Normals Along Edges Sharper Than <deg>" << std::endl;
+		std::cout << "\t-recalc:\tRecalculate All Normals" << std::endl;
+		std::cout << "\t-cleanup:\tRemove Degenerate and Duplicate Triangles and Unused Vertices" << std::endl;
+		std::cout << "\t-tangents:\tGenerate Tangents" << std::endl;
+		std::cout << "\t-scale <sx> <sy> <sz>:\tScale Mesh" << std::endl;
+		std::cout << "\t-translate <dx> <dy> <dz>:\tTranslate Mesh" << std::endl;
+		std::cout << "\t-rotate <x|y|z> <deg>:\tRotate Mesh" << std::endl;
+		std::cout << "\t-texscale <su> <sv>:\tScale Texture Coordinates" << std::endl;
+		std::cout << "\t-transform <file>:\tApply Transforms From Spec File" << std::endl;
+		std::cout << "\t-dedup:\tRemove Duplicate and Unused Materials and Textures" << std::endl;
+		std::cout << "\t-merge:\tMerge Groups With Identical Render State" << std::endl;
+		std::cout << "\t-keep <label|*>:\tDo Not Merge Group(s) With Label" << std::endl;
+		std::cout << "\t-allow <label>:\tAllow Merging Group With Label" << std::endl;
+		std::cout << "\t-keepflags <hex>:\tDo Not Merge Groups With User Flags" << std::endl;
+		std::cout << "\t-patches <nlng> <nlat> <res>:\tGenerate Sphere Patch Tiles Instead of Reading a File" << std::endl;
+		std::cout << "\t-bseg <n>:\tLongitude Segments of a Patch" << std::endl;
+		std::cout << "\t-noreduce:\tDo Not Reduce Segments Towards the Pole" << std::endl;
+		std::cout << "\t-inside:\tGenerate Patches Facing the Centre" << std::endl;
+		std::cout << "\t-archive:\tWrite All Patches to One Archive" << std::endl;
+		std::cout << "\t-j <n>:\tNumber of Threads" << std::endl;
+		std::cout << "\t-q:\tQuiet, Do Not List Groups" << std::endl;
+		std::cout << "\t-stats <file|->:\tWrite Timing and Memory Report as JSON" << std::endl;
+		std::cout << "\t-batch <files|@list>:\tCompile Each Input File, on -j Threads" << std::endl;
+		std::cout << "\t-trace <file>:\tWrite Timeline of Files and Phases as Chrome Trace JSON" << std::endl;
+		std::cout << "\t-bench <quick|full|kernels>:\tTime Parse, Convert and Write of Synthetic Meshes, or the Vertex Kernels" << std::endl;
+		std::cout << "\t-benchdir <dir>:\tAlso Write the Synthetic Meshes of -bench to <dir>" << std::endl;
+		std::cout << "\t-selftest:\tRun the Built-In Checks" << std::endl << std::endl;
+		return 0;
+	}
+
+	ResolveLayout(options);
+
+	// Format 2 structures are written as they are in memory.
+	if (options.Format == 2 && !Cmsh2LittleEndianHost())
+	{
+		std::cout << "Error:  Format 2 can only be written on little-endian hosts." << std::endl;
+		return -1;
+	}
+
+	TraceLog *trace = traceFile ? &traceLog : nullptr;
+	if (patches)
+	{
+		// Rows of a reduced tile have bseg - i segments for i up to res.
+		if (patchSet.Reduce && patchSet.BandSegments >= 0 && patchSet.BandSegments < patchSet.Res)
+		{
+			std::cout << "Error:  \"-bseg\" must be at least <res> unless \"-noreduce\" is given." << std::endl;
+			return -15;
+		}
+		int result;
+		{
+			PhaseTimer timer(stats, "patches", trace);
+			result = GeneratePatches(patchSet, outputFile ? outputFile : "patch", patchArchive, threadCount,
+				options.Format, options.Alignment, options.Layout, options.StraightConvert, options.GenTangents, options.Quiet, trace);
+		}
+		stats.Set("tiles", patchSet.LatCount * patchSet.LngCount);
+		stats.Set("threads", threadCount);
+		stats.Set("tiles_per_second", patchSet.LatCount * patchSet.LngCount / stats.Seconds());
+		if (!result && statsFile && !WriteStats(stats, statsFile)) return -5;
+		if (trace && !WriteTrace(traceLog, traceFile)) return -5;
+		return result;
+	}
+
+	int result;
+	if (batch) result = CompileBatch(options, batchInputs, threadCount, stats, trace, console);
+	else
+	{
+		// The vertex and index lists of both meshes come from one arena,
+		// released when main returns.
+		Arena arena;
+		result = CompileMesh(options, inputFile, outputFile, arena, stats, trace, console);
+		stats.Set("arena_chunks", (double)arena.ChunkCount());
+	}
+
+	if (statsFile && (batch || !result))
+	{
+		double seconds = stats.Seconds();
+		stats.Set("vertices_per_second", stats.Get("vertices") / seconds);
+		stats.Set("input_mb_per_second", stats.Get("input_bytes") / 1e6 / seconds);
+		if (!WriteStats(stats, statsFile) && !result) result = -5;
+	}
+	if (trace && !WriteTrace(traceLog, traceFile) && !result) result = -5;
+
+	return result;
 }